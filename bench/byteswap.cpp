@@ -0,0 +1,82 @@
+/** Times each byte swap kernel the CPU supports, in GB/s of input, on a
+ *  buffer the size of one CT frame, which stays in cache, and on one the size
+ *  of a whole volume, which does not
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "auxiliary.h"
+
+
+static const char *const isa_names[] = { "scalar", "SSSE3", "AVX2" };
+
+
+/** Swaps @p src into @p dst as @p width bit elements, over and over for
+ *  about @p secs seconds. Returns the rate */
+static double time_kernel(int width, tomo::isa which, const std::vector<char> &src,
+                          std::vector<char> &dst, double secs)
+{
+    using clock = std::chrono::steady_clock;
+    const auto t0 = clock::now();
+    double s;
+    size_t reps = 0;
+
+    do {
+        if (width == 16) {
+            tomo::byteswap16(src.data(), dst.data(), src.size() / 2, which);
+        } else {
+            tomo::byteswap32(src.data(), dst.data(), src.size() / 4, which);
+        }
+        reps++;
+        s = std::chrono::duration<double>(clock::now() - t0).count();
+    } while (s < secs);
+    return (double)src.size() * reps / s / 1e9;
+}
+
+
+static int bench(size_t len, double secs)
+{
+    std::vector<char> src(len), dst(len), ref(len);
+    std::mt19937 rng(1);
+    int i;
+
+    for (auto &c: src) {
+        c = (char)rng();
+    }
+    printf("%zu bytes:\n", len);
+    for (int width: { 16, 32 }) {
+        printf("  %d-bit:", width);
+        for (i = 0; i <= (int)tomo::native_isa(); i++) {
+            const double rate = time_kernel(width, (tomo::isa)i, src, dst, secs);
+
+            /* Every kernel has to agree with the scalar one */
+            if (!i) {
+                ref = dst;
+            } else if (dst != ref) {
+                fprintf(stderr, "\n%s %d-bit kernel is wrong\n", isa_names[i], width);
+                return 1;
+            }
+            printf(" %s %.1f GB/s%s", isa_names[i], rate, i < (int)tomo::native_isa() ? "," : "\n");
+        }
+    }
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    double secs = 0.5;
+
+    if (argc > 2 || (argc == 2 && (secs = atof(argv[1])) <= 0)) {
+        fprintf(stderr, "Usage: %s [SECONDS]\n"
+                        "Times each byte swap kernel for SECONDS (default 0.5) per size\n", argv[0]);
+        return 1;
+    }
+    /* A 512 by 512 CT frame, then a 300-slice volume of them */
+    return bench(512 * 512 * 2, secs) || bench((size_t)300 * 512 * 512 * 2, secs);
+}
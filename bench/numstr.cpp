@@ -0,0 +1,127 @@
+/** Times formatting multi-valued DS attributes through a std::stringstream,
+ *  as dicom.h used to, and through snprintf, as the CT slices used to, against
+ *  the to_chars functions in numstr.h
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "numstr.h"
+
+
+/** Total length of what it made, so that none of it is optimized away */
+static size_t sink_len;
+
+
+/** Best of 5 runs of @p fmt over @p n rows, in milliseconds */
+template <class FuncT>
+static double best_of(size_t n, FuncT fmt)
+{
+    using clock = std::chrono::steady_clock;
+    double best = 1e300, ms;
+    size_t i;
+
+    for (int rep = 0; rep < 5; rep++) {
+        auto t0 = clock::now();
+
+        for (i = 0; i < n; i++) {
+            sink_len += fmt(i).size();
+        }
+        ms = std::chrono::duration<double, std::milli>(clock::now() - t0).count();
+        best = std::min(best, ms);
+    }
+    return best;
+}
+
+
+/** The old insert_wrap, with and without a fixed precision */
+static std::string join_stream(size_t n, const float x[], int precision = -1)
+{
+    std::stringstream ss;
+
+    if (precision >= 0) {
+        ss << std::setprecision(precision) << std::fixed;
+    }
+    if (n) {
+        ss << *x++;
+        while (--n) {
+            ss << '\\' << *x++;
+        }
+    }
+    return ss.str();
+}
+
+
+static void report(const char *what, double old_ms, const char *old_name, double new_ms, const char *new_name)
+{
+    printf("%s:\n", what);
+    printf("  %-22s %8.1f ms\n", old_name, old_ms);
+    printf("  %-22s %8.1f ms, %.1fx\n", new_name, new_ms, old_ms / new_ms);
+}
+
+
+int main(int argc, char *argv[])
+{
+    const size_t ncontours = 2000, ncoords = 1200, nslices = 1000000;
+    std::uniform_real_distribution<float> coord(-300.0f, 300.0f);
+    std::vector<float> contours(ncontours * ncoords);
+    std::vector<float> slices(3 * nslices);
+    std::mt19937 rng(1);
+    double old_ms, new_ms;
+
+    if (argc > 1) {
+        fprintf(stderr, "Usage: %s\n"
+                        "Times DS formatting of ContourData and ImagePositionPatient\n", argv[0]);
+        return 1;
+    }
+    for (auto &x: contours) {
+        x = coord(rng);
+    }
+    for (auto &x: slices) {
+        x = coord(rng);
+    }
+
+    /* Every string has to match before any of it is timed */
+    for (size_t i = 0; i < ncontours; i++) {
+        const float *x = &contours[i * ncoords];
+        std::string out(ncoords * (tomo::ds_len + 1), '\0');
+
+        out.resize(tomo::join_fixed(out.data(), ncoords, x, 3) - out.data());
+        if (join_stream(ncoords, x, 3) != tomo::join_numbers(ncoords, x, 3) || out != tomo::join_numbers(ncoords, x, 3)) {
+            fprintf(stderr, "Fixed-point ContourData differs from the stringstream's\n");
+            return 1;
+        }
+    }
+
+    printf("ContourData, %zu contours of %zu values each\n", ncontours, ncoords);
+    old_ms = best_of(ncontours, [&](size_t i) { return join_stream(ncoords, &contours[i * ncoords], 3); });
+    new_ms = best_of(ncontours, [&](size_t i) { return tomo::join_numbers(ncoords, &contours[i * ncoords], 3); });
+    report("3 decimals", old_ms, "stringstream fixed", new_ms, "join_numbers");
+    new_ms = best_of(ncontours, [&](size_t i) {
+        std::string out(ncoords * (tomo::ds_len + 1), '\0');
+
+        out.resize(tomo::join_fixed(out.data(), ncoords, &contours[i * ncoords], 3) - out.data());
+        return out;
+    });
+    report("3 decimals, in bulk", old_ms, "stringstream fixed", new_ms, "join_fixed");
+    old_ms = best_of(ncontours, [&](size_t i) { return join_stream(ncoords, &contours[i * ncoords]); });
+    new_ms = best_of(ncontours, [&](size_t i) { return tomo::join_numbers(ncoords, &contours[i * ncoords]); });
+    report("Shortest", old_ms, "stringstream", new_ms, "join_numbers");
+
+    printf("ImagePositionPatient, %zu slices\n", nslices);
+    old_ms = best_of(nslices, [&](size_t i) {
+        char buf[64];
+
+        snprintf(buf, sizeof buf, "%g\\%g\\%g", slices[3 * i], slices[3 * i + 1], slices[3 * i + 2]);
+        return std::string(buf);
+    });
+    new_ms = best_of(nslices, [&](size_t i) { return tomo::join_numbers(3, &slices[3 * i]); });
+    report("Per slice", old_ms, "snprintf %g", new_ms, "join_numbers");
+    return sink_len == 0;
+}
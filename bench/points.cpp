@@ -0,0 +1,113 @@
+/** Times parsing ROI pointData text the way structures.cpp used to, with
+ *  strtod and a push_back per value, against tomo::parse_triplets into a
+ *  pre-sized buffer. Both include the centimeter to millimeter and axis flip
+ *  that construct_point_data applies afterwards
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <array>
+#include <chrono>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "auxiliary.h"
+
+
+static float pop_float(const char *text, char **endptr, char delim)
+{
+    float res;
+
+    res = 10.0f * (float)strtod(text, endptr);
+    if (**endptr != delim) {
+        throw std::runtime_error("Malformed ROI curve triplet");
+    }
+    return res;
+}
+
+
+/** The old parse_triplet and construct_point_data together */
+static void parse_strtod(const char *text, std::vector<float> &out)
+{
+    std::array<float, 3> trip;
+    char *endptr;
+
+    while (text) {
+        trip[0] = pop_float(text, &endptr, ',');
+        trip[1] = -pop_float(endptr + 1, &endptr, ',');
+        trip[2] = -pop_float(endptr + 1, &endptr, ';');
+        while (isspace(*++endptr)) { }
+        text = (*endptr) ? endptr : nullptr;
+        for (float x: trip) {
+            out.push_back(x);
+        }
+    }
+}
+
+
+static void parse_from_chars(const std::string &text, std::vector<float> &out)
+{
+    size_t i;
+
+    tomo::parse_triplets(text, out);
+    for (i = 0; i + 3 <= out.size(); i += 3) {
+        out[i] *= 10.0f;
+        out[i + 1] *= -10.0f;
+        out[i + 2] *= -10.0f;
+    }
+}
+
+
+/** Best of @p reps runs, in milliseconds */
+template <class FuncT>
+static double best_of(int reps, std::vector<float> &out, FuncT parse)
+{
+    using clock = std::chrono::steady_clock;
+    double best = 1e300, ms;
+
+    while (reps--) {
+        std::vector<float>().swap(out);
+        auto t0 = clock::now();
+        parse(out);
+        ms = std::chrono::duration<double, std::milli>(clock::now() - t0).count();
+        best = std::min(best, ms);
+    }
+    return best;
+}
+
+
+int main(int argc, char *argv[])
+{
+    const size_t n = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+    std::uniform_real_distribution<float> coord(-30.0f, 30.0f);
+    std::vector<float> old_pts, new_pts;
+    std::mt19937 rng(1);
+    std::string text;
+    double old_ms, new_ms;
+    char buf[64];
+    size_t i;
+
+    if (!n) {
+        fprintf(stderr, "Usage: %s [TRIPLETS]\n"
+                        "Times parsing TRIPLETS (default 1000000) random contour points\n", argv[0]);
+        return 1;
+    }
+    /* As the archives spell them, in centimeters */
+    for (i = 0; i < n; i++) {
+        snprintf(buf, sizeof buf, "%.6g,%.6g,%.6g; ", coord(rng), coord(rng), coord(rng));
+        text += buf;
+    }
+
+    old_ms = best_of(5, old_pts, [&text](auto &out) { parse_strtod(text.c_str(), out); });
+    new_ms = best_of(5, new_pts, [&text](auto &out) { parse_from_chars(text, out); });
+    if (old_pts != new_pts) {
+        fprintf(stderr, "The two parsers disagree\n");
+        return 1;
+    }
+    printf("%zu triplets, %zu bytes of text:\n", n, text.size());
+    printf("  strtod + push_back     %8.1f ms, %6.1f MB/s\n", old_ms, text.size() / old_ms / 1e3);
+    printf("  parse_triplets         %8.1f ms, %6.1f MB/s\n", new_ms, text.size() / new_ms / 1e3);
+    return 0;
+}
@@ -1,8 +1,16 @@
 #include <iostream>
 #include <cstring>
+#include <fstream>
 #include <map>
+#include <optional>
+#include <vector>
 #include "src/archive.h"
+#include "src/scheduler.h"
+#include "src/sink.h"
 #include "src/log.h"
+#include "src/lookup/lookup.h"
+#include "src/mrncache.h"
+#include "src/dicom/storesink.h"
 
 #define PROGNAME "tomoconv"
 
@@ -41,17 +49,30 @@ class args {
     int argc, argi;
     char **argv;
 
-    std::filesystem::path xml;  /* The only unqualified argument. Parsing stops
-                                when this is read */
+    std::vector<std::filesystem::path> xmls;    /* Every unqualified argument,
+                                                plus the contents of each -f */
 
     std::filesystem::path dir;  /* The argument to -o, --out-dir */
     bool no_lookup;             /* -s, --skip-mrn */
+    bool mrn_pipe;              /* --mrn-pipeline */
+    bool no_mrn_cache;          /* --no-mrn-cache */
+    unsigned mrn_ttl;           /* --mrn-ttl, in hours */
+    unsigned mrn_negttl;        /* --mrn-negative-ttl, in minutes */
+    unsigned mrn_wait;          /* --mrn-timeout, in seconds */
+    std::optional<tomo::storepeer> peer;    /* --send */
+    std::string calling;        /* --calling-ae */
+    unsigned nassoc;            /* --associations */
     bool testing_only;          /* If -t, --test is passed */
-    bool found_path;            /* I could use a std::optional but not gonna */
+    bool use_snapshot;          /* --snapshot */
 
     const char *host;
     uint16_t port;
 
+    unsigned njobs;             /* -j, --jobs */
+    size_t iobudget;            /* -b, --io-budget, in bytes */
+
+    tomo::selection sel;        /* -d, --disease, --only and --multiframe */
+
     tomo::log::level lthresh;   /* Logging level override */
 
     enum type {
@@ -69,6 +90,17 @@ class args {
     bool read_hostname() noexcept;
     bool read_port() noexcept;
     bool read_loglvl() noexcept;
+    bool read_jobs() noexcept;
+    bool read_budget() noexcept;
+    bool read_ttl() noexcept;
+    bool read_negative_ttl() noexcept;
+    bool read_mrn_timeout() noexcept;
+    void read_send();
+    bool read_associations() noexcept;
+    void read_calling_ae();
+    void read_disease();
+    void read_only();
+    void read_list();
 
     void read_short();
     void read_long();
@@ -79,18 +111,34 @@ public:
 
     void parse();
 
-    const std::filesystem::path &xml_path() const noexcept { return xml; }
+    const std::vector<std::filesystem::path> &xml_paths() const noexcept { return xmls; }
     const std::filesystem::path &out_path() const noexcept { return dir; }
 
     bool testing() const noexcept { return testing_only; }
+    bool snapshot() const noexcept { return use_snapshot; }
 
     /* This method name is confusing, considering the variable it refs */
     bool skip_lookup() const noexcept { return no_lookup; }
 
     const char *mrn_hostname() const noexcept { return host; }
     uint16_t mrn_port() const noexcept { return port; }
+    bool mrn_pipeline() const noexcept { return mrn_pipe; }
+    bool mrn_cache() const noexcept { return !no_mrn_cache; }
+    std::chrono::hours mrn_cache_ttl() const noexcept { return std::chrono::hours(mrn_ttl); }
+    std::chrono::minutes mrn_negative_ttl() const noexcept { return std::chrono::minutes(mrn_negttl); }
+    std::chrono::seconds mrn_timeout() const noexcept { return std::chrono::seconds(mrn_wait); }
+
+    /** The storage SCP to send to instead of writing files, if any */
+    const std::optional<tomo::storepeer> &store_peer() const noexcept { return peer; }
+    const std::string &calling_ae() const noexcept { return calling; }
+    unsigned associations() const noexcept { return nassoc; }
 
     tomo::log::level loglvl() const noexcept { return lthresh; }
+
+    unsigned jobs() const noexcept { return njobs; }
+    size_t io_budget() const noexcept { return iobudget; }
+
+    const tomo::selection &selection() const noexcept { return sel; }
 };
 
 
@@ -163,6 +211,140 @@ bool args::read_loglvl() noexcept
 }
 
 
+bool args::read_jobs() noexcept
+{
+    const char *arg;
+
+    arg = next();
+    if (arg && argtype(arg) == ARG) {
+        njobs = std::max(atoi(arg), 0);
+        return true;
+    }
+    return false;
+}
+
+
+/** The argument is in MiB, and is at least one */
+bool args::read_budget() noexcept
+{
+    const char *arg;
+
+    arg = next();
+    if (arg && argtype(arg) == ARG) {
+        iobudget = (size_t)std::max(atoi(arg), 1) << 20;
+        return true;
+    }
+    return false;
+}
+
+
+/** The argument is in hours. Zero turns the cache off */
+bool args::read_ttl() noexcept
+{
+    const char *arg;
+
+    arg = next();
+    if (arg && argtype(arg) == ARG) {
+        mrn_ttl = std::max(atoi(arg), 0);
+        return true;
+    }
+    return false;
+}
+
+
+/** The argument is in minutes. Zero caches no "NOT FOUND" or ambiguous reply */
+bool args::read_negative_ttl() noexcept
+{
+    const char *arg;
+
+    arg = next();
+    if (arg && argtype(arg) == ARG) {
+        mrn_negttl = std::max(atoi(arg), 0);
+        return true;
+    }
+    return false;
+}
+
+
+/** The argument is in seconds. Zero waits as long as the system does */
+bool args::read_mrn_timeout() noexcept
+{
+    const char *arg;
+
+    arg = next();
+    if (arg && argtype(arg) == ARG) {
+        mrn_wait = std::max(atoi(arg), 0);
+        return true;
+    }
+    return false;
+}
+
+
+void args::read_send()
+{
+    const char *arg;
+
+    arg = next();
+    if (!arg || argtype(arg) != ARG) {
+        throw std::runtime_error("Option --send requires an argument");
+    }
+    peer = tomo::storepeer::parse(arg);
+}
+
+
+/** At least one */
+bool args::read_associations() noexcept
+{
+    const char *arg;
+
+    arg = next();
+    if (arg && argtype(arg) == ARG) {
+        nassoc = std::max(atoi(arg), 1);
+        return true;
+    }
+    return false;
+}
+
+
+void args::read_calling_ae()
+{
+    const char *arg;
+
+    arg = next();
+    if (!arg || argtype(arg) != ARG) {
+        throw std::runtime_error("Option --calling-ae requires an argument");
+    }
+    if (!*arg || strlen(arg) > 16) {
+        throw std::runtime_error("An AE title is 1 to 16 characters, not "s + arg);
+    }
+    calling = arg;
+}
+
+
+void args::read_disease()
+{
+    const char *arg;
+
+    arg = next();
+    if (!arg || argtype(arg) != ARG) {
+        throw std::runtime_error("Option --disease requires an argument");
+    }
+    sel.add_disease(arg);
+}
+
+
+void args::read_only()
+{
+    const char *arg;
+
+    arg = next();
+    if (!arg || argtype(arg) != ARG) {
+        throw std::runtime_error("Option --only requires an argument");
+    }
+    sel.only(arg);
+}
+
+
 void args::read_short()
 {
     const char *arg = argv[argi] + 1;
@@ -205,6 +387,32 @@ void args::read_short()
                 }
             }
             throw std::runtime_error("Short option -l requires an argument");
+        case 'j':
+            if (nopt == 1) {
+                if (read_jobs()) {
+                    return;
+                }
+            }
+            throw std::runtime_error("Short option -j requires an argument");
+        case 'b':
+            if (nopt == 1) {
+                if (read_budget()) {
+                    return;
+                }
+            }
+            throw std::runtime_error("Short option -b requires an argument");
+        case 'f':
+            if (nopt == 1) {
+                read_list();
+                return;
+            }
+            throw std::runtime_error("Short option -f requires an argument");
+        case 'd':
+            if (nopt == 1) {
+                read_disease();
+                return;
+            }
+            throw std::runtime_error("Short option -d requires an argument");
         default:
             tomo::log::printf(tomo::log::WARN, "Unrecognized short option %c", *arg);
             break;
@@ -222,7 +430,22 @@ void args::read_long()
         { "host"s, 2 },
         { "port"s, 3 },
         { "skip-mrn"s, 4 },
-        { "log-lvl", 5 }
+        { "log-lvl", 5 },
+        { "jobs", 6 },
+        { "file-list", 7 },
+        { "io-budget", 8 },
+        { "disease", 9 },
+        { "only", 10 },
+        { "snapshot", 11 },
+        { "multiframe", 12 },
+        { "mrn-pipeline", 13 },
+        { "no-mrn-cache", 14 },
+        { "mrn-ttl", 15 },
+        { "mrn-timeout", 16 },
+        { "send", 17 },
+        { "associations", 18 },
+        { "calling-ae", 19 },
+        { "mrn-negative-ttl", 20 }
     };
     const char *arg = argv[argi] + 2;
     map_t::const_iterator it;
@@ -256,6 +479,63 @@ void args::read_long()
                 throw std::runtime_error("Option --log-lvl requires an argument");
             }
             break;
+        case 6:
+            if (!read_jobs()) {
+                throw std::runtime_error("Option --jobs requires an argument");
+            }
+            break;
+        case 7:
+            read_list();
+            break;
+        case 8:
+            if (!read_budget()) {
+                throw std::runtime_error("Option --io-budget requires an argument");
+            }
+            break;
+        case 9:
+            read_disease();
+            break;
+        case 10:
+            read_only();
+            break;
+        case 11:
+            use_snapshot = true;
+            break;
+        case 12:
+            sel.multiframe(true);
+            break;
+        case 13:
+            mrn_pipe = true;
+            break;
+        case 14:
+            no_mrn_cache = true;
+            break;
+        case 15:
+            if (!read_ttl()) {
+                throw std::runtime_error("Option --mrn-ttl requires an argument");
+            }
+            break;
+        case 16:
+            if (!read_mrn_timeout()) {
+                throw std::runtime_error("Option --mrn-timeout requires an argument");
+            }
+            break;
+        case 17:
+            read_send();
+            break;
+        case 18:
+            if (!read_associations()) {
+                throw std::runtime_error("Option --associations requires an argument");
+            }
+            break;
+        case 19:
+            read_calling_ae();
+            break;
+        case 20:
+            if (!read_negative_ttl()) {
+                throw std::runtime_error("Option --mrn-negative-ttl requires an argument");
+            }
+            break;
         default:
             unreachable();
             break;
@@ -266,11 +546,38 @@ void args::read_long()
 }
 
 
+/** Reads the argument to -f, --file-list: one archive XML path per line. Blank
+ *  lines and lines starting with '#' are skipped
+ */
+void args::read_list()
+{
+    const char *arg;
+    std::ifstream list;
+    std::string line;
+    size_t begin, end;
+
+    arg = next();
+    if (!arg || argtype(arg) != ARG) {
+        throw std::runtime_error("Option --file-list requires an argument");
+    }
+    list.open(arg);
+    if (!list) {
+        throw std::runtime_error("Cannot open file list "s + arg);
+    }
+    while (std::getline(list, line)) {
+        begin = line.find_first_not_of(" \t\r");
+        if (begin == line.npos || line[begin] == '#') {
+            continue;
+        }
+        end = line.find_last_not_of(" \t\r");
+        xmls.emplace_back(line.substr(begin, end - begin + 1));
+    }
+}
+
+
 void args::read_arg()
 {
-    xml = argv[argi];
-    found_path = true;
-    argi = argc - 1;
+    xmls.emplace_back(argv[argi]);
 }
 
 
@@ -280,10 +587,19 @@ args::args(int argc, char *argv[]):
     argv(argv),
     dir("."),
     no_lookup(false),
+    mrn_pipe(false),
+    no_mrn_cache(false),
+    mrn_ttl(24),
+    mrn_negttl(10),
+    mrn_wait(10),
+    calling("TOMOCONV"),
+    nassoc(4),
     testing_only(false),
-    found_path(false),
+    use_snapshot(false),
     host("localhost"),
     port(6006),
+    njobs(1),
+    iobudget(tomo::sink::budget()),
     lthresh(tomo::log::DEBUG)
 {
 
@@ -307,7 +623,7 @@ void args::parse()
             break;
         }
     }
-    if (!found_path) {
+    if (!xmls.size()) {
         throw std::runtime_error("Archive XML path is required");
     }
 }
@@ -514,9 +830,10 @@ int main_log::write(tomo::log::level lvl, const char *msg) noexcept
 static void print_usage()
 {
     static const char *usage =
-    "Usage: " PROGNAME " [OPTION] FILE\n"
+    "Usage: " PROGNAME " [OPTION] FILE...\n"
     "Use a TomoTherapy patient plan xml FILE to convert the archive to DICOM format.\n"
     "If not supplied, the DICOM files will be written to the current directory.\n"
+    "Every FILE is converted in turn; a failed archive does not stop the others.\n"
     "\n"
     "Options:\n"
     "    -t, --test             do not write files to the output directory\n"
@@ -524,7 +841,28 @@ static void print_usage()
     "    -h, --host HOST        use hostname HOST for MRN lookups (default localhost)\n"
     "    -p, --port PORT        use port PORT for MRN lookups (default 6006)\n"
     "    -s, --skip-mrn         demote MRN lookup errors to warnings and ignore\n"
-    "    -l, --log-lvl LVL      override log level threshold to LVL\n";
+    "        --mrn-pipeline     keep one connection to the MRN server and pipeline length-framed\n"
+    "                           lookups over it (the server must speak the framed protocol;\n"
+    "                           a server that does not close after each reply needs this)\n"
+    "        --mrn-ttl HOURS    reuse cached MRN lookups for up to HOURS (default 24, 0 for never)\n"
+    "        --mrn-negative-ttl MIN\n"
+    "                           reuse cached \"NOT FOUND\" and ambiguous MRN lookups for up to\n"
+    "                           MIN minutes (default 10, 0 for never)\n"
+    "        --no-mrn-cache     ask the MRN server every time, and cache nothing\n"
+    "        --mrn-timeout SEC  give up on the MRN server after SEC seconds (default 10)\n"
+    "    -l, --log-lvl LVL      override log level threshold to LVL\n"
+    "    -j, --jobs N           run up to N archives/series at once (0 for one per CPU)\n"
+    "    -f, --file-list LIST   also convert each archive xml listed in LIST, one per line\n"
+    "    -b, --io-budget MB     let up to MB of output per archive wait on the disk (default 256)\n"
+    "    -d, --disease NAME     only export disease NAME; repeat to export more than one\n"
+    "        --only TYPES       only export the comma-separated series TYPES (ct, rtdose, rtstruct)\n"
+    "        --snapshot         reuse a cached copy of each archive's model, or make one\n"
+    "        --multiframe       write each CT series as one Enhanced CT file\n"
+    "        --send AE@HOST:PORT\n"
+    "                           C-STORE every file to the DICOM node AE at HOST:PORT instead\n"
+    "                           of writing it, over up to N --associations at once\n"
+    "        --associations N   send over up to N associations at once (default 4)\n"
+    "        --calling-ae AE    send as AE title AE (default TOMOCONV)\n";
 
     puts(usage);
     {
@@ -542,12 +880,83 @@ static void print_usage()
 }
 
 
-int main(int argc, char *argv[])
+/** @brief Converts a single archive, reporting any failure to the log
+ *  @returns Zero on success
+ */
+static int convert(const args &args, tomo::mrncache &mrn, const std::filesystem::path &ptxml)
 {
-    std::filesystem::path ptxml;
     tomo::archive arch;
+
+    try {
+        /* The lookup runs alongside the rest of the load and the export, and
+        a failure only warns with -s */
+        arch.lookup_mrn(&mrn, args.skip_lookup());
+        arch.load_file(ptxml, args.snapshot(), args.selection());
+        arch.flush(args.out_path(), args.testing(), args.selection());
+        return 0;
+
+    } catch (const tomo::parse_error &e) {
+        tomo::log::printf(tomo::log::ERROR, "Failed to parse XML %s: %s", e.path().string().c_str(), e.res().description());
+        //tomo::log << tomo::log::ERROR << "Failed to parse XML " << e.path() << ": " << e.res().description();
+
+    } catch (const tomo::missing_keys &e) {
+        tomo::log::printf(tomo::log::ERROR, "Node %s is missing required keys:", e.root().name());
+        for (const auto &key: e.keys()) {
+            tomo::log::printf(tomo::log::ERROR, "   - %s", key.c_str());
+        }
+
+    } catch (std::exception &e) {
+        tomo::log::puts(tomo::log::ERROR, e.what());
+
+    }
+    return 1;
+}
+
+
+/** @brief Converts every archive on the command line. Each one is a task on
+ *      the scheduler, so at most --jobs archives are resident at once, and one
+ *      archive failing has no bearing on the rest
+ *  @returns Zero if every archive was converted
+ */
+static int convert_batch(const args &args)
+{
+    const auto &paths = args.xml_paths();
+    std::vector<int> status(paths.size());
+    tomo::mrnclient client(args.mrn_hostname(), args.mrn_port(), args.mrn_pipeline(), args.mrn_timeout());
+    tomo::mrncache mrn(client, args.mrn_cache_ttl(), args.mrn_negative_ttl(), !args.mrn_cache());
+    tomo::taskgroup tasks;
+    size_t i, nfail = 0;
+
+    /* One client for every archive, so that a pipelined one keeps its
+    connection across all of them */
+    for (i = 0; i < paths.size(); i++) {
+        tasks.run([&args, &mrn, &paths, &status, i]() {
+            tomo::log::printf(tomo::log::INFO, "Converting archive %s (%zu of %zu)", paths[i].string().c_str(), i + 1, paths.size());
+            status[i] = convert(args, mrn, paths[i]);
+        });
+    }
+    tasks.wait();
+
+    for (i = 0; i < paths.size(); i++) {
+        nfail += status[i] != 0;
+    }
+    tomo::log::printf(nfail ? tomo::log::WARN : tomo::log::INFO,
+                      "Converted %zu of %zu archives", paths.size() - nfail, paths.size());
+    for (i = 0; i < paths.size(); i++) {
+        if (status[i]) {
+            tomo::log::printf(tomo::log::WARN, "   - failed: %s", paths[i].string().c_str());
+        }
+    }
+    return nfail != 0;
+}
+
+
+int main(int argc, char *argv[])
+{
     args args(argc, argv);
     main_log log(tomo::log::DEBUG);
+    std::shared_ptr<tomo::storesink::pool> assocs;
+    int res;
 
     tomo::log::add(log);
 
@@ -560,8 +969,17 @@ int main(int argc, char *argv[])
     }
 
     log.threshold() = args.loglvl();
+    tomo::scheduler::start(args.jobs());
+    tomo::sink::configure(args.io_budget());
+    if (args.store_peer()) {
+        /* Every archive sends over the same associations */
+        assocs = std::make_shared<tomo::storesink::pool>(*args.store_peer(), args.calling_ae(), args.associations());
+        tomo::sink::configure([assocs](size_t budget) {
+            return std::make_unique<tomo::storesink>(budget, assocs);
+        });
+    }
 
-    if (!args.testing() && !std::filesystem::exists(args.out_path())) {
+    if (!args.testing() && !args.store_peer() && !std::filesystem::exists(args.out_path())) {
         tomo::log << tomo::log::ERROR << "Directory " << args.out_path() << " does not exist. Create it before continuing.";
         return 1;
     }
@@ -572,37 +990,17 @@ int main(int argc, char *argv[])
         tomo::log::puts(tomo::log::INFO, "Entering testing mode, no files will be written to disk");
     }
 
-    try {
-        arch.load_file(args.xml_path());
-        try {
-            arch.update_mrn(args.mrn_hostname(), args.mrn_port());
-        } catch (std::runtime_error &e) {
-            if (args.skip_lookup()) {
-                /* Issue a warning that the MRN could not be looked up */
-                tomo::log::printf(tomo::log::WARN, e.what());
-
-            } else {
-                /* Throw to the lower handler */
-                throw e;
-
-            }
-        }
-        arch.flush(args.out_path(), args.testing());
-        return 0;
-
-    } catch (const tomo::parse_error &e) {
-        tomo::log::printf(tomo::log::ERROR, "Failed to parse XML %s: %s", e.path().string().c_str(), e.res().description());
-        //tomo::log << tomo::log::ERROR << "Failed to parse XML " << e.path() << ": " << e.res().description();
-
-    } catch (const tomo::missing_keys &e) {
-        tomo::log::printf(tomo::log::ERROR, "Node %s is missing required keys:", e.root().name());
-        for (const auto &key: e.keys()) {
-            tomo::log::printf(tomo::log::ERROR, "   - %s", key.c_str());
-        }
-
-    } catch (std::runtime_error &e) {
-        tomo::log::puts(tomo::log::ERROR, e.what());
+    if (args.xml_paths().size() == 1) {
+        tomo::mrnclient client(args.mrn_hostname(), args.mrn_port(), args.mrn_pipeline(), args.mrn_timeout());
+        tomo::mrncache mrn(client, args.mrn_cache_ttl(), args.mrn_negative_ttl(), !args.mrn_cache());
 
+        res = convert(args, mrn, args.xml_paths().front());
+    } else {
+        res = convert_batch(args);
     }
-    return 1;
+    tomo::scheduler::stop();
+
+    /* The associations are released here, not as the program exits */
+    tomo::sink::configure(nullptr);
+    return res;
 }
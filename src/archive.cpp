@@ -1,29 +1,43 @@
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <random>
 #include <set>
+#include <string_view>
+#include <utility>
 #include "archive.h"
 #include "ctseries.h"
 #include "rtdose.h"
 #include "rtstruct.h"
+#include "imageref.h"
 #include "auxiliary.h"
+#include "scheduler.h"
+#include "sink.h"
+#include "schema.h"
+#include "snapshot.h"
+#include "cache.h"
 #include "log.h"
 
 using namespace std::literals;
 
 
+/** All that the schema tables read is element names and text. Entities and
+ *  CDATA still need handling, but comments, PIs, the declaration, whitespace
+ *  between elements, and line ending and attribute normalization do not. The
+ *  text of each element is kept in the element node itself */
+static constexpr unsigned pt_parse_flags = pugi::parse_minimal
+                                         | pugi::parse_escapes
+                                         | pugi::parse_cdata
+                                         | pugi::parse_embed_pcdata;
+
+
 void tomo::archive::load_machine()
 {
-    std::filesystem::directory_iterator dir_iter(dir());
-    bool found = false;
-    
-    for (auto &file: dir_iter) {
-        if (file.path().extension() == ".xml"
-         && machine().load_file(file.path())) {
-            found = true;
-            break;
-        }
-    }
-    if (!found) {
+    if (!machine().load_dir(dir())) {
         throw std::runtime_error("Cannot find machine XML");
     }
 }
@@ -31,17 +45,15 @@ void tomo::archive::load_machine()
 
 void tomo::archive::load_common()
 {
+    static constexpr tomo::schema keys{
+        tomo::xkey<&archive::m_patient>("patient"),
+        tomo::xkey<&archive::m_diseases>("fullDiseaseDataArray")
+    };
     pugi::xml_node root;
-    tomo::xtable xtable;
     
     root = pt_doc().root().first_child();
     root = xchild(root, "FullPatient");
-    xtable.insert("patient", patient());
-    xtable.insert("fullDiseaseDataArray", xref(diseases(), "fullDiseaseDataArray"));
-    xtable.search(root);
-    if (xtable.size()) {
-        throw missing_keys(root, xtable);
-    }
+    keys.require(root, keys.search(*this, root));
 }
 
 
@@ -110,72 +122,391 @@ void tomo::archive::load_imaging_equipment(const std::filesystem::path &path)
 } */
 
 
-tomo::archive::archive()
+tomo::selection::selection() noexcept:
+    m_series(ALL),
+    m_narrowed(false),
+    m_multiframe(false)
 {
 
 }
 
 
-tomo::archive::archive(const std::filesystem::path &ptxml)
+void tomo::selection::only(const char *list)
 {
-    load_file(ptxml);
+    static const std::pair<const char *, series> names[] = {
+        { "ct", CT },
+        { "rtdose", RTDOSE },
+        { "rtstruct", RTSTRUCT }
+    };
+    std::string_view rest = list, name;
+    unsigned mask = 0;
+    size_t comma;
+
+    do {
+        comma = rest.find(',');
+        name = rest.substr(0, comma);
+        rest = (comma == rest.npos) ? std::string_view() : rest.substr(comma + 1);
+
+        auto it = std::find_if(std::begin(names), std::end(names),
+            [name](const auto &pair) { return name == pair.first; });
+        if (it == std::end(names)) {
+            throw std::runtime_error("Unknown series type "s + std::string(name));
+        }
+        mask |= it->second;
+    } while (comma != std::string_view::npos);
+    /* Every --only after the first adds to it */
+    m_series = m_narrowed ? m_series | mask : mask;
+    m_narrowed = true;
 }
 
 
-void tomo::archive::load_file(const std::filesystem::path &ptxml)
+bool tomo::selection::wants(const tomo::disease &dis) const noexcept
 {
+    return !m_diseases.size()
+        || std::find(m_diseases.begin(), m_diseases.end(), dis.name()) != m_diseases.end();
+}
+
+
+bool tomo::selection::covers(const selection &sel) const noexcept
+{
+    if (sel.m_series & ~m_series) {
+        return false;
+    }
+    if (m_diseases.empty()) {
+        return true;
+    }
+    return !sel.m_diseases.empty() && std::all_of(sel.m_diseases.begin(), sel.m_diseases.end(),
+        [this](const std::string &name) {
+            return std::find(m_diseases.begin(), m_diseases.end(), name) != m_diseases.end();
+        });
+}
+
+
+void tomo::selection::serialize(tomo::snapshot &snap)
+{
+    snap(m_series, m_diseases);
+}
+
+
+tomo::archive::archive():
+    m_refs(new tomo::imagerefs),
+    m_mrns(nullptr),
+    m_mrn_lenient(false),
+    m_snaphash(0)
+{
+
+}
+
+
+tomo::archive::archive(const std::filesystem::path &ptxml, bool snapshot):
+    archive()
+{
+    load_file(ptxml, snapshot);
+}
+
+
+tomo::archive::~archive()
+{
+
+}
+
+
+/** The key a snapshot is made under, which comes right after its header */
+struct snapshot_key {
+    std::string path;
+    uint64_t size;
+    int64_t mtime;
+    uint64_t hash;
+
+    void serialize(tomo::snapshot &snap) { snap(path, size, mtime, hash); }
+
+    bool operator==(const snapshot_key &) const = default;
+};
+
+
+/** Snapshots are only good for the build that wrote them. Anything else gets
+ *  a different header and is ignored */
+static std::array<uint32_t, 4> snapshot_header() noexcept
+{
+    return {
+        0x50414e53,     /* "SNAP", in the order it is written in */
+        tomo::snapshot::version,
+        0x01020304,
+        (uint32_t)(sizeof (int) | sizeof (long) << 8 | sizeof (size_t) << 16)
+    };
+}
+
+
+static snapshot_key make_snapshot_key(const std::filesystem::path &ptxml, uint64_t hash)
+{
+    std::error_code err;
+    snapshot_key key;
+
+    key.path = std::filesystem::weakly_canonical(ptxml, err).string();
+    if (err) {
+        key.path = std::filesystem::absolute(ptxml).lexically_normal().string();
+    }
+    key.size = std::filesystem::file_size(ptxml);
+    key.mtime = std::filesystem::last_write_time(ptxml).time_since_epoch().count();
+    key.hash = hash;
+    return key;
+}
+
+
+std::filesystem::path tomo::archive::snapshot_path(const std::filesystem::path &ptxml)
+{
+    std::filesystem::path path = tomo::cache_dir();
+    std::string name;
+    char hex[17];
+
+    if (path.empty()) {
+        return path;
+    }
+    name = make_snapshot_key(ptxml, 0).path;
+    snprintf(hex, sizeof hex, "%016llx", (unsigned long long)tomo::snapshot::hash(name.data(), name.size()));
+    path.append("snapshots");
+    path.append(std::string(hex) + ".snap");
+    return path;
+}
+
+
+bool tomo::archive::load_snapshot(const std::filesystem::path &ptxml, uint64_t hash,
+                                  const tomo::selection &sel)
+{
+    const std::filesystem::path path = snapshot_path(ptxml);
+    const snapshot_key want = make_snapshot_key(ptxml, hash);
+    std::array<uint32_t, 4> header;
+    tomo::selection made_for;
+    snapshot_key key;
+    tomo::mapfile file;
+
+    if (path.empty() || !std::filesystem::exists(path)) {
+        return false;
+    }
+    try {
+        file = tomo::mapfile(path);
+
+        tomo::snapshot snap(file.data(), file.size());
+
+        snap(header);
+        if (header != snapshot_header()) {
+            log::printf(tomo::log::DEBUG, "Snapshot %s is from another build", path.string().c_str());
+            return false;
+        }
+        key.serialize(snap);
+        if (!(key == want)) {
+            log::printf(tomo::log::DEBUG, "Snapshot %s is out of date", path.string().c_str());
+            return false;
+        }
+
+        /* The subtrees that the export it was made after did not read are not
+        in it, so it only does for a selection that reads no more */
+        made_for.serialize(snap);
+        if (!made_for.covers(sel)) {
+            log::printf(tomo::log::DEBUG, "Snapshot %s was made for less than is selected", path.string().c_str());
+            return false;
+        }
+        snap(patient(), diseases());
+        if (!snap.exhausted()) {
+            throw std::runtime_error("Snapshot has trailing bytes");
+        }
+    } catch (std::runtime_error &e) {
+        log::printf(tomo::log::WARN, "Ignoring snapshot %s: %s", path.string().c_str(), e.what());
+        patient() = { };
+        diseases().clear();
+        return false;
+    }
+    return true;
+}
+
+
+void tomo::archive::save_snapshot(const std::filesystem::path &ptxml, uint64_t hash,
+                                  const tomo::selection &sel)
+{
+    static std::atomic<uint64_t> seq(std::random_device{}());
+    const std::filesystem::path path = snapshot_path(ptxml);
+    std::array<uint32_t, 4> header = snapshot_header();
+    std::filesystem::path tmp = path;
+    tomo::selection made_for = sel;
+    snapshot_key key;
+    std::error_code err;
+    std::ofstream file;
+    tomo::snapshot snap;
+    char suffix[32];
+
+    if (path.empty()) {
+        return;
+    }
+    try {
+        key = make_snapshot_key(ptxml, hash);
+        snap(header);
+        key.serialize(snap);
+        made_for.serialize(snap);
+        snap(patient(), diseases());
+    } catch (std::exception &e) {
+        /* Nothing is read from the XML here, so hardly anything can fail */
+        log::printf(tomo::log::WARN, "Not making a snapshot of %s: %s", ptxml.string().c_str(), e.what());
+        return;
+    }
+
+    /* Written under a temporary name of its own and renamed over, so that a
+    reader never sees half a snapshot, and the last writer wins */
+    std::filesystem::create_directories(path.parent_path(), err);
+    snprintf(suffix, sizeof suffix, ".%016" PRIx64 ".tmp", seq++);
+    tmp += suffix;
+    file.open(tmp, std::ios::out | std::ios::binary | std::ios::trunc);
+    file.write(snap.bytes().data(), snap.bytes().size());
+    file.close();
+    if (file) {
+        std::filesystem::rename(tmp, path, err);
+    }
+    if (!file || err) {
+        log::printf(tomo::log::WARN, "Cannot write snapshot %s", path.string().c_str());
+        std::filesystem::remove(tmp, err);
+        return;
+    }
+    log::printf(tomo::log::DEBUG, "Wrote snapshot %s (%.1f MiB)",
+                path.string().c_str(), snap.bytes().size() / 1048576.0);
+}
+
+
+void tomo::archive::load_file(const std::filesystem::path &ptxml, bool snapshot,
+                              const tomo::selection &sel)
+{
+    using clock = std::chrono::steady_clock;
+    std::chrono::duration<double, std::milli> ms;
     pugi::xml_parse_result res;
+    clock::time_point start;
+    uint64_t hash = 0;
+
+    /* Parsed in place in a private mapping. Pages are copied by the kernel as
+    pugixml terminates the strings in them, instead of the whole file being
+    read into a heap buffer first, and the file is never held twice */
+    start = clock::now();
+    pt_doc().reset();
+    pt_map() = tomo::mapfile(ptxml, true);
+    m_snapxml.clear();
+    dir() = ptxml;
+    dir().remove_filename();
+
+    if (snapshot) {
+        /* Hashed before the parse writes into the mapping */
+        hash = tomo::snapshot::hash(pt_map().data(), pt_map().size());
+        if (load_snapshot(ptxml, hash, sel)) {
+            pt_map() = { };
+            ms = clock::now() - start;
+            log::printf(tomo::log::DEBUG, "Loaded %s from its snapshot in %.1f ms",
+                        ptxml.string().c_str(), ms.count());
+            if (m_mrns) {
+                patient().update_mrn(*m_mrns, m_mrn_lenient);
+            }
+            load_machine();
+            return;
+        }
+    }
 
-    res = pt_doc().load_file(ptxml.c_str());
+    res = pt_doc().load_buffer_inplace(pt_map().data(), pt_map().size(), pt_parse_flags);
     if (!res) {
         throw parse_error(res, ptxml);
     }
-    dir() = ptxml;
-    dir().remove_filename();
+    ms = clock::now() - start;
+    log::printf(tomo::log::DEBUG, "Parsed %s (%.1f MiB) in %.1f ms",
+                ptxml.string().c_str(), pt_map().size() / 1048576.0, ms.count());
     load_common();
+    if (m_mrns) {
+        patient().update_mrn(*m_mrns, m_mrn_lenient);
+    }
     load_machine();
+    if (snapshot) {
+        m_snapxml = ptxml;
+        m_snaphash = hash;
+    }
 }
 
 
-void tomo::archive::flush(const std::filesystem::path &dir, bool dry_run)
+void tomo::archive::flush(const std::filesystem::path &dir, bool dry_run,
+                          const tomo::selection &sel)
 {
+    std::unique_ptr<tomo::sink> out = tomo::sink::open();
     std::set<std::string> uids;
-    const std::string *uid;
+    tomo::taskgroup tasks;
+    size_t nselected = 0;
 
+    m_refs->clear(sel.multiframe());
+
+    /* Every series is its own task. The duplicate check stays on this thread,
+    and even the log messages in between are queued so that they come out in the
+    same order for any number of jobs. The lazy subtrees are only read from here
+    on, once the selection says they are wanted */
     for (const auto &dis: diseases()) {
-        log::printf(tomo::log::DEBUG, "Exporting disease %s", dis.name().c_str());
-
-        for (const auto &img: dis.images()) {
-            tomo::ctseries ct(*this, dis, img.img);
-
-            uid = &img.img.dbinfo().uid();
-            log::printf(tomo::log::DEBUG, "Exporting %s image %s", img.img.image_type().c_str(), uid->c_str());
-            if (uids.find(*uid) == uids.end()) {
-                ct.flush(dir, dry_run);
-                uids.insert(*uid);
-            } else {
-                log::printf(tomo::log::WARN, "Repeated CT series UID: %s", uid->c_str());
+        if (!sel.wants(dis)) {
+            log::printf(tomo::log::DEBUG, "Skipping disease %s", dis.name().c_str());
+            continue;
+        }
+        nselected++;
+        tasks.run([&dis]() {
+            log::printf(tomo::log::DEBUG, "Exporting disease %s", dis.name().c_str());
+        });
+
+        if (sel.wants(tomo::selection::CT)) {
+            for (const auto &img: dis.images()) {
+                const std::string &uid = img.img.dbinfo().uid();
+
+                if (uids.insert(uid).second) {
+                    tasks.run([this, &out, &dis, &img, &uid, &dir, dry_run]() {
+                        log::printf(tomo::log::DEBUG, "Exporting %s image %s", img.img.image_type().c_str(), uid.c_str());
+                        tomo::ctseries ct(*this, dis, img.img);
+
+                        ct.flush(*out, dir, dry_run);
+                    });
+                } else {
+                    tasks.run([&img, &uid]() {
+                        log::printf(tomo::log::DEBUG, "Exporting %s image %s", img.img.image_type().c_str(), uid.c_str());
+                        log::printf(tomo::log::WARN, "Repeated CT series UID: %s", uid.c_str());
+                    });
+                }
             }
         }
 
-        for (const auto &plan: dis.plans()) {
-            tomo::rtdose rd(*this, dis, plan);
+        if (sel.wants(tomo::selection::RTDOSE)) {
+            for (const auto &plan: dis.plans()) {
+                tasks.run([this, &out, &dis, &plan, &dir, dry_run]() {
+                    log::printf(tomo::log::DEBUG, "Exporting plan dose %s", plan.label().c_str());
+                    tomo::rtdose rd(*this, dis, plan);
 
-            log::printf(tomo::log::DEBUG, "Exporting plan dose %s", plan.label().c_str());
-            rd.flush(dir, dry_run);
+                    rd.flush(*out, dir, dry_run);
+                });
+            }
         }
 
-        for (const auto &ss: dis.structure_sets()) {
-            tomo::rtstruct rs(*this, dis, ss);
+        if (sel.wants(tomo::selection::RTSTRUCT)) {
+            for (const auto &ss: dis.structure_sets()) {
+                tasks.run([this, &out, &dis, &ss, &dir, dry_run]() {
+                    log::printf(tomo::log::DEBUG, "Exporting structure set %s", ss.dbinfo().uid().c_str());
+                    tomo::rtstruct rs(*this, dis, ss);
 
-            log::printf(tomo::log::DEBUG, "Exporting structure set %s", ss.dbinfo().uid().c_str());
-            rs.flush(dir, dry_run);
+                    rs.flush(*out, dir, dry_run);
+                });
+            }
         }
     }
+    tasks.wait();
+    out->wait();
+    m_refs->clear();
+
+    /* Only now, so that making it reads nothing the export did not */
+    if (!m_snapxml.empty()) {
+        save_snapshot(m_snapxml, m_snaphash, sel);
+        m_snapxml.clear();
+    }
+    if (!nselected && sel.diseases().size()) {
+        log::puts(tomo::log::WARN, "No disease in the archive matches the selection");
+    }
 }
 
 
-void tomo::archive::update_mrn(const char *host, uint16_t port)
+void tomo::archive::lookup_mrn(tomo::mrncache *cache, bool lenient) noexcept
 {
-    patient().update_mrn(host, port);
+    m_mrns = cache;
+    m_mrn_lenient = lenient;
 }
@@ -3,28 +3,97 @@
 #ifndef ARCHIVE_H
 #define ARCHIVE_H
 
+#include <cstdint>
 #include <filesystem>
+#include <memory>
 #include <set>
+#include <string>
 #include <vector>
 #include <pugixml.hpp>
 #include "patient.h"
 #include "machine.h"
 #include "disease.h"
 #include "error.h"
+#include "mapfile.h"
 
 
 namespace tomo {
 
 
+class snapshot;
+
+
+class imagerefs;
+class mrncache;
+
+
+/** What archive::flush exports, and how. By default, every series of every
+ *  disease, with a file per CT slice */
+class selection {
+public:
+    enum series {
+        CT          = 1 << 0,
+        RTDOSE      = 1 << 1,
+        RTSTRUCT    = 1 << 2,
+        ALL         = CT | RTDOSE | RTSTRUCT
+    };
+
+private:
+    unsigned m_series;
+    bool m_narrowed;            /* Once only() has been called */
+    std::vector<std::string> m_diseases;
+    bool m_multiframe;
+
+public:
+    selection() noexcept;
+
+    /** @brief Narrows the series to the comma-separated @p list of "ct",
+     *      "rtdose" and "rtstruct". The first call drops every other series
+     *  @throws std::runtime_error on a series type it does not know
+     */
+    void only(const char *list);
+
+    /** @brief Narrows the diseases to those named @p name, plus any other
+     *      names added */
+    void add_disease(const char *name) { m_diseases.emplace_back(name); }
+
+    bool wants(series s) const noexcept { return m_series & s; }
+    bool wants(const tomo::disease &dis) const noexcept;
+
+    /** @brief Whether this wants every series and disease that @p sel does */
+    bool covers(const selection &sel) const noexcept;
+
+    /** The series and diseases, which is what a snapshot was made for */
+    void serialize(tomo::snapshot &snap);
+
+    const std::vector<std::string> &diseases() const noexcept { return m_diseases; }
+
+    /** @brief Writes each CT series as a single Enhanced CT file. The dose
+     *      and structure sets then refer to its frames */
+    void multiframe(bool on) noexcept { m_multiframe = on; }
+    bool multiframe() const noexcept { return m_multiframe; }
+};
+
+
 class archive {
     std::filesystem::path m_archdir;
 
+    tomo::mapfile m_ptmap;          /* Holds every string in m_ptroot */
     pugi::xml_document m_ptroot;    /* Patient XML document root */
 
     tomo::machine m_machine;
     tomo::patient m_patient;
     std::vector<tomo::disease> m_diseases;
 
+    std::unique_ptr<tomo::imagerefs> m_refs;    /* During flush */
+
+    tomo::mrncache *m_mrns;         /* Looks up the MRN as the patient loads */
+    bool m_mrn_lenient;
+
+    std::filesystem::path m_snapxml;    /* Parsed, and to be snapshotted once
+                                        flushed; empty otherwise */
+    uint64_t m_snaphash;
+
 
     /** Finds the machine file */
     void load_machine();
@@ -32,8 +101,25 @@ class archive {
     /** Loads common data from the patient XML */
     void load_common();
 
+    /** Where the snapshot of the archive at @p ptxml lives, if anywhere */
+    static std::filesystem::path snapshot_path(const std::filesystem::path &ptxml);
+
+    /** @brief Reads the patient and diseases from the snapshot of @p ptxml,
+     *      provided it was made by this build from a file with the same path,
+     *      size, modification time and @p hash, and for a selection that
+     *      covers @p sel. Only then does it hold every subtree @p sel reads
+     *  @returns false, leaving the model empty, if there is no such snapshot
+     */
+    bool load_snapshot(const std::filesystem::path &ptxml, uint64_t hash, const tomo::selection &sel);
+
+    /** @brief Writes the snapshot that load_snapshot reads, once @p sel has
+     *      been exported. Of the lazy subtrees, it holds those that the export
+     *      read, and reads none. Failures are only warned about */
+    void save_snapshot(const std::filesystem::path &ptxml, uint64_t hash, const tomo::selection &sel);
+
     std::filesystem::path &dir() noexcept { return m_archdir; }
     
+    tomo::mapfile &pt_map() noexcept { return m_ptmap; }
     pugi::xml_document &pt_doc() noexcept { return m_ptroot; }
 
     tomo::machine &machine() noexcept { return m_machine; }
@@ -42,25 +128,41 @@ class archive {
 
 public:
     archive();
-    explicit archive(const std::filesystem::path &ptxml);
+    explicit archive(const std::filesystem::path &ptxml, bool snapshot = false);
+    ~archive();
 
 
     /** @brief Loads the patient archive using the path to the patient's XML
      *  @param ptxml
      *      Path to patient XML
-     *  @throws pugi::xml_parse_result on parse failure
+     *  @param snapshot
+     *      Load the model from a snapshot in the cache directory if one was
+     *      made from this very file for a selection that covers @p sel, and
+     *      otherwise make one once flush has exported it
+     *  @param sel
+     *      What flush will be asked to export
+     *  @throws tomo::parse_error on parse failure, std::runtime_error if the
+     *      file cannot be mapped
      */
-    void load_file(const std::filesystem::path &ptxml);
+    void load_file(const std::filesystem::path &ptxml, bool snapshot = false,
+                   const tomo::selection &sel = { });
 
 
-    /** @brief Writes the DICOM series to disk
+    /** @brief Writes the DICOM series to disk. Each series is exported as a
+     *      separate task on the tomo::scheduler pool
      *  @param dir
      *      Directory to write each file to
      *  @param dry_run
      *      Proceed as normal, but do NOT write the files to disk. This can help
      *      with testing
+     *  @param sel
+     *      Which diseases and series to export. The subtrees of the patient XML
+     *      that nothing selected refers to are never read. The snapshot that
+     *      load_file was asked for is made after a successful export
+     *  @throws the first error raised by any series, in export order
      */
-    void flush(const std::filesystem::path &dir = ".", bool dry_run = false);
+    void flush(const std::filesystem::path &dir = ".", bool dry_run = false,
+               const tomo::selection &sel = { });
 
 
     const tomo::machine &machine() const noexcept { return m_machine; }
@@ -71,8 +173,18 @@ public:
 
     const std::filesystem::path &dir() const noexcept { return m_archdir; }
 
-    /** Attempt to fetch an updated MRN from an external database */
-    void update_mrn(const char *host, uint16_t port);
+    /** The slice references that the series being flushed share */
+    tomo::imagerefs &image_refs() const noexcept { return *m_refs; }
+
+    /** @brief Has each load_file start fetching an updated MRN from an
+     *      external database as soon as it has read the patient, and carry on
+     *      loading while it runs. Only writing the patient attributes of the
+     *      first series waits for it. Null turns it off
+     *  @param lenient
+     *      A failed lookup is a warning, and the MRN in the archive stands.
+     *      Otherwise it fails every series, see tomo::patient::mrn
+     */
+    void lookup_mrn(tomo::mrncache *cache, bool lenient = false) noexcept;
 };
 
 
@@ -0,0 +1,449 @@
+#include <algorithm>
+#include <charconv>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include "auxiliary.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#   define TOMO_X86 1
+#   include <immintrin.h>
+
+#   if defined(_MSC_VER)
+#       include <intrin.h>
+#       define TOMO_TARGET(isa)
+
+#   else
+#       define TOMO_TARGET(isa) __attribute__((target(isa)))
+
+#   endif
+
+#else
+#   define TOMO_X86 0
+
+#endif
+
+
+/* Kernels take raw bytes and an element count. None of them care about
+alignment, and src == dst is fine */
+using kernel_t = void (*)(const uint8_t *, uint8_t *, size_t);
+using max_kernel_t = float (*)(const uint8_t *, size_t, float);
+using quant_kernel_t = void (*)(const uint8_t *, size_t, float, uint16_t *);
+
+
+template <class UIntT>
+static void scalar_kernel(const uint8_t *src, uint8_t *dst, size_t n)
+{
+    UIntT x;
+
+    for (; n; n--, src += sizeof x, dst += sizeof x) {
+        std::memcpy(&x, src, sizeof x);
+        tomo::endianswap(x);
+        std::memcpy(dst, &x, sizeof x);
+    }
+}
+
+
+static float load_bigendian(const uint8_t *src) noexcept
+{
+    float x;
+
+    std::memcpy(&x, src, sizeof x);
+    if (g_target_lendian) {
+        tomo::endianswap(x);
+    }
+    return x;
+}
+
+
+static float scalar_max(const uint8_t *src, size_t n, float max)
+{
+    float x;
+
+    for (; n; n--, src += sizeof x) {
+        x = load_bigendian(src);
+        max = (x > max) ? x : max;
+    }
+    return max;
+}
+
+
+static void scalar_quantize(const uint8_t *src, size_t n, float scale, uint16_t *dst)
+{
+    float x;
+
+    for (; n; n--, src += sizeof x) {
+        x = load_bigendian(src) * scale;
+        /* Written so that NaN lands on zero */
+        x = (x > 0.0f) ? std::min(x, (float)UINT16_MAX) : 0.0f;
+        *dst++ = (uint16_t)std::lrint(x);
+    }
+}
+
+
+#if TOMO_X86
+
+/** The pshufb control that reverses every @p Width byte group in a lane */
+template <size_t Width>
+static constexpr std::array<char, 16> lane_mask()
+{
+    std::array<char, 16> res = { };
+    size_t i;
+
+    for (i = 0; i < res.size(); i++) {
+        res[i] = (char)(i - i % Width + Width - 1 - i % Width);
+    }
+    return res;
+}
+
+
+template <class UIntT>
+TOMO_TARGET("ssse3")
+static void ssse3_kernel(const uint8_t *src, uint8_t *dst, size_t n)
+{
+    static constexpr auto bytes = lane_mask<sizeof (UIntT)>();
+    const __m128i mask = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes.data()));
+    const size_t len = n * sizeof (UIntT);
+    __m128i v;
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        v = _mm_shuffle_epi8(v, mask);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), v);
+    }
+    scalar_kernel<UIntT>(src + i, dst + i, (len - i) / sizeof (UIntT));
+}
+
+
+template <class UIntT>
+TOMO_TARGET("avx2")
+static void avx2_kernel(const uint8_t *src, uint8_t *dst, size_t n)
+{
+    static constexpr auto bytes = lane_mask<sizeof (UIntT)>();
+    const __m256i mask = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes.data())));
+    const size_t len = n * sizeof (UIntT);
+    __m256i v0, v1;
+    size_t i;
+
+    /* Two registers per trip keeps both shuffle ports busy */
+    for (i = 0; i + 64 <= len; i += 64) {
+        v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+        v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i + 32));
+        v0 = _mm256_shuffle_epi8(v0, mask);
+        v1 = _mm256_shuffle_epi8(v1, mask);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), v0);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i + 32), v1);
+    }
+    if (i + 32 <= len) {
+        v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+        v0 = _mm256_shuffle_epi8(v0, mask);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), v0);
+        i += 32;
+    }
+    scalar_kernel<UIntT>(src + i, dst + i, (len - i) / sizeof (UIntT));
+}
+
+
+TOMO_TARGET("ssse3")
+static float ssse3_max(const uint8_t *src, size_t n, float init)
+{
+    static constexpr auto bytes = lane_mask<4>();
+    const __m128i mask = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes.data()));
+    __m128 v, max = _mm_set1_ps(init);
+    float lanes[4];
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        v = _mm_castsi128_ps(_mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 4 * i)), mask));
+        /* maxps returns its second operand on NaN, which is the accumulator */
+        max = _mm_max_ps(v, max);
+    }
+    _mm_storeu_ps(lanes, max);
+    init = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+    return scalar_max(src + 4 * i, n - i, init);
+}
+
+
+TOMO_TARGET("avx2")
+static float avx2_max(const uint8_t *src, size_t n, float init)
+{
+    static constexpr auto bytes = lane_mask<4>();
+    const __m256i mask = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes.data())));
+    __m256 v0, v1, max0 = _mm256_set1_ps(init), max1 = max0;
+    float lanes[8];
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        v0 = _mm256_castsi256_ps(_mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + 4 * i)), mask));
+        v1 = _mm256_castsi256_ps(_mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + 4 * i + 32)), mask));
+        max0 = _mm256_max_ps(v0, max0);
+        max1 = _mm256_max_ps(v1, max1);
+    }
+    _mm256_storeu_ps(lanes, _mm256_max_ps(max0, max1));
+    init = *std::max_element(lanes, lanes + 8);
+    return scalar_max(src + 4 * i, n - i, init);
+}
+
+
+TOMO_TARGET("sse4.1")
+static void sse41_quantize(const uint8_t *src, size_t n, float scale, uint16_t *dst)
+{
+    static constexpr auto bytes = lane_mask<4>();
+    const __m128i mask = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes.data()));
+    const __m128 mul = _mm_set1_ps(scale), top = _mm_set1_ps((float)UINT16_MAX);
+    __m128 v0, v1;
+    __m128i i0, i1;
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        v0 = _mm_castsi128_ps(_mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 4 * i)), mask));
+        v1 = _mm_castsi128_ps(_mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 4 * i + 16)), mask));
+        /* minps passes a NaN in its second operand through, cvtps turns it
+        into INT_MIN, and packus saturates that and any negative to zero.
+        Rounding is to nearest even */
+        i0 = _mm_cvtps_epi32(_mm_min_ps(top, _mm_mul_ps(v0, mul)));
+        i1 = _mm_cvtps_epi32(_mm_min_ps(top, _mm_mul_ps(v1, mul)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_packus_epi32(i0, i1));
+    }
+    scalar_quantize(src + 4 * i, n - i, scale, dst + i);
+}
+
+
+TOMO_TARGET("avx2")
+static void avx2_quantize(const uint8_t *src, size_t n, float scale, uint16_t *dst)
+{
+    static constexpr auto bytes = lane_mask<4>();
+    const __m256i mask = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes.data())));
+    const __m256 mul = _mm256_set1_ps(scale), top = _mm256_set1_ps((float)UINT16_MAX);
+    __m256 v0, v1;
+    __m256i i0, i1, packed;
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        v0 = _mm256_castsi256_ps(_mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + 4 * i)), mask));
+        v1 = _mm256_castsi256_ps(_mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + 4 * i + 32)), mask));
+        i0 = _mm256_cvtps_epi32(_mm256_min_ps(top, _mm256_mul_ps(v0, mul)));
+        i1 = _mm256_cvtps_epi32(_mm256_min_ps(top, _mm256_mul_ps(v1, mul)));
+        /* packus works within 128-bit lanes, so put the quadwords back in
+        order afterwards */
+        packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(i0, i1), 0xd8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), packed);
+    }
+    scalar_quantize(src + 4 * i, n - i, scale, dst + i);
+}
+
+
+#if defined(_MSC_VER)
+
+static bool has_ssse3() noexcept
+{
+    int regs[4];
+
+    __cpuid(regs, 1);
+    return regs[2] & (1 << 9);
+}
+
+
+static bool has_sse41() noexcept
+{
+    int regs[4];
+
+    __cpuid(regs, 1);
+    return regs[2] & (1 << 19);
+}
+
+
+static bool has_avx2() noexcept
+{
+    int regs[4];
+
+    __cpuid(regs, 1);
+    /* The OS has to save the YMM registers too */
+    if (!(regs[2] & (1 << 27)) || (_xgetbv(0) & 0x6) != 0x6) {
+        return false;
+    }
+    __cpuidex(regs, 7, 0);
+    return regs[1] & (1 << 5);
+}
+
+#else
+
+/* libgcc checks OS support for the YMM state on our behalf */
+static bool has_ssse3() noexcept { return __builtin_cpu_supports("ssse3"); }
+static bool has_sse41() noexcept { return __builtin_cpu_supports("sse4.1"); }
+static bool has_avx2() noexcept { return __builtin_cpu_supports("avx2"); }
+
+#endif
+
+#endif /* TOMO_X86 */
+
+
+template <class UIntT>
+static kernel_t swap_kernel(tomo::isa which) noexcept
+{
+    switch (which) {
+#if TOMO_X86
+    case tomo::isa::AVX2:
+        return avx2_kernel<UIntT>;
+    case tomo::isa::SSSE3:
+        return ssse3_kernel<UIntT>;
+#endif
+    default:
+        return scalar_kernel<UIntT>;
+    }
+}
+
+
+template <class UIntT>
+static kernel_t pick_kernel() noexcept
+{
+    return swap_kernel<UIntT>(tomo::native_isa());
+}
+
+
+static max_kernel_t pick_max_kernel() noexcept
+{
+#if TOMO_X86
+    if (has_avx2()) {
+        return avx2_max;
+    }
+    if (has_ssse3()) {
+        return ssse3_max;
+    }
+#endif
+    return scalar_max;
+}
+
+
+static quant_kernel_t pick_quant_kernel() noexcept
+{
+#if TOMO_X86
+    if (has_avx2()) {
+        return avx2_quantize;
+    }
+    if (has_sse41()) {
+        return sse41_quantize;
+    }
+#endif
+    return scalar_quantize;
+}
+
+
+tomo::isa tomo::native_isa() noexcept
+{
+#if TOMO_X86
+    if (has_avx2()) {
+        return isa::AVX2;
+    }
+    if (has_ssse3()) {
+        return isa::SSSE3;
+    }
+#endif
+    return isa::SCALAR;
+}
+
+
+void tomo::byteswap16(const void *src, void *dst, size_t n) noexcept
+{
+    static const kernel_t kernel = pick_kernel<uint16_t>();
+
+    kernel(static_cast<const uint8_t *>(src), static_cast<uint8_t *>(dst), n);
+}
+
+
+void tomo::byteswap32(const void *src, void *dst, size_t n) noexcept
+{
+    static const kernel_t kernel = pick_kernel<uint32_t>();
+
+    kernel(static_cast<const uint8_t *>(src), static_cast<uint8_t *>(dst), n);
+}
+
+
+void tomo::byteswap16(const void *src, void *dst, size_t n, isa which) noexcept
+{
+    swap_kernel<uint16_t>(which)(static_cast<const uint8_t *>(src), static_cast<uint8_t *>(dst), n);
+}
+
+
+void tomo::byteswap32(const void *src, void *dst, size_t n, isa which) noexcept
+{
+    swap_kernel<uint32_t>(which)(static_cast<const uint8_t *>(src), static_cast<uint8_t *>(dst), n);
+}
+
+
+float tomo::bigendian_max(const void *src, size_t n, float init) noexcept
+{
+    static const max_kernel_t kernel = pick_max_kernel();
+
+    return kernel(static_cast<const uint8_t *>(src), n, init);
+}
+
+
+void tomo::bigendian_quantize(const void *src, size_t n, float scale, uint16_t *dst) noexcept
+{
+    static const quant_kernel_t kernel = pick_quant_kernel();
+
+    kernel(static_cast<const uint8_t *>(src), n, scale, dst);
+}
+
+
+/** Parses the number at @p text, which must be followed by @p delim
+ *  @returns The character after the delimiter
+ */
+static const char *pop_float(const char *text, const char *end, float &res, char delim)
+{
+    std::from_chars_result conv;
+    double x;
+
+    /* strtod skipped leading space and a plus sign, and nothing else in these
+    files is spelled differently between the two */
+    while (text < end && isspace((unsigned char)*text)) {
+        text++;
+    }
+    if (text < end && *text == '+') {
+        text++;
+    }
+    /* Parsed as a double first, like strtod, so that nothing is rounded
+    differently than it used to be */
+    conv = std::from_chars(text, end, x);
+    if (conv.ec != std::errc() || conv.ptr == end || *conv.ptr != delim) {
+        throw std::runtime_error("Malformed ROI curve triplet");
+    }
+    res = (float)x;
+    return conv.ptr + 1;
+}
+
+
+void tomo::parse_triplets(std::string_view str, std::vector<float> &out)
+{
+    const char *text = str.data(), *end = str.data() + str.size();
+    size_t n, i;
+
+    /* One triplet per semicolon, so the output is sized once up front */
+    n = std::count(text, end, ';');
+    i = out.size();
+    out.resize(i + 3 * n);
+    for (;;) {
+        /* Text that is only whitespace, as an empty element has, is no points */
+        while (text < end && isspace((unsigned char)*text)) {
+            text++;
+        }
+        if (text == end) {
+            break;
+        }
+        if (i + 3 > out.size()) {
+            throw std::runtime_error("Malformed ROI curve triplet");
+        }
+        text = pop_float(text, end, out[i], ',');
+        text = pop_float(text, end, out[i + 1], ',');
+        text = pop_float(text, end, out[i + 2], ';');
+        i += 3;
+    }
+    out.resize(i);
+}
@@ -4,6 +4,14 @@
 #define AUXILIARY_H
 
 #include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <string_view>
+#include <type_traits>
+#include <vector>
 #include <pugixml.hpp>
 
 /** Have I *tested* this application on a big endian machine? No. Am I going to
@@ -105,17 +113,98 @@ static void endianswap(PrimT &prim)
 }
 
 
-/** DCMTK implements this functionality as well... not gonna #include it though */
+/** @brief Byte-swap @p n 16-bit elements from @p src into @p dst. The two may
+ *      be the same buffer, but must not otherwise overlap. The kernel is picked
+ *      on first use from whatever the CPU supports (AVX2, SSSE3, or plain C++)
+ */
+void byteswap16(const void *src, void *dst, size_t n) noexcept;
+
+/** @brief The same as above, for 32-bit elements */
+void byteswap32(const void *src, void *dst, size_t n) noexcept;
+
+
+/** Instruction sets the byte swap kernels come in */
+enum class isa {
+    SCALAR,
+    SSSE3,
+    AVX2
+};
+
+/** @brief The best of the above this CPU supports, which byteswap16 and
+ *      byteswap32 use
+ */
+isa native_isa() noexcept;
+
+/** @brief byteswap16 and byteswap32 through the kernel for @p which, for
+ *      benchmarking them against each other. The CPU must support it
+ */
+void byteswap16(const void *src, void *dst, size_t n, isa which) noexcept;
+void byteswap32(const void *src, void *dst, size_t n, isa which) noexcept;
+
+
+/** DCMTK implements this functionality as well... not gonna #include it though
+ *  Contiguous ranges of 16- and 32-bit elements go to the vector kernels
+ */
 template <class InputIt>
 static void endianswap(InputIt begin, InputIt end)
 {
-    while (begin != end) {
-        endianswap(*begin);
-        ++begin;
+    using value_t = typename std::iterator_traits<InputIt>::value_type;
+
+    if constexpr (std::contiguous_iterator<InputIt> && sizeof (value_t) == 2) {
+        byteswap16(std::to_address(begin), std::to_address(begin), end - begin);
+    } else if constexpr (std::contiguous_iterator<InputIt> && sizeof (value_t) == 4) {
+        byteswap32(std::to_address(begin), std::to_address(begin), end - begin);
+    } else {
+        while (begin != end) {
+            endianswap(*begin);
+            ++begin;
+        }
     }
 }
 
 
+/** Copies [@p begin, @p end) to @p dst, swapping byte order in the same pass */
+template <class InputIt, class OutputIt>
+static void endianswap(InputIt begin, InputIt end, OutputIt dst)
+{
+    using value_t = typename std::iterator_traits<InputIt>::value_type;
+    constexpr bool contiguous = std::contiguous_iterator<InputIt>
+                             && std::contiguous_iterator<OutputIt>;
+
+    if constexpr (contiguous && sizeof (value_t) == 2) {
+        byteswap16(std::to_address(begin), std::to_address(dst), end - begin);
+    } else if constexpr (contiguous && sizeof (value_t) == 4) {
+        byteswap32(std::to_address(begin), std::to_address(dst), end - begin);
+    } else {
+        for (; begin != end; ++begin, ++dst) {
+            *dst = *begin;
+            endianswap(*dst);
+        }
+    }
+}
+
+
+/** @brief Finds the largest of @p n big-endian floats at @p src, without
+ *      converting them anywhere. NaNs are ignored
+ *  @returns The maximum, or @p init if nothing is larger
+ */
+float bigendian_max(const void *src, size_t n, float init) noexcept;
+
+
+/** @brief Converts @p n big-endian floats at @p src into unsigned 16-bit
+ *      integers at @p dst in one pass: each value is multiplied by @p scale,
+ *      rounded to nearest, and saturated to [0, UINT16_MAX]
+ */
+void bigendian_quantize(const void *src, size_t n, float scale, uint16_t *dst) noexcept;
+
+
+/** @brief Appends the numbers in @p text, triplets like "x,y,z;" with any
+ *      amount of space after each, to @p out as they are
+ *  @throws std::runtime_error if a triplet is malformed
+ */
+void parse_triplets(std::string_view text, std::vector<float> &out);
+
+
 };
 
 
@@ -0,0 +1,54 @@
+#include <cstdlib>
+#include <mutex>
+#include <system_error>
+#include "cache.h"
+#include "log.h"
+
+
+static std::filesystem::path find_cache_dir()
+{
+    std::filesystem::path path;
+    const char *env;
+
+    if ((env = getenv("TOMOCONV_CACHE"))) {
+        return env;
+    }
+#if defined(_WIN32)
+    if ((env = getenv("LOCALAPPDATA"))) {
+        path = env;
+    }
+#else
+    if ((env = getenv("XDG_CACHE_HOME")) && *env) {
+        path = env;
+    } else if ((env = getenv("HOME")) && *env) {
+        path = env;
+        path.append(".cache");
+    }
+#endif
+    if (!path.empty()) {
+        path.append("tomoconv");
+    }
+    return path;
+}
+
+
+std::filesystem::path tomo::cache_dir()
+{
+    static std::filesystem::path dir;
+    static std::once_flag once;
+
+    std::call_once(once, []() {
+        std::error_code err;
+
+        dir = find_cache_dir();
+        if (!dir.empty()) {
+            std::filesystem::create_directories(dir, err);
+            if (err) {
+                log::printf(tomo::log::WARN, "Cannot create cache directory %s: %s",
+                            dir.string().c_str(), err.message().c_str());
+                dir.clear();
+            }
+        }
+    });
+    return dir;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <filesystem>
+
+
+namespace tomo {
+
+
+/** @brief The directory tomoconv keeps files in between runs, created on
+ *      first use. It is $TOMOCONV_CACHE if that is set, and otherwise a
+ *      tomoconv directory under the user's usual cache directory
+ *  @returns An empty path if there is nowhere to keep anything, including
+ *      when $TOMOCONV_CACHE is set but empty
+ */
+std::filesystem::path cache_dir();
+
+
+};
+
+
+#endif /* CACHE_H */
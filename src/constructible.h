@@ -9,12 +9,19 @@
 namespace tomo {
 
 
+class snapshot;
+
+
 class constructible {
 
 public:
     constructible() = default;
 
     virtual void construct(pugi::xml_node root) = 0;
+
+    /** @brief Writes every member to @p snap, or reads every member back from
+     *      it, in the same order either way */
+    virtual void serialize(tomo::snapshot &snap) = 0;
 };
 
 
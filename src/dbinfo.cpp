@@ -1,5 +1,6 @@
 #include "dbinfo.h"
 #include "error.h"
+#include "snapshot.h"
 
 
 tomo::dbinfo::dbinfo()
@@ -20,3 +21,9 @@ void tomo::dbinfo::construct(pugi::xml_node root)
     node = xchild(root, "time");
     time() = node.text().as_string();
 }
+
+
+void tomo::dbinfo::serialize(tomo::snapshot &snap)
+{
+    snap(m_uid, m_date, m_time);
+}
@@ -18,6 +18,7 @@ public:
     dbinfo();
 
     virtual void construct(pugi::xml_node root) override;
+    virtual void serialize(tomo::snapshot &snap) override;
 
     std::string &uid() noexcept { return m_uid; }
     std::string &date() noexcept { return m_date; }
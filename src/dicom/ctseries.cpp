@@ -27,7 +27,7 @@ void tomo::ctseries::load_pixel_data()
     if (image().header().datatype() != "Short_Data") {
         throw std::runtime_error("Unsupported CT data type: "s + image().header().datatype());
     }
-    px_data() = image().load_file<uint16_t>(archive().dir());
+    px_data() = image().map_file<uint16_t>(archive().dir());
 }
 
 
@@ -51,12 +51,165 @@ void tomo::ctseries::write_numeric_attributes()
 }
 
 
+using seqptr_t = std::unique_ptr<DcmSequenceOfItems>;
+using itemptr_t = std::unique_ptr<DcmItem>;
+
+
+/** Wraps @p item in a sequence @p key of its own, and puts that in @p group */
+static void insert_group(DcmItem *group, const DcmTag &key, itemptr_t &item)
+{
+    seqptr_t seq(new DcmSequenceOfItems(key));
+
+    tomo::insert_wrap(seq.get(), item.get());
+    item.release();
+    tomo::insert_wrap(group, seq.get());
+    seq.release();
+}
+
+
+/** Image Type and Frame Type of the Enhanced CT. The volume is resampled, so
+ *  it is DERIVED, which spares it the acquisition macros that an ORIGINAL one
+ *  needs and the archive has nothing to fill in with. Enhanced objects are
+ *  always PRIMARY */
+static const char enhanced_type[] = "DERIVED\\PRIMARY\\AXIAL\\RESAMPLED";
+
+
+/** The attributes that go with Image Type at the top level, and with Frame
+ *  Type in the CT Image Frame Type macro */
+static void insert_frame_type(DcmItem *item, const DcmTag &key)
+{
+    tomo::insert_wrap(item, key, enhanced_type);
+    tomo::insert_wrap(item, DCM_PixelPresentation, "MONOCHROME");
+    tomo::insert_wrap(item, DCM_VolumetricProperties, "VOLUME");
+    tomo::insert_wrap(item, DCM_VolumeBasedCalculationTechnique, "NONE");
+}
+
+
+/** The archive says nothing of the anatomy, so every frame is of an unpaired
+ *  region of the entire body */
+static void insert_frame_anatomy(DcmItem *group)
+{
+    itemptr_t item(new DcmItem), code(new DcmItem);
+    seqptr_t seq(new DcmSequenceOfItems(DCM_AnatomicRegionSequence));
+
+    tomo::insert_wrap(code.get(), DCM_CodeValue, "38266002");
+    tomo::insert_wrap(code.get(), DCM_CodingSchemeDesignator, "SCT");
+    tomo::insert_wrap(code.get(), DCM_CodeMeaning, "Entire body");
+    tomo::insert_wrap(seq.get(), code.get());
+    code.release();
+    tomo::insert_wrap(item.get(), DCM_FrameLaterality, "U");
+    tomo::insert_wrap(item.get(), seq.get());
+    seq.release();
+    insert_group(group, DCM_FrameAnatomySequence, item);
+}
+
+
+/** Enhanced CT keeps most of what write_numeric_attributes puts at the top
+ *  level in functional groups instead. Those that every frame shares go in
+ *  once; each frame only carries its own position */
+void tomo::ctseries::write_functional_groups()
+{
+    const std::array<float, 6> orient = { 1, 0, 0, 0, 1, 0 };
+    const std::string dimuid = uid() + ".0";
+    const std::string &device = archive().machine().name();
+    std::array<float, 3> pos = image_position();
+    itemptr_t shared, frame, item;
+    seqptr_t seq, perframe;
+    int inst;
+
+    insert_frame_type(dcm().getDataset(), DCM_ImageType);
+    insert(DCM_AcquisitionDateTime, (image().dbinfo().date() + image().dbinfo().time()).c_str());
+    insert(DCM_ContentDate, image().dbinfo().date().c_str());
+    insert(DCM_ContentTime, image().dbinfo().time().c_str());
+    insert(DCM_ContentQualification, "PRODUCT");
+    insert(DCM_InstanceNumber, 1);
+    insert(DCM_NumberOfFrames, nframes());
+    insert(DCM_SamplesPerPixel, 1);
+    insert(DCM_Rows, image().header().dim(1));
+    insert(DCM_Columns, image().header().dim(0));
+    insert(DCM_BitsAllocated, 16);
+    insert(DCM_BitsStored, 16);
+    insert(DCM_HighBit, 15);
+    insert(DCM_PixelRepresentation, 0);
+    insert(DCM_BurnedInAnnotation, "NO");
+    insert(DCM_LossyImageCompression, "00");
+    insert(DCM_PresentationLUTShape, "IDENTITY");
+    insert(DCM_DeviceSerialNumber, device.empty() ? "UNKNOWN" : device.c_str());
+
+    /* Type 2, and nothing is known of the acquisition */
+    seq.reset(new DcmSequenceOfItems(DCM_AcquisitionContextSequence));
+    insert(seq.get());
+    seq.release();
+
+    /* Frames are indexed by where they sit in the stack */
+    item.reset(new DcmItem);
+    insert_wrap(item.get(), DCM_DimensionOrganizationUID, dimuid);
+    insert(DCM_DimensionOrganizationSequence, item.get());
+    item.release();
+    item.reset(new DcmItem);
+    insert_wrap(item.get(), DCM_DimensionOrganizationUID, dimuid);
+    insert_wrap(item.get(), DCM_DimensionIndexPointer, DCM_ImagePositionPatient);
+    insert_wrap(item.get(), DCM_FunctionalGroupPointer, DCM_PlanePositionSequence);
+    insert(DCM_DimensionIndexSequence, item.get());
+    item.release();
+
+    shared.reset(new DcmItem);
+    item.reset(new DcmItem);
+    insert_wrap(item.get(), DCM_PixelSpacing, 2, image().header().res().data());
+    insert_wrap(item.get(), DCM_SliceThickness, image().header().res(2));
+    insert_group(shared.get(), DCM_PixelMeasuresSequence, item);
+    item.reset(new DcmItem);
+    insert_wrap(item.get(), DCM_ImageOrientationPatient, orient.size(), orient.data());
+    insert_group(shared.get(), DCM_PlaneOrientationSequence, item);
+    item.reset(new DcmItem);
+    insert_wrap(item.get(), DCM_RescaleIntercept, -1024.0);
+    insert_wrap(item.get(), DCM_RescaleSlope, 1.0);
+    insert_wrap(item.get(), DCM_RescaleType, "HU");
+    insert_group(shared.get(), DCM_PixelValueTransformationSequence, item);
+    item.reset(new DcmItem);
+    insert_frame_type(item.get(), DCM_FrameType);
+    insert_group(shared.get(), DCM_CTImageFrameTypeSequence, item);
+
+    /* The range a 12-bit scanner stores, -1024 to 3071 HU */
+    item.reset(new DcmItem);
+    insert_wrap(item.get(), DCM_WindowCenter, 1024.0);
+    insert_wrap(item.get(), DCM_WindowWidth, 4096.0);
+    insert_wrap(item.get(), DCM_WindowCenterWidthExplanation, "FULL RANGE");
+    insert_group(shared.get(), DCM_FrameVOILUTSequence, item);
+    insert_frame_anatomy(shared.get());
+
+    /* The whole volume counts as one irradiation event */
+    item.reset(new DcmItem);
+    insert_wrap(item.get(), DCM_IrradiationEventUID, uid() + ".0.1");
+    insert_group(shared.get(), DCM_IrradiationEventIdentificationSequence, item);
+    insert(DCM_SharedFunctionalGroupsSequence, shared.get());
+    shared.release();
+
+    /* The same positions the single-frame slices get */
+    perframe.reset(new DcmSequenceOfItems(DCM_PerFrameFunctionalGroupsSequence));
+    for (inst = 1; inst <= nframes(); inst++) {
+        frame.reset(new DcmItem);
+        item.reset(new DcmItem);
+        insert_wrap(item.get(), DCM_ImagePositionPatient, pos.size(), pos.data());
+        insert_group(frame.get(), DCM_PlanePositionSequence, item);
+        item.reset(new DcmItem);
+        insert_wrap(item.get(), DCM_DimensionIndexValues, inst);
+        insert_group(frame.get(), DCM_FrameContentSequence, item);
+        insert_wrap(perframe.get(), frame.get());
+        frame.release();
+        pos[2] -= image().header().res(2);
+    }
+    insert(perframe.get());
+    perframe.release();
+}
+
+
 void tomo::ctseries::write_attributes()
 {
     using pair_t = std::pair<DcmTag, const char *>;
+    const bool multiframe = refs().multiframe();
     const pair_t pairs[] = {
-        { DCM_ImageType, "ORIGINAL\\SECONDARY\\AXIAL" },
-        { DCM_SOPClassUID, UID_CTImageStorage },
+        { DCM_SOPClassUID, multiframe ? UID_EnhancedCTImageStorage : UID_CTImageStorage },
         { DCM_SeriesDate, image().dbinfo().date().c_str() },
         { DCM_AcquisitionDate, image().dbinfo().date().c_str() },
         { DCM_SeriesTime, image().dbinfo().time().c_str() },
@@ -78,7 +231,12 @@ void tomo::ctseries::write_attributes()
     for (const auto &pair: pairs) {
         insert(pair.first, pair.second);
     }
-    write_numeric_attributes();
+    if (multiframe) {
+        write_functional_groups();
+    } else {
+        insert(DCM_ImageType, "ORIGINAL\\SECONDARY\\AXIAL");
+        write_numeric_attributes();
+    }
 }
 
 
@@ -91,48 +249,172 @@ tomo::ctseries::ctseries(const tomo::archive &arch,
     if (image().image_type() != "KVCT"s) {
         throw std::runtime_error("Unexpected image type: " + image().image_type());
     }
+    m_refs = archive().image_refs().get(uid(), nframes());
     calc_geometry();
     load_pixel_data();
     write_attributes();
 }
 
 
-void tomo::ctseries::flush(const std::filesystem::path &dir, bool dry_run)
+std::array<std::string, tomo::slicetemplate::nfields> tomo::ctseries::slice_values(int inst)
 {
-    std::filesystem::path path;
-    std::vector<uint16_t> data;
-    //std::vector<uint16_t>::const_iterator it, end;
-    /* Windows does not like advancing iterators past the end */
-    /* Ironic that I have to use pointers because of Windows */
-    /* If I had access to Merge DICOM I wouldn't even be using C++ though */
-    const uint16_t *it, *end;
+    std::array<std::string, slicetemplate::nfields> values;
     char buf[100];
+
+    values[slicetemplate::instance_uid] = refs().uid(inst);
+    values[slicetemplate::instance_number].assign(buf, to_is(buf, inst));
+    values[slicetemplate::image_position] = join_numbers(image_position().size(), image_position().data());
+    values[slicetemplate::slice_location].assign(buf, to_ds(buf, -image_position(2)));
+    image_position(2) -= image().header().res(2);
+    return values;
+}
+
+
+tomo::slicetemplate tomo::ctseries::make_template(const std::array<std::string, slicetemplate::nfields> &values)
+{
+    insert(DCM_SOPInstanceUID, values[slicetemplate::instance_uid].c_str());
+    insert(DCM_InstanceNumber, values[slicetemplate::instance_number].c_str());
+    insert(DCM_ImagePositionPatient, values[slicetemplate::image_position].c_str());
+    insert(DCM_SliceLocation, values[slicetemplate::slice_location].c_str());
+    return slicetemplate(dcm(), frame_len() * sizeof (uint16_t));
+}
+
+
+void tomo::ctseries::prefetch(frame &f, tomo::volume<uint16_t> &px, size_t len, int idx)
+{
+    if (!f.px) {
+        f.px.reset(new uint16_t[len]);
+    }
+    f.fill.run([&f, &px, len, idx]() {
+        /* The byte swap happens here, straight into the element buffer, and
+        the mapped pages go back to the kernel as soon as they are consumed */
+        px.read(idx * len, len, f.px.get());
+        px.release(idx * len, len);
+    });
+}
+
+
+/** Owns the mapping, so that the series can go before the sink is done. The
+ *  frames are read ahead on the scheduler, from whichever thread pulls them */
+class tomo::ctseries::framestream {
+    tomo::volume<uint16_t> m_px;
+    size_t m_len;
+    int m_nframes;
+    int m_next;
+    std::array<frame, ring_depth> m_ring;   /* After m_px, to go first */
+
+public:
+    framestream(tomo::volume<uint16_t> &&px, size_t len, int nframes):
+        m_px(std::move(px)),
+        m_len(len),
+        m_nframes(nframes),
+        m_next(0)
+    {
+        for (int k = 0; k < nframes && k < (int)m_ring.size(); k++) {
+            prefetch(m_ring[k], m_px, m_len, k);
+        }
+    }
+
+    /** At most the ring, and the frame just taken out of it, are in memory */
+    static constexpr size_t resident(size_t len) noexcept
+    {
+        return (ring_depth + 1) * len * sizeof (uint16_t);
+    }
+
+    bool operator()(outbuf &buf)
+    {
+        frame &f = m_ring[m_next % m_ring.size()];
+        const uint16_t *px;
+
+        if (m_next == m_nframes) {
+            return false;
+        }
+        f.fill.wait();
+        px = f.px.get();
+        buf = { std::shared_ptr<const void>(std::move(f.px)), px, m_len * sizeof (uint16_t) };
+        if (m_next + m_ring.size() < (size_t)m_nframes) {
+            prefetch(f, m_px, m_len, m_next + m_ring.size());
+        }
+        m_next++;
+        return true;
+    }
+};
+
+
+void tomo::ctseries::flush_multiframe(tomo::sink &out, const std::filesystem::path &dir, bool dry_run)
+{
+    const size_t pxlen = nframes() * frame_len() * sizeof (uint16_t);
+    std::shared_ptr<framestream> frames;
+    std::filesystem::path path;
+    std::vector<char> header;
+    outbuf buf;
+
+    if (pxlen > 0xfffffffe) {
+        throw std::runtime_error("CT volume is too large for a DICOM element");
+    }
+
+    /* The first frames are read while the rest of the dataset is encoded */
+    frames = std::make_shared<framestream>(std::move(px_data()), frame_len(), nframes());
+    write_patient_attributes();
+    insert(DCM_SOPInstanceUID, refs().uid(1).c_str());
+    header = encode(dcm());
+
+    /* The frames follow the PixelData header one by one, as they are */
+    append_pixel_header(header, pxlen);
+    if (dry_run) {
+        /* Every frame is still read, as the slices would be */
+        while ((*frames)(buf)) {
+        }
+        return;
+    }
+    path = dir;
+    path.append("CT" + refs().uid(1) + ".dcm");
+    out.write(path, { outbuf::adopt(std::move(header)) },
+              [frames](outbuf &next) { return (*frames)(next); },
+              pxlen, framestream::resident(frame_len()));
+}
+
+
+void tomo::ctseries::flush(tomo::sink &out, const std::filesystem::path &dir, bool dry_run)
+{
+    /* One per distinct set of value lengths, which only change when a number
+    gains a digit, so there are a handful of these at most */
+    std::map<slicetemplate::lengths_t, slicetemplate> templates;
+    std::array<std::string, slicetemplate::nfields> values;
+    std::array<frame, ring_depth> ring;
+    std::filesystem::path path;
     int inst;
 
-    data.resize(frame_len());
-    it = px_data().data();
-    end = it + frame_len();
+    if (refs().multiframe()) {
+        flush_multiframe(out, dir, dry_run);
+        return;
+    }
+    for (inst = 0; inst < nframes() && inst < (int)ring.size(); inst++) {
+        prefetch(ring[inst], px_data(), frame_len(), inst);
+    }
+    write_patient_attributes();
     for (inst = 1; inst <= nframes(); inst++) {
-        /* Put this in another function */
-        snprintf(buf, sizeof buf, "%s.%d", uid().c_str(), inst);
-        insert(DCM_SOPInstanceUID, buf);
-        insert(DCM_InstanceNumber, inst);
-        insert(DCM_ImagePositionPatient, image_position().size(), image_position().data());
-        insert(DCM_SliceLocation, -image_position(2));
-        image_position(2) -= image().header().res(2);
-        std::transform(it, end, data.begin(), [this](auto x){
-            /* Leaving this as a std::transform just in case I do actually need
-            to modulate the data later */
-            return x;
-        });
-        it = end;
-        end += frame_len();
-        insert_pixels(data);
-        snprintf(buf, sizeof buf, "CT%s.%d.dcm", uid().c_str(), inst);
-        path = dir;
-        path.append(buf);
+        frame &f = ring[(inst - 1) % ring.size()];
+        const uint16_t *px;
+
+        values = slice_values(inst);
+        auto it = templates.find(slicetemplate::lengths(values));
+        if (it == templates.end()) {
+            it = templates.emplace(slicetemplate::lengths(values), make_template(values)).first;
+        }
+        it->second.patch(values);
+        f.fill.wait();
+        px = f.px.get();
         if (!dry_run) {
-            save_file(path);
+            path = dir;
+            path.append("CT" + values[slicetemplate::instance_uid] + ".dcm");
+            out.write(path, {
+                outbuf::adopt(std::vector<char>(it->second.bytes())),
+                { std::shared_ptr<const void>(std::move(f.px)), px, frame_len() * sizeof (uint16_t) }
+            });
+        }
+        if (inst - 1 + ring.size() < (size_t)nframes()) {
+            prefetch(f, px_data(), frame_len(), inst - 1 + ring.size());
         }
     }
 }
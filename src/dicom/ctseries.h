@@ -3,32 +3,72 @@
 #ifndef CTSERIES_H
 #define CTSERIES_H
 
+#include <map>
+#include <memory>
 #include "image.h"
 #include "ivdt.h"
 #include "dicom.h"
 #include "archive.h"
+#include "scheduler.h"
+#include "slicetemplate.h"
+#include "imageref.h"
 
 
 namespace tomo {
 
 
 class ctseries: public dicom {
+    /** One slot in the ring of axial frames that are read ahead of the encoder.
+     *  The pixels are swapped straight into a buffer that is handed over to the
+     *  output sink as is, and the slot gets a fresh one
+     */
+    struct frame {
+        std::unique_ptr<uint16_t[]> px;
+        tomo::taskgroup fill;   /* Last, so it is waited on before px dies */
+    };
+
+    /** Frames resident at once. Memory stays flat no matter how many slices
+     *  the scan has */
+    static constexpr size_t ring_depth = 4;
+
+    /** The frames of an Enhanced CT file, for the sink to pull through a ring
+     *  of their own as it writes them */
+    class framestream;
+
     /** The CT volume itself. This is the only information required for this
      *  DICOM */
     const tomo::image &m_image;
 
     std::array<float, 3> m_imgpos;
-    std::vector<uint16_t> m_pxdata;
+    tomo::volume<uint16_t> m_pxdata;
     size_t m_framelen;
 
+    std::shared_ptr<const tomo::imageref> m_refs;   /* Slice UIDs */
+
 
     /** @brief Convert from their coordinate system to DICOM's */
     void calc_geometry() noexcept;
     void load_pixel_data();
 
     void write_numeric_attributes();
+    void write_functional_groups();
     void write_attributes();
 
+    /** Formats the per-slice attributes of instance number @p inst */
+    std::array<std::string, slicetemplate::nfields> slice_values(int inst);
+
+    /** Serializes the invariant part of the dataset around @p values */
+    slicetemplate make_template(const std::array<std::string, slicetemplate::nfields> &values);
+
+    /** Queues frame @p idx of @p px, frames @p len elements long, to be read
+     *  into @p f */
+    static void prefetch(frame &f, tomo::volume<uint16_t> &px, size_t len, int idx);
+
+    /** Writes the whole volume as one Enhanced CT object. The frames stream
+     *  into the sink behind the rest of the dataset, and only the ring's worth
+     *  of them is in memory at once */
+    void flush_multiframe(tomo::sink &out, const std::filesystem::path &dir, bool dry_run);
+
 
     std::array<float, 3> &image_position() noexcept { return m_imgpos; }
     const std::array<float, 3> &image_position() const noexcept { return m_imgpos; }
@@ -42,7 +82,9 @@ class ctseries: public dicom {
 
     const tomo::image &image() const noexcept { return m_image; }
 
-    std::vector<uint16_t> &px_data() noexcept { return m_pxdata; }
+    tomo::volume<uint16_t> &px_data() noexcept { return m_pxdata; }
+
+    const tomo::imageref &refs() const noexcept { return *m_refs; }
 
 public:
     ctseries() = delete;
@@ -51,8 +93,10 @@ public:
              const tomo::image   &img);
 
 
-    /** @brief Writes the CT series to disk in @p dir */
-    virtual void flush(const std::filesystem::path &dir, bool dry_run) override;
+    /** @brief Writes the CT series to disk in @p dir, one slice at a time, or
+     *      as a single Enhanced CT file if the archive's image references say
+     *      so; see tomo::imageref */
+    virtual void flush(tomo::sink &out, const std::filesystem::path &dir, bool dry_run) override;
 
 
     /** @brief Gets the series instance UID of this CT volume */
@@ -1,5 +1,7 @@
 #include <dcmtk/dcmdata/dctk.h>
+#include <dcmtk/dcmdata/dcostrmb.h>
 #include "dicom.h"
+#include "numstr.h"
 
 
 tomo::dicom::insert_error::insert_error(const DcmTag &tag, OFCondition stat, const std::string &val):
@@ -35,27 +37,18 @@ void tomo::dicom::insert(const DcmTag &key, const char *value)
 }
 
 
-template <class AppendT>
-static std::string dicom_string(size_t n, const AppendT x[])
-{
-    std::stringstream ss;
-
-    if (n) {
-        ss << *x++;
-        while (--n) {
-            ss << '\\' << *x++;
-        }
-    }
-    return ss.str();
-}
-
-
 void tomo::dicom::insert(const DcmTag &key, size_t n, const std::string str[])
 {
     OFCondition stat;
     std::string val;
+    size_t i;
 
-    val = dicom_string(n, str);
+    for (i = 0; i < n; i++) {
+        if (i) {
+            val += '\\';
+        }
+        val += str[i];
+    }
     stat = dset()->putAndInsertString(key, val.c_str());
     if (stat.bad()) {
         throw insert_error(key, stat, val);
@@ -68,7 +61,7 @@ void tomo::dicom::insert(const DcmTag &key, size_t n, const long x[])
     OFCondition stat;
     std::string val;
 
-    val = dicom_string(n, x);
+    val = join_numbers(n, x);
     stat = dset()->putAndInsertString(key, val.c_str());
     if (stat.bad()) {
         throw insert_error(key, stat, val);
@@ -87,7 +80,7 @@ void tomo::dicom::insert(const DcmTag &key, size_t n, const float x[])
     OFCondition stat;
     std::string val;
 
-    val = dicom_string(n, x);
+    val = join_numbers(n, x);
     stat = dset()->putAndInsertString(key, val.c_str());
     if (stat.bad()) {
         throw insert_error(key, stat, val);
@@ -106,7 +99,7 @@ void tomo::dicom::insert(const DcmTag &key, size_t n, const double x[])
     OFCondition stat;
     std::string val;
 
-    val = dicom_string(n, x);
+    val = join_numbers(n, x);
     stat = dset()->putAndInsertString(key, val.c_str());
     if (stat.bad()) {
         throw insert_error(key, stat, val);
@@ -157,29 +150,87 @@ void tomo::dicom::insert(DcmElement *elem)
 }
 
 
-void tomo::dicom::insert_pixels(const std::vector<uint16_t> &data)
+void tomo::insert_contour_data(DcmItem *item, size_t n, const float x[], int precision)
 {
-    const Uint8 *pixels = reinterpret_cast<const Uint8 *>(data.data());
-    size_t len = data.size() * sizeof data[0];
+    static thread_local std::vector<char> buf;
+    std::unique_ptr<DcmDecimalString> elem;
     OFCondition stat;
+    size_t len;
 
-    stat = dset()->putAndInsertUint8Array(DCM_PixelData, pixels, len);
+    if (buf.size() < n * (ds_len + 1)) {
+        buf.resize(n * (ds_len + 1));
+    }
+    len = join_fixed(buf.data(), n, x, precision) - buf.data();
+    if (len > 0xfffffffe) {
+        throw std::runtime_error("Contour is too large for a DICOM element");
+    }
+    elem.reset(new DcmDecimalString(DCM_ContourData));
+    stat = elem->putString(buf.data(), (Uint32)len);
+    if (stat.good()) {
+        stat = item->insert(elem.get(), true);
+    }
     if (stat.bad()) {
-        std::stringstream ss;
-        ss << len << " pixels";
-        throw insert_error(DCM_PixelData, stat, ss.str());
+        throw dicom::insert_error(DCM_ContourData, stat, std::string(buf.data(), std::min<size_t>(len, 64)));
     }
+    elem.release();
 }
 
 
-void tomo::dicom::save_file(const std::filesystem::path &path)
+static void write_le(char *p, uint32_t x, size_t n)
 {
-    OFCondition stat;
+    while (n--) {
+        *p++ = (char)(x & 0xff);
+        x >>= 8;
+    }
+}
 
-    stat = dcm().saveFile(path.string(), EXS_LittleEndianImplicit);
+
+std::vector<char> tomo::encode(DcmFileFormat &dcm, E_EncodingType enctype)
+{
+    char buf[1 << 16];
+    DcmOutputBufferStream out(buf, sizeof buf);
+    std::vector<char> bytes;
+    OFCondition stat;
+    offile_off_t n;
+    void *p;
+
+    /* Preamble and magic on top of what DCMTK counts */
+    bytes.reserve(dcm.calcElementLength(EXS_LittleEndianImplicit, enctype) + 132);
+
+    /* The buffer stream hands control back every time it fills up */
+    dcm.transferInit();
+    do {
+        stat = dcm.write(out, EXS_LittleEndianImplicit, enctype, nullptr,
+                         EGL_recalcGL, EPD_noChange, 0, 0, 0, EWM_updateMeta);
+        out.flushBuffer(p, n);
+        bytes.insert(bytes.end(), (char *)p, (char *)p + n);
+    } while (stat == EC_StreamNotifyClient);
+    dcm.transferEnd();
     if (stat.bad()) {
         throw std::runtime_error(stat.text());
     }
+    return bytes;
+}
+
+
+/** Implicit VR little endian, as encode writes: tag, then a 4-byte length */
+void tomo::append_pixel_header(std::vector<char> &bytes, size_t pxlen)
+{
+    const size_t pos = bytes.size();
+
+    if (pxlen > 0xfffffffe) {
+        throw std::runtime_error("Pixel data is too large for a DICOM element");
+    }
+    bytes.resize(pos + 8);
+    write_le(&bytes[pos], DCM_PixelData.getGroup(), 2);
+    write_le(&bytes[pos + 2], DCM_PixelData.getElement(), 2);
+    write_le(&bytes[pos + 4], (uint32_t)pxlen, 4);
+}
+
+
+void tomo::dicom::save_file(tomo::sink &out, const std::filesystem::path &path)
+{
+    out.write(path, { outbuf::adopt(encode(dcm())) });
 }
 
 
@@ -232,6 +283,5 @@ tomo::dicom::dicom(const tomo::archive &arch, const tomo::disease &dis):
     m_arch(arch),
     m_disease(dis)
 {
-    write_patient_attributes();
     write_current_datetime();
 }
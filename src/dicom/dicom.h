@@ -6,6 +6,8 @@
 #include <filesystem>
 #include <dcmtk/dcmdata/dcfilefo.h>
 #include "archive.h"
+#include "sink.h"
+#include "numstr.h"
 
 
 namespace tomo {
@@ -57,9 +59,12 @@ protected:
     void insert(const DcmTag &key, DcmItem *item);
     void insert(DcmElement *elem);
 
-    void insert_pixels(const std::vector<uint16_t> &data);
-    void save_file(const std::filesystem::path &path);
+    /** Encodes the file and hands it to @p out to be written to @p path */
+    void save_file(tomo::sink &out, const std::filesystem::path &path);
 
+    /** Waits for the patient's MRN lookup, see tomo::patient::mrn. Each
+     *  exporter calls it at the last moment before encoding, once its pixel
+     *  data is on the way */
     void write_patient_attributes();
     void write_current_datetime();
 
@@ -72,10 +77,33 @@ protected:
 public:
     dicom(const tomo::archive &arch, const tomo::disease &dis);
 
-    virtual void flush(const std::filesystem::path &dir, bool dry_run) = 0;
+    virtual void flush(tomo::sink &out, const std::filesystem::path &dir, bool dry_run) = 0;
 };
 
 
+/** @brief Encodes @p dcm in memory, exactly as DCMTK would write it to a file,
+ *      with the meta information updated to match the dataset
+ *  @throws std::runtime_error if DCMTK cannot encode it
+ */
+std::vector<char> encode(DcmFileFormat &dcm, E_EncodingType enctype = EET_UndefinedLength);
+
+
+/** @brief Appends the header of a PixelData element of @p pxlen bytes to
+ *      @p bytes, as encode writes them, for the pixels to follow as they are.
+ *      PixelData has the highest tag in an image, so it goes last
+ *  @throws std::runtime_error if @p pxlen does not fit in the element
+ */
+void append_pixel_header(std::vector<char> &bytes, size_t pxlen);
+
+
+/** @brief Inserts the @p n coordinates at @p x into @p item as its ContourData,
+ *      with @p precision decimals each. The text is made in a buffer that each
+ *      thread keeps, see join_fixed, and copied into the element once
+ *  @throws tomo::dicom::insert_error on failure
+ */
+void insert_contour_data(DcmItem *item, size_t n, const float x[], int precision = 3);
+
+
 /** @brief Insert @p key @p val pair into the DICOM item @p item
  *  @throws tomo::dicom::insert_error on failure
  */
@@ -90,35 +118,46 @@ static inline void insert_wrap(DcmItem *item, const DcmTag &key, const char *val
 }
 
 
-template <class ValT>
-static inline void insert_wrap(DcmItem *item, const DcmTag &key, ValT x)
+/** Insert an element of VR AT */
+static inline void insert_wrap(DcmItem *item, const DcmTag &key, const DcmTagKey &atval)
 {
-    std::stringstream ss;
     OFCondition stat;
 
-    ss << x;
-    stat = item->putAndInsertString(key, ss.str().c_str());
+    stat = item->putAndInsertTagKey(key, atval);
     if (stat.bad()) {
-        throw tomo::dicom::insert_error(key, stat, ss.str().c_str());
+        throw tomo::dicom::insert_error(key, stat, DcmTag(atval).getTagName());
     }
 }
 
 
+static inline void insert_wrap(DcmItem *item, const DcmTag &key, const std::string &val)
+{
+    insert_wrap(item, key, val.c_str());
+}
+
+
+/** Numbers go through a buffer on the stack, see numstr.h */
+template <class ValT>
+requires std::is_arithmetic_v<ValT>
+static inline void insert_wrap(DcmItem *item, const DcmTag &key, ValT x)
+{
+    char buf[ds_len + 1];
+
+    *to_dicom(buf, x) = '\0';
+    insert_wrap(item, key, buf);
+}
+
+
 template <class ValT>
-static inline void insert_wrap(DcmItem *item, const DcmTag &key, size_t n, ValT x)
+static inline void insert_wrap(DcmItem *item, const DcmTag &key, size_t n, const ValT x[])
 {
-    std::stringstream ss;
     OFCondition stat;
+    std::string val;
 
-    if (n) {
-        ss << *x++;
-        while (--n) {
-            ss << '\\' << *x++;
-        }
-    }
-    stat = item->putAndInsertString(key, ss.str().c_str());
+    val = join_numbers(n, x);
+    stat = item->putAndInsertString(key, val.c_str());
     if (stat.bad()) {
-        throw tomo::dicom::insert_error(key, stat, ss.str().c_str());
+        throw tomo::dicom::insert_error(key, stat, val);
     }
 }
 
@@ -133,21 +172,13 @@ static inline void insert_wrap(DcmItem      *item,
                                FloatT        x[],
                                int           precision)
 {
-    std::stringstream ss;
     OFCondition stat;
+    std::string val;
 
-    static_assert(std::is_floating_point<FloatT>::value);
-
-    if (n) {
-        ss << std::setprecision(precision) << std::fixed;
-        ss << *x++;
-        while (--n) {
-            ss << '\\' << *x++;
-        }
-    }
-    stat = item->putAndInsertString(key, ss.str().c_str());
+    val = join_numbers(n, x, precision);
+    stat = item->putAndInsertString(key, val.c_str());
     if (stat.bad()) {
-        throw tomo::dicom::insert_error(key, stat, ss.str().c_str());
+        throw tomo::dicom::insert_error(key, stat, val);
     }
 }
 
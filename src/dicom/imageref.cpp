@@ -0,0 +1,98 @@
+#include <dcmtk/dcmdata/dctk.h>
+#include <algorithm>
+#include "imageref.h"
+#include "dicom.h"
+
+
+DcmItem *tomo::imageref::make_item(int inst) const
+{
+    std::unique_ptr<DcmItem> item(new DcmItem);
+
+    if (multiframe()) {
+        tomo::insert_wrap(item.get(), DCM_ReferencedSOPClassUID, UID_EnhancedCTImageStorage);
+        tomo::insert_wrap(item.get(), DCM_ReferencedSOPInstanceUID, uid(inst));
+        tomo::insert_wrap(item.get(), DCM_ReferencedFrameNumber, inst);
+    } else {
+        tomo::insert_wrap(item.get(), DCM_ReferencedSOPClassUID, UID_CTImageStorage);
+        tomo::insert_wrap(item.get(), DCM_ReferencedSOPInstanceUID, uid(inst));
+    }
+    return item.release();
+}
+
+
+tomo::imageref::imageref(const std::string &uid, int n, bool multiframe):
+    m_series(uid),
+    m_multiframe(multiframe)
+{
+    char buf[is_len];
+    int i;
+
+    /* One UID for the whole series when it is a single object */
+    for (i = 1; i <= (multiframe ? std::min(n, 1) : n); i++) {
+        m_uids.push_back(m_series + '.' + std::string(buf, to_is(buf, i)));
+    }
+    m_items.reserve(n > 0 ? n : 0);
+    for (i = 1; i <= n; i++) {
+        m_items.emplace_back(make_item(i));
+    }
+}
+
+
+std::string tomo::imageref::uid(int inst) const
+{
+    char buf[is_len];
+
+    if (multiframe()) {
+        inst = 1;
+    }
+    if (inst >= 1 && inst <= (int)m_uids.size()) {
+        return m_uids[inst - 1];
+    }
+    return m_series + '.' + std::string(buf, to_is(buf, inst));
+}
+
+
+DcmItem *tomo::imageref::item(int inst) const
+{
+    if (inst >= 1 && inst <= size()) {
+        return new DcmItem(*m_items[inst - 1]);
+    }
+    return make_item(inst);
+}
+
+
+DcmSequenceOfItems *tomo::imageref::sequence(const DcmTag &key) const
+{
+    std::unique_ptr<DcmSequenceOfItems> seq(new DcmSequenceOfItems(key));
+    std::unique_ptr<DcmItem> item;
+
+    for (const auto &proto: m_items) {
+        item.reset(new DcmItem(*proto));
+        tomo::insert_wrap(seq.get(), item.get());
+        item.release();
+    }
+    return seq.release();
+}
+
+
+std::shared_ptr<const tomo::imageref> tomo::imagerefs::get(const std::string &uid, int n)
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    auto &ref = m_refs[{ uid, n }];
+
+    /* Made under the lock. It is a few hundred small items at most, and the
+    exporters that would wait are the ones that want it */
+    if (!ref) {
+        ref = std::make_shared<const imageref>(uid, n, m_multiframe);
+    }
+    return ref;
+}
+
+
+void tomo::imagerefs::clear(bool multiframe)
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+
+    m_refs.clear();
+    m_multiframe = multiframe;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#ifndef IMAGEREF_H
+#define IMAGEREF_H
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <dcmtk/dcmdata/dcitem.h>
+#include <dcmtk/dcmdata/dcsequen.h>
+
+
+namespace tomo {
+
+
+/** The SOP instance UIDs of the slices of a CT series, "<series uid>.<n>" for
+ *  n from 1, and an item referencing each one. The CT, its dose and its
+ *  structure sets all refer to the same slices, so the table is made once and
+ *  every exporter clones the items out of it
+ *
+ *  When the series is written as a single Enhanced CT object instead, every
+ *  slice is a frame of the instance "<series uid>.1", and the items reference
+ *  it by frame number
+ */
+class imageref {
+    std::string m_series;
+    std::vector<std::string> m_uids;
+    std::vector<std::unique_ptr<DcmItem>> m_items;
+    bool m_multiframe;
+
+    /** A reference item made from scratch */
+    DcmItem *make_item(int inst) const;
+
+public:
+    /** @brief Makes the table for the @p n slices of series @p uid
+     *  @throws tomo::dicom::insert_error if an item cannot be made
+     */
+    imageref(const std::string &uid, int n, bool multiframe = false);
+
+    imageref(const imageref &) = delete;
+    imageref &operator=(const imageref &) = delete;
+
+
+    int size() const noexcept { return (int)m_items.size(); }
+
+    /** Whether the series is one Enhanced CT object */
+    bool multiframe() const noexcept { return m_multiframe; }
+
+    /** @brief SOP instance UID of slice @p inst. Instances outside the series
+     *      get the UID they would have had, but it is not kept */
+    std::string uid(int inst) const;
+
+    /** @brief A copy of the item that references slice @p inst, with its SOP
+     *      class and instance UID. The caller owns it */
+    DcmItem *item(int inst) const;
+
+    /** @brief A new sequence @p key that references every slice in order.
+     *      The caller owns it */
+    DcmSequenceOfItems *sequence(const DcmTag &key) const;
+};
+
+
+/** The imageref tables of one archive, made as the first exporter asks for
+ *  each. Exporters on different threads may ask at once */
+class imagerefs {
+    std::map<std::pair<std::string, int>, std::shared_ptr<const imageref>> m_refs;
+    std::mutex m_mtx;
+    bool m_multiframe;
+
+public:
+    imagerefs() noexcept: m_multiframe(false) { }
+
+
+    /** @brief The table for the @p n slices of series @p uid */
+    std::shared_ptr<const imageref> get(const std::string &uid, int n);
+
+    /** @brief Drops every table, and makes the next ones for CT series
+     *      written as Enhanced CT if @p multiframe. Exporters still holding
+     *      a table keep it */
+    void clear(bool multiframe = false);
+};
+
+
+};
+
+
+#endif /* IMAGEREF_H */
@@ -0,0 +1,131 @@
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include "numstr.h"
+
+
+char *tomo::to_is(char *out, long long x)
+{
+    if (x < INT32_MIN || x > INT32_MAX) {
+        throw std::runtime_error("Integer string out of range: " + std::to_string(x));
+    }
+    return std::to_chars(out, out + is_len, x).ptr;
+}
+
+
+/** Shortest round trip for a float is at most 9 significant digits, which
+ *  with a sign, point and exponent always comes in under ds_len
+ */
+char *tomo::to_ds(char *out, float x) noexcept
+{
+    return std::to_chars(out, out + ds_len, x).ptr;
+}
+
+
+char *tomo::to_ds(char *out, double x) noexcept
+{
+    char buf[32];
+    std::to_chars_result res;
+    int prec;
+
+    res = std::to_chars(out, out + ds_len, x);
+    if (res.ec == std::errc()) {
+        return res.ptr;
+    }
+    /* Up to 17 digits, too many. Take away significant digits until it fits,
+    which also takes care of the exponent losing its point and sign */
+    for (prec = 16; ; prec--) {
+        res = std::to_chars(buf, buf + sizeof buf, x, std::chars_format::general, prec);
+        if (res.ptr - buf <= (ptrdiff_t)ds_len || prec == 1) {
+            break;
+        }
+    }
+    memcpy(out, buf, res.ptr - buf);
+    return out + (res.ptr - buf);
+}
+
+
+char *tomo::to_ds(char *out, double x, int precision) noexcept
+{
+    std::to_chars_result res;
+
+    res = std::to_chars(out, out + ds_len, x, std::chars_format::fixed, precision);
+    if (res.ec != std::errc()) {
+        return to_ds(out, x);
+    }
+    return res.ptr;
+}
+
+
+/** Writes @p q / 10^@p prec, right to left */
+static char *put_fixed(char *out, uint64_t q, bool neg, int prec) noexcept
+{
+    char buf[32], *p = buf + sizeof buf;
+    int i;
+
+    for (i = 0; i < prec; i++) {
+        *--p = (char)('0' + q % 10);
+        q /= 10;
+    }
+    if (prec) {
+        *--p = '.';
+    }
+    do {
+        *--p = (char)('0' + q % 10);
+        q /= 10;
+    } while (q);
+    if (neg) {
+        *--p = '-';
+    }
+    memcpy(out, p, buf + sizeof buf - p);
+    return out + (buf + sizeof buf - p);
+}
+
+
+char *tomo::join_fixed(char *out, size_t n, const float x[], int precision) noexcept
+{
+    static constexpr double scales[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8 };
+    constexpr size_t block = 256;
+    double q[block], scale;
+    size_t i, j, m;
+    char *end;
+
+    if (precision < 0 || precision > 8) {
+        for (i = 0; i < n; i++) {
+            if (i) {
+                *out++ = '\\';
+            }
+            out = to_ds(out, x[i], precision);
+        }
+        return out;
+    }
+    /* A float has 24 significant bits and 10^8 needs 27, so each product is
+    exact in a double, and rounding it half to even rounds the float exactly
+    as to_chars does. This pass has no branches and vectorizes */
+    scale = scales[precision];
+    for (i = 0; i < n; i += block) {
+        m = std::min(block, n - i);
+        for (j = 0; j < m; j++) {
+            q[j] = std::nearbyint((double)x[i + j] * scale);
+        }
+        for (j = 0; j < m; j++) {
+            if (i + j) {
+                *out++ = '\\';
+            }
+            /* Too long, infinite or NaN, none of which are coordinates */
+            if (std::fabs(q[j]) < 1e15) {
+                end = put_fixed(out, (uint64_t)std::fabs(q[j]), std::signbit(x[i + j]), precision);
+                if (end - out <= (ptrdiff_t)ds_len) {
+                    out = end;
+                    continue;
+                }
+            }
+            out = to_ds(out, x[i + j], precision);
+        }
+    }
+    return out;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#ifndef NUMSTR_H
+#define NUMSTR_H
+
+#include <cstddef>
+#include <string>
+#include <type_traits>
+
+
+namespace tomo {
+
+
+/** Longest values of VR DS and IS that DICOM allows, in characters */
+constexpr size_t ds_len = 16;
+constexpr size_t is_len = 12;
+
+
+/** @brief Writes @p x as a DICOM IS to @p out, which must have room for is_len
+ *      characters. Nothing is terminated
+ *  @returns One past the last character written
+ *  @throws std::runtime_error if @p x is not a 32-bit signed integer
+ */
+char *to_is(char *out, long long x);
+
+/** @brief Writes @p x as a DICOM DS to @p out, which must have room for ds_len
+ *      characters. This is the shortest string that reads back as @p x, or,
+ *      when that does not fit, the closest one that does
+ *  @returns One past the last character written
+ */
+char *to_ds(char *out, float x) noexcept;
+char *to_ds(char *out, double x) noexcept;
+
+/** @brief Writes @p x as a DICOM DS with @p precision digits after the point,
+ *      or as to_ds(out, x) if that would not fit in ds_len characters
+ */
+char *to_ds(char *out, double x, int precision) noexcept;
+
+/** @brief Writes the @p n values at @p x as a multi-valued DS, each with
+ *      @p precision digits after the point, exactly as to_ds(out, x, precision)
+ *      would one by one. For coordinates in bulk, e.g. ContourData
+ *  @param out
+ *      Room for n * (ds_len + 1) characters
+ *  @returns One past the last character written
+ */
+char *join_fixed(char *out, size_t n, const float x[], int precision) noexcept;
+
+
+/** Integers as IS, everything else as DS */
+template <class T>
+char *to_dicom(char *out, T x)
+{
+    static_assert(std::is_arithmetic_v<T>);
+
+    if constexpr (std::is_integral_v<T>) {
+        return to_is(out, x);
+    } else {
+        return to_ds(out, x);
+    }
+}
+
+
+/** @brief The values of a multi-valued DS or IS, separated by '\\'. This
+ *      makes the one allocation for the string it returns
+ *  @param fmt
+ *      Called as fmt(out, x) for each value, returning one past its end
+ */
+template <class T, class FmtT>
+std::string join_numbers(size_t n, const T x[], FmtT fmt)
+{
+    std::string str(n * (ds_len + 1), '\0');
+    char *begin = str.data(), *p = begin;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (i) {
+            *p++ = '\\';
+        }
+        p = fmt(p, x[i]);
+    }
+    str.resize(p - begin);
+    return str;
+}
+
+
+template <class T>
+std::string join_numbers(size_t n, const T x[])
+{
+    return join_numbers(n, x, [](char *out, T v) { return to_dicom(out, v); });
+}
+
+
+/** Floating-point DS with a fixed number of decimals each */
+template <class T>
+std::string join_numbers(size_t n, const T x[], int precision)
+{
+    static_assert(std::is_floating_point_v<T>);
+
+    return join_numbers(n, x, [precision](char *out, T v) { return to_ds(out, v, precision); });
+}
+
+
+};
+
+
+#endif /* NUMSTR_H */
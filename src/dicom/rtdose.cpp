@@ -1,19 +1,30 @@
 #include <dcmtk/dcmdata/dctk.h>
 #include <cmath>
 #include "rtdose.h"
+#include "imageref.h"
+#include "../scheduler.h"
 #include "../log.h"
 
 using namespace std::literals;
 
 
-void tomo::rtdose::compute_grid_scaling() noexcept
+void tomo::rtdose::compute_grid_scaling()
 {
+    std::vector<float> maxes(nframes(), 0.0f);
+    tomo::taskgroup tasks;
     float max = 0.0f;
+    size_t k;
 
-    std::for_each(px_data().begin(), px_data().end(),
-        [&max](float x) {
-            max = std::max(max, x);
+    /* Straight off the mapping, nothing is converted to keep */
+    for (k = 0; k < nframes(); k++) {
+        tasks.run([this, &maxes, k]() {
+            maxes[k] = bigendian_max(px_data().data() + k * frame_len(), frame_len(), 0.0f);
         });
+    }
+    tasks.wait();
+    for (float x: maxes) {
+        max = std::max(max, x);
+    }
     /* Dose grid scaling will be different than tomo's because Java */
     dose_grid_scaling() = max / (float)UINT16_MAX;
 }
@@ -25,7 +36,10 @@ void tomo::rtdose::load_dose()
     if (dose().header().datatype() != "Float_Data") {
         throw std::runtime_error("Unsupported dose pixel type: " + dose().header().datatype());
     }
-    px_data() = dose().load_file<float>(archive().dir());
+    px_data() = dose().map_file<float>(archive().dir());
+    if (px_data().size() < nframes() * frame_len()) {
+        throw std::runtime_error("Dose binary file is truncated");
+    }
     compute_grid_scaling();
 }
 
@@ -115,9 +129,9 @@ void tomo::rtdose::write_grid_frame_offset_vec()
 void tomo::rtdose::write_numeric_attributes()
 {
     std::array<float, 6> orient = { 1, 0, 0, 0, 1, 0 };
-    char buf[50];
+    char buf[ds_len + 1];
 
-    std::snprintf(buf, sizeof buf, "%e", dose_grid_scaling());
+    *to_ds(buf, dose_grid_scaling()) = '\0';
     insert(DCM_SliceThickness, dose().header().res(2));
     insert(DCM_InstanceNumber, instance());
     insert(DCM_ImagePositionPatient, image_position().size(), image_position().data());
@@ -156,20 +170,10 @@ static itemptr_t make_ref_seq_item(const char *sop, const char *uid)
 
 void tomo::rtdose::write_reference_img_seq()
 {
-    const char *ctuid = image().dbinfo().uid().c_str();
-    const int n = image().header().dim(2);
-    itemptr_t item;
+    auto refs = archive().image_refs().get(image().dbinfo().uid(), image().header().dim(2));
     seqptr_t seq;
-    char uid[65];
-    int i;
-
-    seq = seqptr_t(new DcmSequenceOfItems(DCM_ReferencedImageSequence));
-    for (i = 0; i < n; i++) {
-        snprintf(uid, sizeof uid, "%s.%d", ctuid, i + 1);
-        item = make_ref_seq_item(UID_CTImageStorage, uid);
-        insert_wrap(seq.get(), item.get());
-        item.release();
-    }
+
+    seq.reset(refs->sequence(DCM_ReferencedImageSequence));
     insert(seq.get());
     seq.release();
 }
@@ -246,21 +250,37 @@ tomo::rtdose::rtdose(const tomo::archive &arch,
 }
 
 
-void tomo::rtdose::flush(const std::filesystem::path &dir, bool dry_run)
+void tomo::rtdose::flush(tomo::sink &out, const std::filesystem::path &dir, bool dry_run)
 {
     char fbuf[80];
-    std::vector<uint16_t> data;
+    std::unique_ptr<DcmPixelData> pixels;
     std::filesystem::path path(dir);
+    tomo::taskgroup tasks;
+    OFCondition stat;
+    Uint16 *px;
+    float scale;
+    size_t k;
 
     std::snprintf(fbuf, sizeof fbuf, "RD%s.dcm", dose().dbinfo().uid().c_str());
     path.append(fbuf);
-    data.resize(px_data().size());
-    std::transform(px_data().begin(), px_data().end(), data.begin(),
-        [this](float x) {
-            return static_cast<uint16_t>(x / dose_grid_scaling());
+    pixels.reset(new DcmPixelData(DCM_PixelData));
+    stat = pixels->createUint16Array(nframes() * frame_len(), px);
+    if (stat.bad()) {
+        throw insert_error(DCM_PixelData, stat, "Dose grid buffer");
+    }
+    /* Quantize each frame straight from the mapping into the element */
+    scale = dose_grid_scaling() ? 1.0f / dose_grid_scaling() : 0.0f;
+    for (k = 0; k < nframes(); k++) {
+        tasks.run([this, px, scale, k]() {
+            bigendian_quantize(px_data().data() + k * frame_len(), frame_len(), scale, px + k * frame_len());
+            px_data().release(k * frame_len(), frame_len());
         });
-    insert_pixels(data);
+    }
+    write_patient_attributes();
+    tasks.wait();
+    insert(pixels.get());
+    pixels.release();
     if (!dry_run) {
-        save_file(path);
+        save_file(out, path);
     }
 }
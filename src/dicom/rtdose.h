@@ -23,7 +23,7 @@ class rtdose: public dicom {
 
     const tomo::image *m_dose;          /* The dose volume itself */
 
-    std::vector<float> m_pxdata;
+    tomo::volume<float> m_pxdata;
     float m_gridscal;
     float m_pxmax;
 
@@ -35,7 +35,7 @@ class rtdose: public dicom {
                     (0020,0013) InstanceNumber (I GUESS) */
 
 
-    void compute_grid_scaling() noexcept;
+    void compute_grid_scaling();
     void load_dose();
     void calc_geometry() noexcept;
 
@@ -57,8 +57,8 @@ class rtdose: public dicom {
     const tomo::image &image() const noexcept { return *m_image; }
     const tomo::image &dose() const noexcept { return *m_dose; }
 
-    std::vector<float> &px_data() noexcept { return m_pxdata; }
-    const std::vector<float> &px_data() const noexcept { return m_pxdata; }
+    tomo::volume<float> &px_data() noexcept { return m_pxdata; }
+    const tomo::volume<float> &px_data() const noexcept { return m_pxdata; }
 
     size_t &frame_len() noexcept { return m_framelen; }
     size_t frame_len() const noexcept { return m_framelen; }
@@ -81,7 +81,7 @@ public:
            const tomo::plan    &plan);
 
 
-    virtual void flush(const std::filesystem::path &dir, bool dry_run) override;
+    virtual void flush(tomo::sink &out, const std::filesystem::path &dir, bool dry_run) override;
 
 };
 
@@ -1,5 +1,6 @@
 #include <dcmtk/dcmdata/dctk.h>
 #include "rtstruct.h"
+#include "../scheduler.h"
 #include "log.h"
 
 
@@ -17,6 +18,7 @@ void tomo::rtstruct::find_plan_image()
     if (!m_image) {
         throw std::runtime_error("Missing plan image");
     }
+    m_refs = archive().image_refs().get(uid, image().header().dim(2));
 }
 
 
@@ -24,34 +26,14 @@ using seqptr_t = std::unique_ptr<DcmSequenceOfItems>;
 using itemptr_t = std::unique_ptr<DcmItem>;
 
 
-static seqptr_t make_contour_img_sequence(const std::string &uid, int ninsts)
-{
-    char uidbuf[65];
-    itemptr_t item;
-    seqptr_t seq;
-    int i;
-    
-    seq.reset(new DcmSequenceOfItems(DCM_ContourImageSequence));
-    for (i = 1; i <= ninsts; i++) {
-        item.reset(new DcmItem);
-        snprintf(uidbuf, sizeof uidbuf, "%s.%d", uid.c_str(), i);
-        tomo::insert_wrap(item.get(), DCM_ReferencedSOPClassUID, UID_CTImageStorage);
-        tomo::insert_wrap(item.get(), DCM_ReferencedSOPInstanceUID, uidbuf);
-        tomo::insert_wrap(seq.get(), item.get());
-        item.release();
-    }
-    return seq;
-}
-
-
-static seqptr_t make_ref_series_sequence(const std::string &uid, int ninsts)
+static seqptr_t make_ref_series_sequence(const std::string &uid, const tomo::imageref &refs)
 {
     seqptr_t seq, contour;
     itemptr_t item;
 
     seq.reset(new DcmSequenceOfItems(DCM_RTReferencedSeriesSequence));
     item.reset(new DcmItem);
-    contour = make_contour_img_sequence(uid, ninsts);
+    contour.reset(refs.sequence(DCM_ContourImageSequence));
     tomo::insert_wrap(item.get(), DCM_SeriesInstanceUID, uid.c_str());
     tomo::insert_wrap(item.get(), contour.get());
     contour.release();
@@ -61,16 +43,16 @@ static seqptr_t make_ref_series_sequence(const std::string &uid, int ninsts)
 }
 
 
-static seqptr_t make_ref_study_sequence(const std::string &studyuid,
-                                        const std::string &imguid,
-                                        int                ninsts)
+static seqptr_t make_ref_study_sequence(const std::string    &studyuid,
+                                        const std::string    &imguid,
+                                        const tomo::imageref &refs)
 {
     seqptr_t seq, refseries;
     itemptr_t item;
 
     seq.reset(new DcmSequenceOfItems(DCM_RTReferencedStudySequence));
     item.reset(new DcmItem);
-    refseries = make_ref_series_sequence(imguid, ninsts);
+    refseries = make_ref_series_sequence(imguid, refs);
     tomo::insert_wrap(item.get(), DCM_ReferencedSOPClassUID, UID_RETIRED_DetachedStudyManagementSOPClass);
     tomo::insert_wrap(item.get(), DCM_ReferencedSOPInstanceUID, studyuid.c_str());
     tomo::insert_wrap(item.get(), refseries.get());
@@ -87,7 +69,7 @@ void tomo::rtstruct::write_frame_of_ref_seq()
     seqptr_t seq;
 
     item.reset(new DcmItem);
-    seq = make_ref_study_sequence(disease().dcm_studies()[0].uid(), image().dbinfo().uid(), image().header().dim(2));
+    seq = make_ref_study_sequence(disease().dcm_studies()[0].uid(), image().dbinfo().uid(), refs());
     insert_wrap(item.get(), DCM_FrameOfReferenceUID, image().frame_of_ref().c_str());
     insert_wrap(item.get(), seq.get());
     seq.release();
@@ -117,18 +99,13 @@ void tomo::rtstruct::write_structset_roi_seq()
 }
 
 
-static seqptr_t make_contour_image_sequence(const std::string &ctuid,
-                                            int                idx)
+static seqptr_t make_contour_image_sequence(const tomo::imageref &refs, int idx)
 {
-    char uidbuf[65];
     itemptr_t item;
     seqptr_t res;
 
     res.reset(new DcmSequenceOfItems(DCM_ContourImageSequence));
-    item.reset(new DcmItem);
-    snprintf(uidbuf, sizeof uidbuf, "%s.%d", ctuid.c_str(), idx);
-    tomo::insert_wrap(item.get(), DCM_ReferencedSOPClassUID, UID_CTImageStorage);
-    tomo::insert_wrap(item.get(), DCM_ReferencedSOPInstanceUID, uidbuf);
+    item.reset(refs.item(idx));
     tomo::insert_wrap(res.get(), item.get());
     item.release();
     return res;
@@ -137,22 +114,21 @@ static seqptr_t make_contour_image_sequence(const std::string &ctuid,
 
 /** Returns an empty unique_ptr if the roi is empty */
 static seqptr_t make_contour_sequence(const tomo::roi             &roi,
-                                      const std::string           &ctuid,
+                                      const tomo::imageref        &refs,
                                       const std::filesystem::path &dir)
 {
     static const char *geom_type = "CLOSED_PLANAR";
-    std::vector<tomo::roi::curve> curves;
     seqptr_t res = { }, imgseq;
     itemptr_t item;
 
-    curves = roi.load_file(dir);
+    /* Each curve goes into its item as soon as it is read */
     res.reset(new DcmSequenceOfItems(DCM_ContourSequence));
-    for (const auto &curve: curves) {
+    roi.read_curves(dir, [&](const tomo::roi::curve &curve) {
         if (!curve.data().size()) {
-            continue;
+            return;
         }
         item.reset(new DcmItem);
-        imgseq = make_contour_image_sequence(ctuid, curve.instance_num());
+        imgseq = make_contour_image_sequence(refs, curve.instance_num());
         tomo::insert_wrap(item.get(), imgseq.get());
         imgseq.release();
         tomo::insert_wrap(item.get(), DCM_ContourGeometricType, geom_type);
@@ -161,10 +137,10 @@ static seqptr_t make_contour_sequence(const tomo::roi             &roi,
         tomo::insert_wrap(item.get(), DCM_RETIRED_ContourSlabThickness, 3);
         tomo::insert_wrap(item.get(), DCM_RETIRED_ContourOffsetVector, 3, (const float[]){ 0, 0, 0 }); */
         tomo::insert_wrap(item.get(), DCM_NumberOfContourPoints, curve.data().size() / 3);
-        tomo::insert_wrap(item.get(), DCM_ContourData, curve.data().size(), curve.data().data(), 3);
+        tomo::insert_contour_data(item.get(), curve.data().size(), curve.data().data());
         tomo::insert_wrap(res.get(), item.get());
         item.release();
-    }
+    });
     if (!res->card()) {
         /* If it's empty delete it */
         res.reset();
@@ -175,13 +151,29 @@ static seqptr_t make_contour_sequence(const tomo::roi             &roi,
 
 void tomo::rtstruct::write_roi_contour_seq()
 {
+    const auto &roilist = structure_set().roilist();
+    std::vector<seqptr_t> contours(roilist.size());
     std::array<int, 3> color;
+    tomo::taskgroup tasks;
     seqptr_t rois, contour;
     itemptr_t item;
+    size_t i;
+
+    /* Each curve file is parsed, and its contour sequence built, on the pool.
+    The sequences are put together here in ROI order afterwards, so the file
+    comes out the same for any number of jobs */
+    for (i = 0; i < roilist.size(); i++) {
+        tasks.run([this, &roilist, &contours, i]() {
+            contours[i] = make_contour_sequence(roilist[i], refs(), archive().dir());
+        });
+    }
+    tasks.wait();
 
     rois.reset(new DcmSequenceOfItems(DCM_ROIContourSequence));
-    for (const auto &roi: structure_set().roilist()) {
-        contour = make_contour_sequence(roi, image().dbinfo().uid(), archive().dir());
+    for (i = 0; i < roilist.size(); i++) {
+        const tomo::roi &roi = roilist[i];
+
+        contour = std::move(contours[i]);
         if (!contour) {
             /* This ROI is empty ("ct iso" in the test file is not included) */
             continue;
@@ -269,14 +261,15 @@ tomo::rtstruct::rtstruct(const tomo::archive   &arch,
 }
 
 
-void tomo::rtstruct::flush(const std::filesystem::path &dir, bool dry_run)
+void tomo::rtstruct::flush(tomo::sink &out, const std::filesystem::path &dir, bool dry_run)
 {
     char fbuf[80];
     std::filesystem::path path(dir);
 
     snprintf(fbuf, sizeof fbuf, "RS%s.dcm", structure_set().dbinfo().uid().c_str());
     path.append(fbuf);
+    write_patient_attributes();
     if (!dry_run) {
-        save_file(path);
+        save_file(out, path);
     }
 }
@@ -5,6 +5,7 @@
 
 #include "archive.h"
 #include "dicom.h"
+#include "imageref.h"
 
 
 namespace tomo {
@@ -20,6 +21,8 @@ class rtstruct: public dicom {
     const tomo::image *m_image;         /* Plan CT. This must be found from the
                                         structure set key "associatedImage" */
 
+    std::shared_ptr<const tomo::imageref> m_refs;   /* Its slice UIDs */
+
 
     void find_plan_image();
 
@@ -34,13 +37,14 @@ class rtstruct: public dicom {
 
     const tomo::structset &structure_set() const noexcept { return m_structs; }
     const tomo::image &image() const noexcept { return *m_image; }
+    const tomo::imageref &refs() const noexcept { return *m_refs; }
 
 public:
     rtstruct(const tomo::archive   &arch,
              const tomo::disease   &dis,
              const tomo::structset &ss);
 
-    virtual void flush(const std::filesystem::path &dir, bool dry_run) override;
+    virtual void flush(tomo::sink &out, const std::filesystem::path &dir, bool dry_run) override;
 };
 
 
@@ -0,0 +1,163 @@
+#include <dcmtk/dcmdata/dctk.h>
+#include <cstring>
+#include <stdexcept>
+#include "slicetemplate.h"
+#include "dicom.h"
+
+using namespace std::literals;
+
+
+/** In the order of tomo::slicetemplate::field */
+static const DcmTagKey field_tags[] = {
+    DCM_SOPInstanceUID,
+    DCM_InstanceNumber,
+    DCM_ImagePositionPatient,
+    DCM_SliceLocation
+};
+
+
+static uint32_t tag_code(const DcmTagKey &key)
+{
+    return (uint32_t)key.getGroup() << 16 | key.getElement();
+}
+
+
+static uint32_t read_le(const char *p, size_t n)
+{
+    uint32_t x = 0;
+
+    while (n--) {
+        x = x << 8 | (uint8_t)p[n];
+    }
+    return x;
+}
+
+
+/** Explicit VRs with a 4-byte length after two reserved bytes */
+static bool long_vr(const char *vr)
+{
+    static const char *const vrs[] = {
+        "OB", "OD", "OF", "OL", "OV", "OW", "SQ", "SV", "UC", "UN", "UR", "UT", "UV"
+    };
+
+    for (const char *v: vrs) {
+        if (vr[0] == v[0] && vr[1] == v[1]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/** The file meta information is always explicit VR little endian */
+void tomo::slicetemplate::parse_meta(size_t &pos)
+{
+    const uint32_t meta_uid = tag_code(DCM_MediaStorageSOPInstanceUID);
+    uint32_t tag, len;
+    size_t hdr;
+
+    if (m_bytes.size() < 132 || memcmp(&m_bytes[128], "DICM", 4)) {
+        throw std::runtime_error("Slice template has no DICOM preamble");
+    }
+    m_meta_uid = 0;
+    for (pos = 132; pos + 8 <= m_bytes.size(); pos += hdr + len) {
+        tag = read_le(&m_bytes[pos], 2) << 16 | read_le(&m_bytes[pos + 2], 2);
+        if (tag >> 16 != 0x0002) {
+            break;
+        }
+        if (long_vr(&m_bytes[pos + 4])) {
+            hdr = 12;
+            len = read_le(&m_bytes[pos + 8], 4);
+        } else {
+            hdr = 8;
+            len = read_le(&m_bytes[pos + 6], 2);
+        }
+        if (tag == meta_uid) {
+            m_meta_uid = pos + hdr;
+        }
+    }
+    if (!m_meta_uid) {
+        throw std::runtime_error("Slice template has no media storage SOP instance UID");
+    }
+}
+
+
+/** The dataset is implicit VR little endian, see dicom::save_file */
+void tomo::slicetemplate::parse_dataset(size_t pos)
+{
+    uint32_t tag, len, last = 0;
+    size_t i;
+
+    m_offset.fill(0);
+    for (; pos + 8 <= m_bytes.size(); pos += 8 + len) {
+        tag = read_le(&m_bytes[pos], 2) << 16 | read_le(&m_bytes[pos + 2], 2);
+        len = read_le(&m_bytes[pos + 4], 4);
+        if (len == 0xffffffff) {
+            throw std::runtime_error("Slice template has an element of undefined length");
+        }
+        for (i = 0; i < nfields; i++) {
+            if (tag == tag_code(field_tags[i])) {
+                m_offset[i] = pos + 8;
+                m_len[i] = len;
+            }
+        }
+        last = tag;
+    }
+    for (i = 0; i < nfields; i++) {
+        if (!m_offset[i]) {
+            throw std::runtime_error("Slice template is missing "s + DcmTag(field_tags[i]).getTagName());
+        }
+    }
+    if (last >= tag_code(DCM_PixelData)) {
+        throw std::runtime_error("Slice template already has pixel data");
+    }
+}
+
+
+tomo::slicetemplate::slicetemplate(DcmFileFormat &dcm, size_t pxlen)
+{
+    size_t pos;
+
+    if (pxlen > 0xfffffffe) {
+        throw std::runtime_error("Slice is too large for a DICOM element");
+    }
+    /* Explicit lengths, so that the walk can skip over every element */
+    m_bytes = encode(dcm, EET_ExplicitLength);
+    parse_meta(pos);
+    parse_dataset(pos);
+
+    append_pixel_header(m_bytes, pxlen);
+}
+
+
+tomo::slicetemplate::lengths_t
+tomo::slicetemplate::lengths(const std::array<std::string, nfields> &values) noexcept
+{
+    lengths_t len;
+    size_t i;
+
+    for (i = 0; i < nfields; i++) {
+        len[i] = values[i].size() + (values[i].size() & 1);
+    }
+    return len;
+}
+
+
+void tomo::slicetemplate::patch(const std::array<std::string, nfields> &values)
+{
+    size_t i;
+    char pad;
+
+    if (lengths(values) != lengths()) {
+        throw std::logic_error("Slice values do not fit the template");
+    }
+    for (i = 0; i < nfields; i++) {
+        /* UIDs are padded with NUL, every other string VR with a space */
+        pad = i == instance_uid ? '\0' : ' ';
+        memcpy(&m_bytes[m_offset[i]], values[i].data(), values[i].size());
+        if (values[i].size() & 1) {
+            m_bytes[m_offset[i] + values[i].size()] = pad;
+        }
+    }
+    memcpy(&m_bytes[m_meta_uid], &m_bytes[m_offset[instance_uid]], m_len[instance_uid]);
+}
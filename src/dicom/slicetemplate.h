@@ -0,0 +1,76 @@
+#pragma once
+
+#ifndef SLICETEMPLATE_H
+#define SLICETEMPLATE_H
+
+#include <array>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <dcmtk/dcmdata/dcfilefo.h>
+
+
+namespace tomo {
+
+
+/** A DICOM file serialized once, with holes where the attributes that differ
+ *  between the slices of a series live. Every slice after the first is written
+ *  by patching those holes in place and handing the header and the pixels to
+ *  the output sink together, instead of re-encoding the whole dataset
+ *
+ *  The holes have a fixed size, so a template only fits slices whose values
+ *  encode to the same lengths as the slice it was made from; see lengths()
+ */
+class slicetemplate {
+public:
+    /** Attributes that change from one slice to the next */
+    enum field {
+        instance_uid,       /* Also patched into the file meta information */
+        instance_number,
+        image_position,
+        slice_location,
+        nfields
+    };
+
+    using lengths_t = std::array<size_t, nfields>;
+
+private:
+    std::vector<char> m_bytes;
+    std::array<size_t, nfields> m_offset;
+    lengths_t m_len;
+    size_t m_meta_uid;
+
+    void parse_meta(size_t &pos);
+    void parse_dataset(size_t pos);
+
+public:
+    /** @brief Serializes @p dcm, which must not contain pixel data yet, and
+     *      appends the header of a pixel data element of @p pxlen bytes
+     *  @throws std::runtime_error if the file cannot be encoded, or if any of
+     *      the per-slice attributes are missing from it
+     */
+    slicetemplate(DcmFileFormat &dcm, size_t pxlen);
+
+
+    /** @brief Encoded lengths of the given values, including the padding
+     *      byte that DICOM wants on odd-length values
+     */
+    static lengths_t lengths(const std::array<std::string, nfields> &values) noexcept;
+
+    const lengths_t &lengths() const noexcept { return m_len; }
+
+
+    /** @brief Overwrites every hole with @p values. Their lengths must match
+     *      this template's
+     */
+    void patch(const std::array<std::string, nfields> &values);
+
+    /** @brief Everything in the file up to the pixels themselves */
+    const std::vector<char> &bytes() const noexcept { return m_bytes; }
+};
+
+
+};
+
+
+#endif /* SLICETEMPLATE_H */
@@ -0,0 +1,323 @@
+#include <dcmtk/dcmdata/dctk.h>
+#include <dcmtk/dcmdata/dcistrmb.h>
+#include <dcmtk/dcmnet/assoc.h>
+#include <dcmtk/dcmnet/dimse.h>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include "storesink.h"
+#include "log.h"
+
+using namespace std::literals;
+
+
+/** Seconds to wait on the peer for association negotiation and for each
+ *  C-STORE response, and to connect */
+static constexpr int acse_timeout = 30;
+static constexpr int dimse_timeout = 60;
+
+/** Every SOP class the exporters write */
+static const char *const sop_classes[] = {
+    UID_CTImageStorage,
+    UID_EnhancedCTImageStorage,
+    UID_RTDoseStorage,
+    UID_RTStructureSetStorage
+};
+
+/** Explicit first, as most SCPs prefer. The datasets are re-encoded in
+ *  whichever the peer picks */
+static const char *transfer_syntaxes[] = {
+    UID_LittleEndianExplicitTransferSyntax,
+    UID_LittleEndianImplicitTransferSyntax
+};
+
+
+[[noreturn]] static void throw_store_error(const std::filesystem::path &path, const char *what)
+{
+    std::stringstream ss;
+
+    ss << "Cannot send " << path.filename().string() << ": " << what;
+    throw std::runtime_error(ss.str());
+}
+
+
+tomo::storepeer tomo::storepeer::parse(const std::string &str)
+{
+    const size_t at = str.find('@'), colon = str.rfind(':');
+    storepeer peer;
+    char *end;
+    long port;
+
+    if (at == std::string::npos || colon == std::string::npos || colon < at) {
+        throw std::runtime_error("Expected AE@HOST:PORT, not "s + str);
+    }
+    peer.ae = str.substr(0, at);
+    peer.host = str.substr(at + 1, colon - at - 1);
+    port = strtol(str.c_str() + colon + 1, &end, 10);
+    if (peer.ae.empty() || peer.ae.size() > 16 || peer.host.empty()
+        || *end || end == str.c_str() + colon + 1 || port <= 0 || port > 65535) {
+        throw std::runtime_error("Expected AE@HOST:PORT, not "s + str);
+    }
+    peer.port = (uint16_t)port;
+    return peer;
+}
+
+
+/** One worker's network and association. The association is released, or
+ *  aborted if it failed, when the link goes */
+struct tomo::storesink::pool::link {
+    T_ASC_Network *net = nullptr;
+    T_ASC_Association *assoc = nullptr;
+
+    link() = default;
+    link(const link &) = delete;
+    link &operator=(const link &) = delete;
+
+    ~link()
+    {
+        close(true);
+        if (net) {
+            ASC_dropNetwork(&net);
+        }
+    }
+
+    void close(bool release)
+    {
+        if (!assoc) {
+            return;
+        }
+        if (!release || ASC_releaseAssociation(assoc).bad()) {
+            ASC_abortAssociation(assoc);
+        }
+        ASC_destroyAssociation(&assoc);
+        assoc = nullptr;
+    }
+};
+
+
+tomo::storesink::storesink(size_t budget, std::shared_ptr<pool> pool):
+    sink(budget),
+    m_pool(std::move(pool))
+{
+
+}
+
+
+/** Every file is back before the pool can forget about this sink */
+tomo::storesink::~storesink()
+{
+    drain();
+}
+
+
+void tomo::storesink::start(std::unique_ptr<file> f)
+{
+    m_pool->submit(this, std::move(f));
+}
+
+
+tomo::storesink::pool::pool(const storepeer &peer, const std::string &calling, unsigned nassoc):
+    m_peer(peer),
+    m_calling(calling),
+    m_stopping(false)
+{
+    dcmConnectionTimeout.set(acse_timeout);
+    while (nassoc--) {
+        m_threads.emplace_back(&pool::work, this);
+    }
+}
+
+
+/** Only once every sink is gone, so the queue is empty */
+tomo::storesink::pool::~pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_qmtx);
+
+        m_stopping = true;
+    }
+    m_qcv.notify_all();
+    for (auto &t: m_threads) {
+        t.join();
+    }
+}
+
+
+void tomo::storesink::pool::submit(storesink *owner, std::unique_ptr<file> f)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_qmtx);
+
+        m_queue.emplace_back(owner, std::move(f));
+    }
+    m_qcv.notify_one();
+}
+
+
+void tomo::storesink::pool::work()
+{
+    std::unique_ptr<file> f;
+    std::exception_ptr error;
+    storesink *owner;
+    link lnk;
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(m_qmtx);
+
+            m_qcv.wait(lock, [this]() { return m_stopping || !m_queue.empty(); });
+            if (m_queue.empty()) {
+                return;
+            }
+            owner = m_queue.front().first;
+            f = std::move(m_queue.front().second);
+            m_queue.pop_front();
+        }
+        error = nullptr;
+        try {
+            store(lnk, *f);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        owner->done(std::move(f), error);
+    }
+}
+
+
+void tomo::storesink::pool::connect(link &lnk)
+{
+    const std::string addr = m_peer.host + ':' + std::to_string(m_peer.port);
+    T_ASC_Parameters *params = nullptr;
+    OFCondition stat;
+    size_t i;
+
+    if (lnk.assoc) {
+        return;
+    }
+    if (!lnk.net) {
+        stat = ASC_initializeNetwork(NET_REQUESTOR, 0, acse_timeout, &lnk.net);
+        if (stat.bad()) {
+            throw std::runtime_error("Cannot initialize DICOM network: "s + stat.text());
+        }
+    }
+    stat = ASC_createAssociationParameters(&params, ASC_DEFAULTMAXPDU);
+    if (stat.bad()) {
+        throw std::runtime_error("Cannot create association: "s + stat.text());
+    }
+    ASC_setAPTitles(params, m_calling.c_str(), m_peer.ae.c_str(), nullptr);
+    ASC_setPresentationAddresses(params, OFStandard::getHostName().c_str(), addr.c_str());
+
+    /* Presentation context IDs are odd */
+    for (i = 0; i < std::size(sop_classes); i++) {
+        ASC_addPresentationContext(params, (T_ASC_PresentationContextID)(2 * i + 1), sop_classes[i],
+                                   transfer_syntaxes, (int)std::size(transfer_syntaxes));
+    }
+
+    /* The association owns the parameters from here on, even if it failed */
+    stat = ASC_requestAssociation(lnk.net, params, &lnk.assoc);
+    if (stat.bad()) {
+        if (lnk.assoc) {
+            ASC_destroyAssociation(&lnk.assoc);
+        } else {
+            ASC_destroyAssociationParameters(&params);
+        }
+        lnk.assoc = nullptr;
+        throw std::runtime_error("Association with " + m_peer.ae + '@' + addr + " failed: " + stat.text());
+    }
+    if (!ASC_countAcceptedPresentationContexts(lnk.assoc->params)) {
+        lnk.close(false);
+        throw std::runtime_error(m_peer.ae + '@' + addr + " accepted no presentation context");
+    }
+    log::printf(tomo::log::DEBUG, "Opened association with %s@%s", m_peer.ae.c_str(), addr.c_str());
+}
+
+
+void tomo::storesink::pool::store(link &lnk, const file &f)
+{
+    DcmInputBufferStream in;
+    outbuf cur, next;
+    T_DIMSE_C_StoreRQ req{ };
+    T_DIMSE_C_StoreRSP rsp{ };
+    DcmDataset *detail = nullptr;
+    T_ASC_PresentationContextID pcid;
+    OFString sop_class, sop_inst;
+    DcmFileFormat ff;
+    OFCondition stat = EC_Normal;
+    size_t i = 0;
+    bool more;
+    int tries;
+
+    /* The buffers of the file, then those of its source, if it has one */
+    auto pull = [&f, &i](outbuf &buf) {
+        if (i < f.bufs.size()) {
+            buf = f.bufs[i++];
+            return true;
+        }
+        return f.more && f.more(buf);
+    };
+
+    /* Read back as a dataset, a buffer at a time, since DIMSE sends nothing
+    else. This costs far less than the disk round trip it replaces, but DCMTK
+    keeps the whole dataset, so a streamed file is all in memory here. One
+    buffer is read ahead, to know which is the last */
+    ff.transferInit();
+    for (more = pull(cur); more; cur = std::move(next)) {
+        in.setBuffer(cur.data, cur.len);
+        more = pull(next);
+        if (!more) {
+            in.setEos();
+        }
+        stat = ff.read(in, EXS_Unknown, EGL_noChange, DCM_MaxReadLength);
+        if (stat != EC_StreamNotifyClient) {
+            break;
+        }
+        in.releaseBuffer();
+    }
+    ff.transferEnd();
+    if (stat.bad()) {
+        throw_store_error(f.path, stat.text());
+    }
+    if (ff.getDataset()->findAndGetOFString(DCM_SOPClassUID, sop_class).bad()
+        || ff.getDataset()->findAndGetOFString(DCM_SOPInstanceUID, sop_inst).bad()) {
+        throw_store_error(f.path, "no SOP class or instance UID");
+    }
+
+    /* A failure on an association that was already open may only mean the
+    peer closed it in the meantime, so that one is tried again on a new one */
+    for (tries = lnk.assoc ? 2 : 1; tries--; ) {
+        connect(lnk);
+        pcid = ASC_findAcceptedPresentationContextID(lnk.assoc, sop_class.c_str());
+        if (!pcid) {
+            throw_store_error(f.path, ("the peer does not accept SOP class " + sop_class).c_str());
+        }
+        req.MessageID = lnk.assoc->nextMsgID++;
+        OFStandard::strlcpy(req.AffectedSOPClassUID, sop_class.c_str(), sizeof req.AffectedSOPClassUID);
+        OFStandard::strlcpy(req.AffectedSOPInstanceUID, sop_inst.c_str(), sizeof req.AffectedSOPInstanceUID);
+        req.DataSetType = DIMSE_DATASET_PRESENT;
+        req.Priority = DIMSE_PRIORITY_MEDIUM;
+        stat = DIMSE_storeUser(lnk.assoc, pcid, &req, nullptr, ff.getDataset(), nullptr, nullptr,
+                               DIMSE_NONBLOCKING, dimse_timeout, &rsp, &detail);
+        delete detail;
+        detail = nullptr;
+        if (stat.good()) {
+            break;
+        }
+        lnk.close(false);
+    }
+    if (stat.bad()) {
+        throw_store_error(f.path, stat.text());
+    }
+
+    /* Warnings are Bxxx: coerced, or elements discarded */
+    if (rsp.DimseStatus != STATUS_Success) {
+        char buf[64];
+
+        snprintf(buf, sizeof buf, "the peer returned status 0x%04x", (unsigned)rsp.DimseStatus);
+        if ((rsp.DimseStatus & 0xf000) != 0xb000) {
+            throw_store_error(f.path, buf);
+        }
+        log::printf(tomo::log::WARN, "Sent %s, but %s", f.path.filename().string().c_str(), buf);
+    }
+}
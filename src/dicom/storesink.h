@@ -0,0 +1,105 @@
+#pragma once
+
+#ifndef STORESINK_H
+#define STORESINK_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "sink.h"
+
+
+namespace tomo {
+
+
+/** A DICOM node that takes C-STORE requests */
+struct storepeer {
+    std::string ae;             /* Called AE title */
+    std::string host;
+    uint16_t port;
+
+    /** @brief Reads "AE@HOST:PORT"
+     *  @throws std::runtime_error if @p str is not of that form
+     */
+    static storepeer parse(const std::string &str);
+};
+
+
+/** Sends every file to a storage SCP over DICOM C-STORE instead of writing it,
+ *  so that nothing has to be read back off the disk to be archived. The path
+ *  of each file only names it in the log
+ *
+ *  The associations belong to a pool that every storesink of the run shares,
+ *  so that there are never more than it has, however many archives are
+ *  exported at once. Each of its threads keeps an association of its own,
+ *  opened at its first file and released once the pool goes. The presentation
+ *  contexts are negotiated then, one for each SOP class tomoconv writes, so a
+ *  file costs one C-STORE and nothing else. An association the peer dropped
+ *  is opened again for the next file. Each sink still has its own budget, and
+ *  only sees its own files fail
+ */
+class storesink: public tomo::sink {
+public:
+    class pool;
+
+private:
+    std::shared_ptr<pool> m_pool;
+
+    virtual void start(std::unique_ptr<file> f) override;
+
+    /** DCMTK reads the whole dataset in before it sends any of it */
+    virtual bool holds_streams() const noexcept override { return true; }
+
+public:
+    /** @brief Sends over the associations of @p pool */
+    storesink(size_t budget, std::shared_ptr<pool> pool);
+    virtual ~storesink() override;
+};
+
+
+/** The associations of a run, and a thread to send over each */
+class storesink::pool {
+    struct link;
+
+    storepeer m_peer;
+    std::string m_calling;
+    std::deque<std::pair<storesink *, std::unique_ptr<file>>> m_queue;
+    std::vector<std::thread> m_threads;
+    std::mutex m_qmtx;
+    std::condition_variable m_qcv;
+    bool m_stopping;
+
+    void work();
+
+    /** Opens the association of @p lnk, if it has none */
+    void connect(link &lnk);
+
+    /** Sends @p f over @p lnk, opening its association again once if the
+     *  one it has fails */
+    void store(link &lnk, const file &f);
+
+public:
+    /** @brief Sends to @p peer as AE title @p calling, over up to @p nassoc
+     *      associations at once. None are opened before the first file
+     */
+    pool(const storepeer &peer, const std::string &calling, unsigned nassoc);
+    ~pool();
+
+    pool(const pool &) = delete;
+    pool &operator=(const pool &) = delete;
+
+
+    /** @brief Queues @p f, which is handed back to @p owner once it is sent */
+    void submit(storesink *owner, std::unique_ptr<file> f);
+};
+
+
+};
+
+
+#endif /* STORESINK_H */
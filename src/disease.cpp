@@ -1,7 +1,8 @@
 #include "disease.h"
-#include "lookup.h"
+#include "schema.h"
 #include "error.h"
 #include "log.h"
+#include "snapshot.h"
 
 using namespace std::literals;
 
@@ -14,23 +15,26 @@ tomo::dcmstudy::dcmstudy()
 
 void tomo::dcmstudy::construct(pugi::xml_node node)
 {
-    const std::unordered_map<pugi::string_t, bool> opts = {
-        { "accessionNumber", true }
+    static constexpr tomo::schema keys{
+        tomo::xkey<&dcmstudy::m_uid>("originalStudyUID"),
+        tomo::xkey<&dcmstudy::m_desc>("studyDescription"),
+        tomo::xkey<&dcmstudy::m_acc>("accessionNumber"),
+        tomo::xkey<&dcmstudy::m_date>("originalStudyDate"),
+        tomo::xkey<&dcmstudy::m_time>("originalStudyTime")
     };
-    tomo::xtable xtable;
+    decltype(keys)::mask_t missing;
 
     node = xchild(node, "dicomStudy");
-    xtable.insert("originalStudyUID", uid());
-    xtable.insert("studyDescription", description());
-    xtable.insert("accessionNumber", accession_num());
-    xtable.insert("originalStudyDate", date());
-    xtable.insert("originalStudyTime", time());
-    xtable.search(node);
-
-    xtable.remove(node, opts);
-    if (xtable.size()) {
-        throw missing_keys(node, xtable);
-    }
+    missing = keys.search(*this, node);
+
+    missing = keys.excuse(node, missing, keys.bit("accessionNumber"));
+    keys.require(node, missing);
+}
+
+
+void tomo::dcmstudy::serialize(tomo::snapshot &snap)
+{
+    snap(m_uid, m_desc, m_acc, m_date, m_time);
 }
 
 
@@ -47,18 +51,22 @@ void tomo::dcmstudy::set_default(const tomo::disease &dis)
 
 void tomo::disease::info::construct(pugi::xml_node root)
 {
-    tomo::xtable xtable;
+    static constexpr tomo::schema keys{
+        tomo::xkey<&info::dbinfo>("dbInfo"),
+        tomo::xkey<&info::name>("diseaseName")
+    };
     pugi::xml_node node;
 
     ptage = xchild(root, "patientsAge").text().as_string();
 
     node = xchild(root, "briefDisease");
-    xtable.insert("dbInfo", dbinfo);
-    xtable.insert("diseaseName", name);
-    xtable.search(node);
-    if (xtable.size()) {
-        throw missing_keys(node, xtable);
-    }
+    keys.require(node, keys.search(*this, node));
+}
+
+
+void tomo::disease::info::serialize(tomo::snapshot &snap)
+{
+    snap(dbinfo, name, ptage);
 }
 
 
@@ -70,16 +78,20 @@ tomo::disease::disease()
 
 void tomo::disease::construct(pugi::xml_node root)
 {
-    tomo::xtable xtable;
+    static constexpr tomo::schema keys{
+        tomo::xkey<&disease::m_info>("disease"),
+        tomo::xkey<&disease::m_structs>("fullStructureSetDataArray"),
+        tomo::xkey<&disease::m_dcmstudies>("fullDicomStudyDataArray"),
+        tomo::xkey<&disease::m_plans>("fullPlanDataArray"),
+        tomo::xkey<&disease::m_images>("fullImageDataArray")
+    };
+    constexpr auto studies = keys.bit("fullDicomStudyDataArray");
+    decltype(keys)::mask_t missing;
 
-    xtable.insert("disease", m_info);
-    xtable.insert("fullStructureSetDataArray", xref(m_structs, "fullStructureSetDataArray"));
-    xtable.insert("fullDicomStudyDataArray", xref(dcm_studies(), "fullDicomStudyDataArray"));
-    xtable.insert("fullPlanDataArray", xref(m_plans, "fullPlanDataArray"));
-    xtable.insert("fullImageDataArray", xref(m_images, "fullImageDataArray"));
-    xtable.search(root);
+    missing = keys.search(*this, root);
 
-    if (xtable.remove("fullDicomStudyDataArray")) {
+    if (missing & studies) {
+        missing &= ~studies;
         log::puts(tomo::log::WARN, "Missing fullDicomStudyDataArray");
         dcm_studies().push_back({ });
         dcm_studies().back().set_default(*this);
@@ -91,9 +103,7 @@ void tomo::disease::construct(pugi::xml_node root)
         //log::printf(tomo::log::WARN, "Found %zu DICOM studies", m_dcmstudies.size());
     }
 
-    if (xtable.size()) {
-        throw missing_keys(root, xtable);
-    }
+    keys.require(root, missing);
     /* None of this is possible */
     /* if (!m_structs.size()) {
         throw std::runtime_error("No structure set information");
@@ -105,3 +115,9 @@ void tomo::disease::construct(pugi::xml_node root)
         throw std::runtime_error("No plan images");
     } */
 }
+
+
+void tomo::disease::serialize(tomo::snapshot &snap)
+{
+    snap(m_info, m_dcmstudies, m_plans, m_images, m_structs);
+}
@@ -7,6 +7,7 @@
 #include <pugixml.hpp>
 #include "dbinfo.h"
 #include "constructible.h"
+#include "lazy.h"
 #include "plan.h"
 #include "image.h"
 
@@ -27,6 +28,7 @@ class disease: public constructible {
         std::string ptage;
 
         virtual void construct(pugi::xml_node root) override;
+        virtual void serialize(tomo::snapshot &snap) override;
 
     } m_info;
 
@@ -41,11 +43,13 @@ class disease: public constructible {
      */
     std::vector<tomo::dcmstudy> m_dcmstudies;
 
-    std::vector<tomo::plan> m_plans;
-    std::vector<tomo::img_data> m_images;
-    std::vector<tomo::structset> m_structs; /* This one contains the correct SOP
-                                            instance UID for the RT structure
-                                            set */
+    /* Only read once an exporter asks for them */
+    tomo::lazy<std::vector<tomo::plan>> m_plans;
+    tomo::lazy<std::vector<tomo::img_data>> m_images;
+    tomo::lazy<std::vector<tomo::structset>> m_structs; /* This one contains
+                                                        the correct SOP instance
+                                                        UID for the RT structure
+                                                        set */
 
 
     tomo::dbinfo &dbinfo() noexcept { return m_info.dbinfo; }
@@ -54,17 +58,13 @@ class disease: public constructible {
     std::string &pt_age() noexcept { return m_info.ptage; }
 
     std::vector<tomo::dcmstudy> &dcm_studies() noexcept { return m_dcmstudies; }
-    
-    tomo::plan &plan(size_t i) noexcept { return m_plans[i]; }
-    tomo::image &image(size_t i) noexcept { return m_images[i].img; }
-
-    tomo::structset &structure_set(size_t i) noexcept { return m_structs[i]; }
 
 public:
     disease();
 
     /** Constructed from the LOWER node "fullDiseaseDataArray" */
     virtual void construct(pugi::xml_node root) override;
+    virtual void serialize(tomo::snapshot &snap) override;
 
 
     const tomo::dbinfo &dbinfo() const noexcept { return m_info.dbinfo; }
@@ -74,17 +74,18 @@ public:
 
     const std::vector<tomo::dcmstudy> &dcm_studies() const noexcept { return m_dcmstudies; }
 
-    size_t n_images() const noexcept { return m_images.size(); }
-    const tomo::image &image(size_t i) const noexcept { return m_images[i].img; }
-    const std::vector<tomo::img_data> &images() const noexcept { return m_images; }
+    /* Each of these reads its subtree on first use, and throws if it cannot */
+    size_t n_images() const { return m_images->size(); }
+    const tomo::image &image(size_t i) const { return (*m_images)[i].img; }
+    const std::vector<tomo::img_data> &images() const { return *m_images; }
 
-    size_t n_plans() const noexcept { return m_plans.size(); }
-    const tomo::plan &plan(size_t i) const noexcept { return m_plans[i]; }
-    const std::vector<tomo::plan> &plans() const noexcept { return m_plans; }
+    size_t n_plans() const { return m_plans->size(); }
+    const tomo::plan &plan(size_t i) const { return (*m_plans)[i]; }
+    const std::vector<tomo::plan> &plans() const { return *m_plans; }
 
-    size_t n_structs() const noexcept { return m_structs.size(); }
-    const tomo::structset &structure_set(size_t i) const noexcept { return m_structs[i]; }
-    const std::vector<tomo::structset> &structure_sets() const noexcept { return m_structs; }
+    size_t n_structs() const { return m_structs->size(); }
+    const tomo::structset &structure_set(size_t i) const { return (*m_structs)[i]; }
+    const std::vector<tomo::structset> &structure_sets() const { return *m_structs; }
 };
 
 
@@ -106,6 +107,7 @@ public:
     dcmstudy();
 
     virtual void construct(pugi::xml_node root) override;
+    virtual void serialize(tomo::snapshot &snap) override;
 
     /** Use this if fullDicomStudyArray does not exist */
     void set_default(const tomo::disease &dis);
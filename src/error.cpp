@@ -10,14 +10,12 @@ tomo::missing_keys::missing_keys(pugi::xml_node root, const pugi::char_t *key):
 }
 
 
-tomo::missing_keys::missing_keys(pugi::xml_node root, const xtable &tbl):
+tomo::missing_keys::missing_keys(pugi::xml_node root, kvec_t keys):
     std::runtime_error("Missing XML nodes"),
     m_root(root),
-    m_keys({ })
+    m_keys(std::move(keys))
 {
-    for (auto &pair: tbl) {
-        keys().push_back(pair.first);
-    }
+
 }
 
 
@@ -4,8 +4,9 @@
 #define ERROR_H
 
 #include <filesystem>
+#include <stdexcept>
+#include <vector>
 #include <pugixml.hpp>
-#include "lookup.h"
 
 
 namespace tomo {
@@ -23,7 +24,7 @@ private:
 
 public:
     missing_keys(pugi::xml_node root, const pugi::char_t *key);
-    missing_keys(pugi::xml_node root, const xtable &table);
+    missing_keys(pugi::xml_node root, kvec_t keys);
 
     pugi::xml_node &root() noexcept { return m_root; }
     const pugi::xml_node &root() const noexcept { return m_root; }
@@ -1,6 +1,7 @@
 #include "image.h"
-#include "lookup.h"
+#include "schema.h"
 #include "error.h"
+#include "snapshot.h"
 
 
 void tomo::img_data::construct(pugi::xml_node root)
@@ -9,6 +10,12 @@ void tomo::img_data::construct(pugi::xml_node root)
 }
 
 
+void tomo::img_data::serialize(tomo::snapshot &snap)
+{
+    snap(img);
+}
+
+
 tomo::image::array_header::array_header()
 {
     
@@ -44,18 +51,16 @@ static void load_array(std::array<ArrT, Len> &arr, pugi::xml_node root)
 
 void tomo::image::array_header::construct(pugi::xml_node root)
 {
-    tomo::xtable xtable;
-
-    xtable.insert("binaryFileName", filename());
-    xtable.insert("maxValue", max());
-    xtable.insert("minValue", min());
-    xtable.insert("useAlternateZs", use_altz());
-    xtable.insert("compressionType", compression());
-    xtable.insert("dataType", datatype());
-    xtable.search(root);
-    if (xtable.size()) {
-        throw missing_keys(root, xtable);
-    }
+    static constexpr tomo::schema keys{
+        tomo::xkey<&array_header::m_filename>("binaryFileName"),
+        tomo::xkey<&array_header::m_max>("maxValue"),
+        tomo::xkey<&array_header::m_min>("minValue"),
+        tomo::xkey<&array_header::m_use_altz>("useAlternateZs"),
+        tomo::xkey<&array_header::m_compression>("compressionType"),
+        tomo::xkey<&array_header::m_datatype>("dataType")
+    };
+
+    keys.require(root, keys.search(*this, root));
     load_array(dim(), root.child("dimensions"));
     load_array(orig_axdim(), root.child("origAxialDimensions"));
     load_array(start(), root.child("start"));
@@ -72,6 +77,13 @@ void tomo::image::array_header::construct(pugi::xml_node root)
 }
 
 
+void tomo::image::array_header::serialize(tomo::snapshot &snap)
+{
+    snap(m_filename, m_compression, m_datatype);
+    snap(m_dim, m_orig_axdim, m_start, m_res, m_max, m_min, m_use_altz, m_origz);
+}
+
+
 tomo::image::image()
 {
 
@@ -80,15 +92,19 @@ tomo::image::image()
 
 void tomo::image::construct(pugi::xml_node root)
 {
-    tomo::xtable xtable;
-
-    xtable.insert("dbInfo", dbinfo());
-    xtable.insert("frameOfReference", frame_of_ref());
-    xtable.insert("patientPosition", pt_position());
-    xtable.insert("imageType", image_type());
-    xtable.insert("arrayHeader", header());
-    xtable.search(root);
-    if (xtable.size()) {
-        throw missing_keys(root, xtable);
-    }
+    static constexpr tomo::schema keys{
+        tomo::xkey<&image::m_dbinfo>("dbInfo"),
+        tomo::xkey<&image::m_frame_of_ref>("frameOfReference"),
+        tomo::xkey<&image::m_pt_pos>("patientPosition"),
+        tomo::xkey<&image::m_imgtype>("imageType"),
+        tomo::xkey<&image::m_arrheader>("arrayHeader")
+    };
+
+    keys.require(root, keys.search(*this, root));
+}
+
+
+void tomo::image::serialize(tomo::snapshot &snap)
+{
+    snap(m_dbinfo, m_frame_of_ref, m_pt_pos, m_imgtype, m_arrheader);
 }
@@ -4,18 +4,66 @@
 #define IMAGE_H
 
 #include <array>
+#include <cstring>
 #include <filesystem>
-#include <fstream>
 #include <optional>
+#include <stdexcept>
 #include <vector>
 #include "constructible.h"
 #include "dbinfo.h"
+#include "mapfile.h"
 #include "auxiliary.h"
 
 
 namespace tomo {
 
 
+/** An image binary file, mapped instead of read. The file is big-endian, and
+ *  nothing is converted up front: consumers pull runs of native-order elements
+ *  out of it as they need them, so the only copy is the consumer's own buffer
+ */
+template <class DataT>
+class volume {
+    tomo::mapfile m_file;
+
+public:
+    volume() = default;
+    explicit volume(const std::filesystem::path &path): m_file(path) { }
+
+    size_t size() const noexcept { return m_file.size() / sizeof (DataT); }
+
+    /** The elements as they sit in the file, big-endian */
+    const DataT *data() const noexcept { return static_cast<const DataT *>(m_file.data()); }
+
+
+    /** @brief Copies elements [@p first, @p first + @p n) into @p dst in
+     *      native byte order
+     *  @throws std::runtime_error if the file is too short
+     */
+    void read(size_t first, size_t n, DataT *dst) const
+    {
+        const DataT *src = data();
+
+        if (first + n > size()) {
+            throw std::runtime_error("Image binary file is truncated");
+        }
+        if (g_target_lendian) {
+            endianswap(src + first, src + first + n, dst);
+        } else {
+            std::memcpy(dst, src + first, n * sizeof (DataT));
+        }
+    }
+
+
+    /** Drops elements [@p first, @p first + @p n) from memory once they have
+     *  been read for the last time */
+    void release(size_t first, size_t n) noexcept
+    {
+        m_file.release(first * sizeof (DataT), n * sizeof (DataT));
+    }
+};
+
+
 class image: public constructible {
 public:
     class array_header: public constructible {
@@ -39,6 +87,7 @@ public:
         array_header();
 
         virtual void construct(pugi::xml_node root) override;
+        virtual void serialize(tomo::snapshot &snap) override;
 
 
         std::string &filename() noexcept { return m_filename; }
@@ -81,10 +130,12 @@ public:
     image();
 
     virtual void construct(pugi::xml_node root) override;
+    virtual void serialize(tomo::snapshot &snap) override;
 
 
+    /** Maps the binary file described by the array header, found in @p dir */
     template <class DataT>
-    std::vector<DataT> load_file(std::filesystem::path dir) const;
+    tomo::volume<DataT> map_file(std::filesystem::path dir) const;
 
     tomo::dbinfo &dbinfo() noexcept { return m_dbinfo; }
     std::string &frame_of_ref() noexcept { return m_frame_of_ref; }
@@ -106,27 +157,15 @@ struct img_data: public constructible {
     tomo::image img;
 
     virtual void construct(pugi::xml_node root);
+    virtual void serialize(tomo::snapshot &snap) override;
 };
 
 
 template <class DataT>
-std::vector<DataT> tomo::image::load_file(std::filesystem::path path) const
+tomo::volume<DataT> tomo::image::map_file(std::filesystem::path path) const
 {
-    std::vector<DataT> res;
-    std::ifstream input;
-    size_t fsize, vsize;
-
     path.append(header().filename());
-    fsize = std::filesystem::file_size(path);
-    vsize = fsize / sizeof (DataT);
-    input.open(path.string(), std::ios::in | std::ios::binary);
-    res.resize(vsize);
-    input.read(reinterpret_cast<char *>(res.data()), fsize);
-    input.close();
-    if (g_target_lendian) {
-        endianswap(res.begin(), res.end());
-    }
-    return res;
+    return tomo::volume<DataT>(path);
 }
 
 
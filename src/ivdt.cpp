@@ -4,21 +4,21 @@
 #include "ivdt.h"
 #include "aux.h"
 #include "error.h"
+#include "schema.h"
+#include "snapshot.h"
 
 
 void tomo::ivdt::data::construct(pugi::xml_node root)
 {
-    tomo::xtable xtable;
+    static constexpr tomo::schema keys{
+        tomo::xkey<&data::filename>("sinogramDataFile"),
+        tomo::xkey<&data::compression>("compressionType"),
+        tomo::xkey<&data::datatype>("dataType")
+    };
     pugi::xml_node node;
     unsigned i = 0;
 
-    xtable.insert("sinogramDataFile", filename);
-    xtable.insert("compressionType", compression);
-    xtable.insert("dataType", datatype);
-    xtable.search(root);
-    if (xtable.size()) {
-        throw missing_keys(root, xtable);
-    }
+    keys.require(root, keys.search(*this, root));
     node = xchild(root, "dimensions");
     for (pugi::xml_node child: node.children()) {
         if (i < dim.size()) {
@@ -32,6 +32,12 @@ void tomo::ivdt::data::construct(pugi::xml_node root)
 }
 
 
+void tomo::ivdt::data::serialize(tomo::snapshot &snap)
+{
+    snap(filename, compression, datatype, dim, data);
+}
+
+
 tomo::ivdt::ivdt()
 {
 
@@ -102,14 +108,18 @@ void tomo::ivdt::load_data()
 
 void tomo::ivdt::construct(pugi::xml_node root)
 {
-    tomo::xtable xtable;
-
-    xtable.insert("dbInfo", dbinfo());
-    xtable.insert("isCurrentlyCommissioned", currently_commissioned());
-    xtable.insert("isLatest", is_latest());
-    xtable.insert("imagingEquipmentData", m_data);
-    xtable.search(root);
-    if (xtable.size()) {
-        throw missing_keys(root, xtable);
-    }
+    static constexpr tomo::schema keys{
+        tomo::xkey<&ivdt::m_dbinfo>("dbInfo"),
+        tomo::xkey<&ivdt::m_curcomm>("isCurrentlyCommissioned"),
+        tomo::xkey<&ivdt::m_latest>("isLatest"),
+        tomo::xkey<&ivdt::m_data>("imagingEquipmentData")
+    };
+
+    keys.require(root, keys.search(*this, root));
+}
+
+
+void tomo::ivdt::serialize(tomo::snapshot &snap)
+{
+    snap(m_dbinfo, m_curcomm, m_latest, m_data);
 }
@@ -32,6 +32,7 @@ class ivdt: public constructible {
         std::vector<float> data;
 
         virtual void construct(pugi::xml_node root) override;
+        virtual void serialize(tomo::snapshot &snap) override;
     
     } m_data;
 
@@ -60,6 +61,7 @@ public:
 
     /** From the node "imagingEquipment" */
     virtual void construct(pugi::xml_node root) override;
+    virtual void serialize(tomo::snapshot &snap) override;
 
 
     const tomo::dbinfo &dbinfo() const noexcept { return m_dbinfo; }
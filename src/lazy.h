@@ -0,0 +1,102 @@
+#pragma once
+
+#ifndef LAZY_H
+#define LAZY_H
+
+#include <atomic>
+#include <mutex>
+#include <utility>
+#include <pugixml.hpp>
+#include "schema.h"
+
+
+namespace tomo {
+
+
+/** A subtree of the patient XML that is only read into a @p T the first time
+ *  something asks for it. Reading the key with a tomo::schema just remembers
+ *  the node, so the document it came from must outlive this
+ *
+ *  Exporters running on different threads may ask for the same subtree at
+ *  once; the first one reads it and the rest wait. If reading it throws, the
+ *  next caller tries again and throws the same
+ */
+template <class T>
+class lazy {
+    pugi::xml_node m_node;
+    mutable T m_value;
+    mutable std::atomic<bool> m_ready;
+    mutable std::mutex m_mtx;
+
+public:
+    lazy() noexcept: m_ready(false) { }
+
+    /* Models are moved around while the tree is being read, and never after
+    anything has been asked of them */
+    lazy(lazy &&other):
+        m_node(other.m_node),
+        m_value(std::move(other.m_value)),
+        m_ready(other.m_ready.load())
+    {
+
+    }
+
+    lazy &operator=(lazy &&other)
+    {
+        m_node = other.m_node;
+        m_value = std::move(other.m_value);
+        m_ready = other.m_ready.load();
+        return *this;
+    }
+
+
+    /** @brief Forgets whatever was read before, and reads @p node next time */
+    void bind(pugi::xml_node node) noexcept
+    {
+        m_node = node;
+        m_ready = false;
+    }
+
+    /** @brief Sets the value outright, as though it had been read already */
+    void assign(T value)
+    {
+        m_value = std::move(value);
+        m_ready = true;
+    }
+
+    /** @brief Whether the subtree has been read yet */
+    bool ready() const noexcept { return m_ready.load(std::memory_order_acquire); }
+
+    const pugi::xml_node &node() const noexcept { return m_node; }
+
+
+    /** @throws Whatever reading the subtree throws */
+    const T &get() const
+    {
+        if (!ready()) {
+            std::lock_guard<std::mutex> lock(m_mtx);
+
+            if (!m_ready.load(std::memory_order_relaxed)) {
+                xread(m_value, m_node);
+                m_ready.store(true, std::memory_order_release);
+            }
+        }
+        return m_value;
+    }
+
+    const T &operator*() const { return get(); }
+    const T *operator->() const { return &get(); }
+};
+
+
+template <class T>
+void xread(lazy<T> &val, pugi::xml_node node)
+{
+    val.bind(node);
+}
+
+
+};
+
+
+#endif /* LAZY_H */
@@ -1,11 +1,17 @@
 #include <cstdarg>
 #include <list>
+#include <mutex>
 #include <utility>
 #include "log.h"
 
 
 static std::list<tomo::logfile *> logs = { };
 
+/* Log files are not required to be reentrant */
+static std::mutex logs_mtx;
+
+static thread_local tomo::logbuffer *capture = nullptr;
+
 
 void tomo::log::add(logfile &lf)
 {
@@ -28,6 +34,11 @@ int tomo::log::puts(level lvl, const char *msg)
 {
     int res = 0;
 
+    if (capture) {
+        capture->push(lvl, msg);
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(logs_mtx);
     for (auto *log: logs) {
         if (std::as_const(*log).threshold() <= lvl) {
             res = log->write(lvl, msg) || res;
@@ -56,6 +67,42 @@ tomo::logfile::logfile(log::level threshold):
 }
 
 
+tomo::logbuffer::logbuffer():
+    m_prev(nullptr)
+{
+
+}
+
+
+void tomo::logbuffer::attach() noexcept
+{
+    m_prev = capture;
+    capture = this;
+}
+
+
+void tomo::logbuffer::detach() noexcept
+{
+    capture = m_prev;
+    m_prev = nullptr;
+}
+
+
+void tomo::logbuffer::push(log::level lvl, const char *msg)
+{
+    m_msgs.emplace_back(lvl, msg);
+}
+
+
+void tomo::logbuffer::replay()
+{
+    for (const auto &msg: m_msgs) {
+        log::puts(msg.first, msg.second.c_str());
+    }
+    m_msgs.clear();
+}
+
+
 void tomo::logger::appender::clear()
 {
     ss.str("");
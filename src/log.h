@@ -5,6 +5,9 @@
 
 #include <iostream>
 #include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
 
 
 namespace tomo {
@@ -103,6 +106,31 @@ public:
 };
 
 
+/** Holds messages issued on a single thread so that they can be forwarded to
+ *  the log list later, in whatever order the owner chooses. While a buffer is
+ *  attached, every log::puts from the attaching thread lands here instead
+ */
+class logbuffer {
+    std::vector<std::pair<log::level, std::string>> m_msgs;
+    logbuffer *m_prev;  /* The buffer that was attached before this one */
+
+public:
+    logbuffer();
+
+    /** Capture messages from the calling thread until detach() */
+    void attach() noexcept;
+    void detach() noexcept;
+
+    void push(log::level lvl, const char *msg);
+
+    /** @brief Issue every buffered message through log::puts from the calling
+     *      thread, then empty the buffer. If the calling thread is itself
+     *      captured, the messages move into that buffer
+     */
+    void replay();
+};
+
+
 /** operator<< this a log::level before sending it further data
  *  unlike the printf function above this buffers the message on the heap using
  *  a stringstream, which is really not a good practice for a simple tracer
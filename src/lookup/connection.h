@@ -0,0 +1,63 @@
+#pragma once
+
+#ifndef TOMO_CONNECTION_H
+#define TOMO_CONNECTION_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+
+namespace tomo {
+
+
+/** A TCP connection to the MRN server. Each platform has its own, see
+ *  lookup-unix.cpp and lookup-win32.cpp
+ */
+class connection {
+#ifdef _WIN32
+    uintptr_t sock;     /* SOCKET */
+#else
+    int sock;
+#endif
+
+public:
+    /** @brief Connects to @p host on service @p svc, or on @p port if @p svc
+     *      is null. The addresses it resolves to are raced as RFC 8305 has
+     *      it: alternating between IPv6 and IPv4, each attempt starts 250 ms
+     *      after the one before, or as soon as that one fails, and the first
+     *      to connect wins. A dead address costs that much, not a timeout
+     *  @param timeout
+     *      How long all the attempts together may take, and then how long
+     *      any one send or recv may block. Zero waits as long as the system
+     *      does
+     *  @throws std::runtime_error if none of them accept in time
+     */
+    connection(const char *host, const char *svc, uint16_t port,
+               std::chrono::milliseconds timeout = { });
+    ~connection();
+
+    connection(const connection &) = delete;
+    connection &operator=(const connection &) = delete;
+
+
+    /** @brief Sends all @p len bytes, however many calls that takes
+     *  @throws std::runtime_error on failure, or if it times out
+     */
+    void send(const void *data, size_t len);
+
+    /** @brief Receives up to @p len bytes
+     *  @returns 0 once the server has closed its end
+     *  @throws std::runtime_error on failure, or if it times out
+     */
+    size_t recv(void *dst, size_t len);
+
+    /** @brief Tells the server nothing more is coming */
+    void shutdown_send();
+};
+
+
+};
+
+
+#endif /* TOMO_CONNECTION_H */
@@ -1,18 +1,28 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
 
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <poll.h>
 #include <unistd.h>
 
-#include "lookup.h"
+#include "connection.h"
 #include "../log.h"
 
 using namespace std::literals;
 
 
+/** How long an attempt to connect to one address gets before the next
+ *  address is tried alongside it, as RFC 8305 recommends */
+static constexpr std::chrono::milliseconds connect_stagger(250);
+
+
 static void throw_errno(const char *ctx, int erno)
 {
     char buf[256];
@@ -44,18 +54,6 @@ static void throw_gai(int code)
 }
 
 
-class connection {
-    int sock;
-
-public:
-    connection(const char *host, const char *svc, uint16_t port);
-    ~connection();
-
-    void send(const void *data, size_t len);
-    size_t recv(void *dst, size_t len);
-};
-
-
 static void set_port(struct sockaddr *addr, uint16_t port)
 {
     switch (addr->sa_family) {
@@ -97,7 +95,175 @@ static std::string sockaddr_str(const struct sockaddr *addr)
 }
 
 
-connection::connection(const char *host, const char *svc, uint16_t port):
+/** Addresses in the order RFC 8305 tries them: alternating between families,
+ *  starting with whichever getaddrinfo put first */
+static std::vector<const struct addrinfo *> interleave(const struct addrinfo *ai)
+{
+    std::vector<const struct addrinfo *> first, other, order;
+    size_t i;
+
+    for (; ai; ai = ai->ai_next) {
+        if (first.empty() || ai->ai_family == first.front()->ai_family) {
+            first.push_back(ai);
+        } else {
+            other.push_back(ai);
+        }
+    }
+    for (i = 0; i < first.size() || i < other.size(); i++) {
+        if (i < first.size()) {
+            order.push_back(first[i]);
+        }
+        if (i < other.size()) {
+            order.push_back(other[i]);
+        }
+    }
+    return order;
+}
+
+
+/** Opens a non-blocking socket to @p addr and starts connecting it. Returns
+ *  the socket, or -1 with errno set. @p done is set if it connected at once */
+static int start_connect(const struct addrinfo *addr, bool &done)
+{
+    int sock, flags;
+
+    done = false;
+    sock = socket(addr->ai_family, SOCK_STREAM, IPPROTO_TCP);
+    if (sock == -1) {
+        return -1;
+    }
+    flags = fcntl(sock, F_GETFL);
+    if (flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK)) {
+        flags = errno;
+        close(sock);
+        errno = flags;
+        return -1;
+    }
+    tomo::log << tomo::log::DEBUG << "Attempting to connect to " << sockaddr_str(addr->ai_addr);
+    if (!connect(sock, addr->ai_addr, addr->ai_addrlen)) {
+        done = true;
+    } else if (errno != EINPROGRESS) {
+        flags = errno;
+        close(sock);
+        errno = flags;
+        return -1;
+    }
+    return sock;
+}
+
+
+/** Connects to the first of @p addrs to accept, RFC 8305 style. Attempts
+ *  start connect_stagger apart, or as soon as the last one fails, and race
+ *  each other until one wins or @p timeout runs out. Returns a blocking
+ *  socket, or -1 with errno set by the last failure */
+static int race_connect(const std::vector<const struct addrinfo *> &addrs,
+                        std::chrono::milliseconds timeout)
+{
+    using clock = std::chrono::steady_clock;
+    const clock::time_point deadline = clock::now() + timeout;
+    std::vector<struct pollfd> fds;
+    clock::time_point next_start = clock::now();
+    int sock = -1, err = ECONNREFUSED, wait, res, soerr;
+    socklen_t errlen;
+    size_t next = 0, i;
+    bool done;
+
+    while (sock == -1) {
+        /* Another attempt if it is time, or if none is in flight */
+        if (next < addrs.size() && (fds.empty() || clock::now() >= next_start)) {
+            res = start_connect(addrs[next++], done);
+            if (res == -1) {
+                err = errno;
+                continue;
+            }
+            if (done) {
+                sock = res;
+                break;
+            }
+            fds.push_back({ res, POLLOUT, 0 });
+            next_start = clock::now() + connect_stagger;
+        }
+        if (fds.empty()) {
+            break;
+        }
+
+        /* With no attempt left to start and no deadline, wait for as long
+        as the ones in flight take */
+        wait = -1;
+        if (next < addrs.size()) {
+            wait = (int)std::chrono::ceil<std::chrono::milliseconds>(next_start - clock::now()).count();
+            wait = std::max(wait, 0);
+        }
+        if (timeout.count() > 0) {
+            res = (int)std::chrono::ceil<std::chrono::milliseconds>(deadline - clock::now()).count();
+            if (res <= 0) {
+                err = ETIMEDOUT;
+                break;
+            }
+            wait = wait < 0 ? res : std::min(wait, res);
+        }
+        res = poll(fds.data(), fds.size(), wait);
+        if (res < 0 && errno != EINTR) {
+            err = errno;
+            break;
+        }
+
+        /* The first to connect wins. The ones that failed make way for the
+        next address straight away */
+        for (i = 0; res > 0 && i < fds.size(); ) {
+            if (!fds[i].revents) {
+                i++;
+                continue;
+            }
+            errlen = sizeof soerr;
+            if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &soerr, &errlen)) {
+                soerr = errno;
+            }
+            if (!soerr) {
+                sock = fds[i].fd;
+                fds.erase(fds.begin() + i);
+                break;
+            }
+            err = soerr;
+            close(fds[i].fd);
+            fds.erase(fds.begin() + i);
+            next_start = clock::now();
+        }
+    }
+
+    for (const auto &pfd: fds) {
+        close(pfd.fd);
+    }
+    if (sock == -1) {
+        errno = err;
+        return -1;
+    }
+    res = fcntl(sock, F_GETFL);
+    if (res < 0 || fcntl(sock, F_SETFL, res & ~O_NONBLOCK)) {
+        err = errno;
+        close(sock);
+        errno = err;
+        return -1;
+    }
+    return sock;
+}
+
+
+static void set_timeout(int sock, std::chrono::milliseconds timeout)
+{
+    struct timeval tv;
+
+    tv.tv_sec = timeout.count() / 1000;
+    tv.tv_usec = timeout.count() % 1000 * 1000;
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv)
+     || setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv)) {
+        throw_errno("Cannot set MRN server timeout");
+    }
+}
+
+
+tomo::connection::connection(const char *host, const char *svc, uint16_t port,
+                             std::chrono::milliseconds timeout):
     sock(-1)
 {
     struct addrinfo hints{ }, *ai, *node;
@@ -111,52 +277,66 @@ connection::connection(const char *host, const char *svc, uint16_t port):
     if (res) {
         throw_gai(res);
     }
-    for (node = ai; node; node = node->ai_next) {
-        sock = socket(node->ai_family, SOCK_STREAM, IPPROTO_TCP);
-        if (sock == -1) {
-            res = 1;
-            break;
-        }
-        if (!svc) {
+    if (!svc) {
+        for (node = ai; node; node = node->ai_next) {
             set_port(node->ai_addr, port);
         }
-        tomo::log << tomo::log::DEBUG << "Attempting to connect to " << sockaddr_str(node->ai_addr);
-        res = connect(sock, node->ai_addr, node->ai_addrlen);
-        if (!res) {
-            break;
-        }
-        close(sock);
-        sock = -1;
     }
+    sock = race_connect(interleave(ai), timeout);
+    res = errno;
     freeaddrinfo(ai);
-    if (res) {
-        throw_errno("Connection to MRN server failed");
+    if (sock == -1) {
+        throw_errno("Connection to MRN server failed", res);
+    }
+    if (timeout.count() > 0) {
+        try {
+            set_timeout(sock, timeout);
+        } catch (...) {
+            close(sock);
+            throw;
+        }
     }
 }
 
 
-connection::~connection()
+tomo::connection::~connection()
 {
     close(sock);
 }
 
 
-void connection::send(const void *buf, size_t len)
+void tomo::connection::send(const void *buf, size_t len)
 {
+    const char *p = static_cast<const char *>(buf);
     ssize_t count;
 
-    count = ::send(sock, buf, len, 0);
-    if (count < 0) {
-        throw_errno("Failed sending data to MRN server");
+    while (len) {
+        count = ::send(sock, p, len, MSG_NOSIGNAL);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                throw std::runtime_error("Timed out sending data to MRN server");
+            }
+            throw_errno("Failed sending data to MRN server");
+        }
+        p += count;
+        len -= count;
     }
 }
 
 
-size_t connection::recv(void *buf, size_t len)
+size_t tomo::connection::recv(void *buf, size_t len)
 {
     ssize_t count;
 
-    count = ::recv(sock, buf, len, 0);
+    do {
+        count = ::recv(sock, buf, len, 0);
+    } while (count < 0 && errno == EINTR);
+    if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        throw std::runtime_error("Timed out waiting for MRN server");
+    }
     if (count < 0) {
         throw_errno("Failed receiving data from MRN server");
     }
@@ -164,15 +344,9 @@ size_t connection::recv(void *buf, size_t len)
 }
 
 
-void tomo::lookup_name(const char *host, uint16_t port, char *name, size_t len)
+void tomo::connection::shutdown_send()
 {
-    connection conn(host, NULL, port);
-    size_t recd;
-
-    conn.send(name, strlen(name));
-    recd = conn.recv(name, len);
-    name[std::min(recd, len - 1)] = '\0';
-    if (!strcmp(name, "NOT FOUND")) {
-        throw std::runtime_error("Patient name not found in MRN database");
+    if (shutdown(sock, SHUT_WR)) {
+        throw_errno("Failed sending data to MRN server");
     }
 }
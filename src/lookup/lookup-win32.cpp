@@ -1,185 +1,345 @@
-#include "lookup.h"
-#include "../log.h"
-
-#include <WS2tcpip.h>
-
-#undef min
-#undef max
-
-
-static class wsa_init {
-    WSADATA wsdata;
-
-public:
-    wsa_init()
-    {
-        WSAStartup(MAKEWORD(2, 2), &wsdata);
-    }
-
-} initializer;
-
-
-static void throw_win32_error(DWORD err)
-{
-    char message[256], *crlf;
-
-    FormatMessageA(FORMAT_MESSAGE_FROM_SYSTEM,
-                   NULL,
-                   err,
-                   LANG_USER_DEFAULT,
-                   message,
-                   sizeof message,
-                   NULL);
-    crlf = strstr(message, "\r\n");
-    if (crlf) {
-        *crlf = '\0';
-    }
-    throw std::runtime_error(message);
-}
-
-
-static void throw_win32_error(void)
-{
-    DWORD err;
-
-    err = GetLastError();
-    throw_win32_error(err);
-}
-
-
-class connection {
-    SOCKET sock;
-
-public:
-    connection(const char *host, const char *svc, u_short port);
-    ~connection();
-
-    void send(const void *data, size_t len);
-    size_t recv(void *dst, size_t len);
-};
-
-
-static void set_port(struct sockaddr *addr, u_short port)
-{
-    switch (addr->sa_family) {
-    case AF_INET:
-        reinterpret_cast<struct sockaddr_in *>(addr)->sin_port = htons(port);
-        break;
-    case AF_INET6:
-        reinterpret_cast<struct sockaddr_in6 *>(addr)->sin6_port = htons(port);
-        break;
-    default:
-        throw std::runtime_error("Bad address family");
-        break;
-    }
-}
-
-
-static std::string sockaddr_str(const struct sockaddr *addr)
-{
-    const struct sockaddr_in *in4 = (const struct sockaddr_in *)addr;
-    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
-    const int af = addr->sa_family;
-    uint16_t port;
-    char ip[80], buf[128];
-
-    switch (af) {
-    case AF_INET:
-        port = ntohs(in4->sin_port);
-        inet_ntop(af, &in4->sin_addr, ip, sizeof ip);
-        snprintf(buf, sizeof buf, "%s:%u", ip, (unsigned)port);
-        break;
-    case AF_INET6:
-        port = ntohs(in6->sin6_port);
-        inet_ntop(af, &in6->sin6_addr, ip, sizeof ip);
-        snprintf(buf, sizeof buf, "[%s]:%u", ip, (unsigned)port);
-        break;
-    default:
-        return "Unsupported address family";
-    }
-    return std::string(buf);
-}
-
-
-connection::connection(const char *host, const char *svc, u_short port):
-    sock(INVALID_SOCKET)
-{
-    ADDRINFO hints{ }, *ai, *node;
-    DWORD lasterr;
-    int res;
-
-    hints.ai_family   = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
-    hints.ai_flags    = AI_ADDRCONFIG;
-    res = getaddrinfo(host, svc, &hints, &ai);
-    if (res) {
-        throw_win32_error((DWORD)WSAGetLastError());
-    }
-    for (node = ai; node; node = node->ai_next) {
-        sock = socket(node->ai_family, SOCK_STREAM, IPPROTO_TCP);
-        if (sock == INVALID_SOCKET) {
-            lasterr = WSAGetLastError();
-            res = 1;
-            break;
-        }
-        if (!svc) {
-            set_port(node->ai_addr, port);
-        }
-        tomo::log << tomo::log::DEBUG << "Attempting to connect to " << sockaddr_str(node->ai_addr);
-        res = connect(sock, node->ai_addr, node->ai_addrlen);
-        if (!res) {
-            break;
-        }
-        lasterr = WSAGetLastError();
-        closesocket(sock);
-        sock = INVALID_SOCKET;
-    }
-    freeaddrinfo(ai);
-    if (res) {
-        throw_win32_error(lasterr);
-    }
-}
-
-
-connection::~connection()
-{
-    closesocket(sock);
-}
-
-
-void connection::send(const void *data, size_t len)
-{
-    int count;
-            /* type "void *" not compatible with "char *"? */
-    count = ::send(sock, (const char *)data, len, 0);
-    if (count < 0) {
-        throw_win32_error((DWORD)WSAGetLastError());
-    }
-}
-
-
-size_t connection::recv(void *buf, size_t len)
-{
-    int count;
-                    /* Fuck you, C++ */
-    count = ::recv(sock, (char *)buf, len, 0);
-    if (count < 0) {
-        throw_win32_error((DWORD)WSAGetLastError());
-    }
-    return (size_t)count;
-}
-
-
-void tomo::lookup_name(const char *host, uint16_t port, char *name, size_t len)
-{
-    connection conn(host, NULL, port);
-    size_t recd;
-
-    conn.send(name, strlen(name));
-    recd = conn.recv(name, len);
-    name[std::min(recd, len - 1)] = '\0';
-    if (!strcmp(name, "NOT FOUND")) {
-        throw std::runtime_error("Patient name not found in MRN database");
-    }
-}
+#include <algorithm>
+#include <climits>
+#include <stdexcept>
+#include <vector>
+#include "connection.h"
+#include "../log.h"
+
+#include <WS2tcpip.h>
+
+#undef min
+#undef max
+
+
+/** See lookup-unix.cpp */
+static constexpr std::chrono::milliseconds connect_stagger(250);
+
+
+static class wsa_init {
+    WSADATA wsdata;
+
+public:
+    wsa_init()
+    {
+        WSAStartup(MAKEWORD(2, 2), &wsdata);
+    }
+
+} initializer;
+
+
+static void throw_win32_error(DWORD err)
+{
+    char message[256], *crlf;
+
+    FormatMessageA(FORMAT_MESSAGE_FROM_SYSTEM,
+                   NULL,
+                   err,
+                   LANG_USER_DEFAULT,
+                   message,
+                   sizeof message,
+                   NULL);
+    crlf = strstr(message, "\r\n");
+    if (crlf) {
+        *crlf = '\0';
+    }
+    throw std::runtime_error(message);
+}
+
+
+static void throw_win32_error(void)
+{
+    DWORD err;
+
+    err = GetLastError();
+    throw_win32_error(err);
+}
+
+
+
+static void set_port(struct sockaddr *addr, u_short port)
+{
+    switch (addr->sa_family) {
+    case AF_INET:
+        reinterpret_cast<struct sockaddr_in *>(addr)->sin_port = htons(port);
+        break;
+    case AF_INET6:
+        reinterpret_cast<struct sockaddr_in6 *>(addr)->sin6_port = htons(port);
+        break;
+    default:
+        throw std::runtime_error("Bad address family");
+        break;
+    }
+}
+
+
+static std::string sockaddr_str(const struct sockaddr *addr)
+{
+    const struct sockaddr_in *in4 = (const struct sockaddr_in *)addr;
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+    const int af = addr->sa_family;
+    uint16_t port;
+    char ip[80], buf[128];
+
+    switch (af) {
+    case AF_INET:
+        port = ntohs(in4->sin_port);
+        inet_ntop(af, &in4->sin_addr, ip, sizeof ip);
+        snprintf(buf, sizeof buf, "%s:%u", ip, (unsigned)port);
+        break;
+    case AF_INET6:
+        port = ntohs(in6->sin6_port);
+        inet_ntop(af, &in6->sin6_addr, ip, sizeof ip);
+        snprintf(buf, sizeof buf, "[%s]:%u", ip, (unsigned)port);
+        break;
+    default:
+        return "Unsupported address family";
+    }
+    return std::string(buf);
+}
+
+
+/** Addresses in the order RFC 8305 tries them: alternating between families,
+ *  starting with whichever getaddrinfo put first */
+static std::vector<const ADDRINFO *> interleave(const ADDRINFO *ai)
+{
+    std::vector<const ADDRINFO *> first, other, order;
+    size_t i;
+
+    for (; ai; ai = ai->ai_next) {
+        if (first.empty() || ai->ai_family == first.front()->ai_family) {
+            first.push_back(ai);
+        } else {
+            other.push_back(ai);
+        }
+    }
+    for (i = 0; i < first.size() || i < other.size(); i++) {
+        if (i < first.size()) {
+            order.push_back(first[i]);
+        }
+        if (i < other.size()) {
+            order.push_back(other[i]);
+        }
+    }
+    return order;
+}
+
+
+/** Opens a non-blocking socket to @p addr and starts connecting it. Returns
+ *  the socket, or INVALID_SOCKET with @p err set. @p done is set if it
+ *  connected at once */
+static SOCKET start_connect(const ADDRINFO *addr, bool &done, DWORD &err)
+{
+    u_long nonblock = 1;
+    SOCKET s;
+
+    done = false;
+    s = socket(addr->ai_family, SOCK_STREAM, IPPROTO_TCP);
+    if (s == INVALID_SOCKET) {
+        err = WSAGetLastError();
+        return s;
+    }
+    if (ioctlsocket(s, FIONBIO, &nonblock)) {
+        err = WSAGetLastError();
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+    tomo::log << tomo::log::DEBUG << "Attempting to connect to " << sockaddr_str(addr->ai_addr);
+    if (!connect(s, addr->ai_addr, (int)addr->ai_addrlen)) {
+        done = true;
+    } else if (WSAGetLastError() != WSAEWOULDBLOCK) {
+        err = WSAGetLastError();
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+    return s;
+}
+
+
+/** Connects to the first of @p addrs to accept, RFC 8305 style, as the unix
+ *  version does. A failed connect shows in the except set of select() here.
+ *  Returns a blocking socket, or INVALID_SOCKET with @p err set by the last
+ *  failure */
+static SOCKET race_connect(const std::vector<const ADDRINFO *> &addrs,
+                           std::chrono::milliseconds timeout, DWORD &err)
+{
+    using clock = std::chrono::steady_clock;
+    const clock::time_point deadline = clock::now() + timeout;
+    clock::time_point next_start = clock::now();
+    std::vector<SOCKET> socks;
+    SOCKET s, won = INVALID_SOCKET;
+    fd_set wfds, efds;
+    struct timeval tv;
+    u_long nonblock = 0;
+    long long wait, left;
+    int res, soerr, errlen;
+    size_t next = 0, i;
+    bool done;
+
+    err = WSAECONNREFUSED;
+    while (won == INVALID_SOCKET) {
+        if (next < addrs.size() && (socks.empty() || clock::now() >= next_start)) {
+            s = start_connect(addrs[next++], done, err);
+            if (s == INVALID_SOCKET) {
+                continue;
+            }
+            if (done) {
+                won = s;
+                break;
+            }
+            socks.push_back(s);
+            next_start = clock::now() + connect_stagger;
+        }
+        if (socks.empty()) {
+            break;
+        }
+
+        /* With no attempt left to start and no deadline, select() gets no
+        timeval and waits for as long as the ones in flight take */
+        wait = -1;
+        if (next < addrs.size()) {
+            wait = std::chrono::ceil<std::chrono::milliseconds>(next_start - clock::now()).count();
+            wait = std::max(wait, 0LL);
+        }
+        if (timeout.count() > 0) {
+            left = std::chrono::ceil<std::chrono::milliseconds>(deadline - clock::now()).count();
+            if (left <= 0) {
+                err = WSAETIMEDOUT;
+                break;
+            }
+            wait = wait < 0 ? left : std::min(wait, left);
+        }
+        FD_ZERO(&wfds);
+        FD_ZERO(&efds);
+        for (SOCKET pending: socks) {
+            FD_SET(pending, &wfds);
+            FD_SET(pending, &efds);
+        }
+        tv.tv_sec = (long)(wait / 1000);
+        tv.tv_usec = (long)(wait % 1000 * 1000);
+        res = select(0, NULL, &wfds, &efds, wait < 0 ? NULL : &tv);
+        if (res == SOCKET_ERROR) {
+            err = WSAGetLastError();
+            break;
+        }
+
+        for (i = 0; res > 0 && i < socks.size(); ) {
+            if (FD_ISSET(socks[i], &wfds)) {
+                won = socks[i];
+                socks.erase(socks.begin() + i);
+                break;
+            }
+            if (!FD_ISSET(socks[i], &efds)) {
+                i++;
+                continue;
+            }
+            soerr = 0;
+            errlen = sizeof soerr;
+            getsockopt(socks[i], SOL_SOCKET, SO_ERROR, (char *)&soerr, &errlen);
+            err = soerr ? (DWORD)soerr : WSAECONNREFUSED;
+            closesocket(socks[i]);
+            socks.erase(socks.begin() + i);
+            next_start = clock::now();
+        }
+    }
+
+    for (SOCKET pending: socks) {
+        closesocket(pending);
+    }
+    if (won != INVALID_SOCKET && ioctlsocket(won, FIONBIO, &nonblock)) {
+        err = WSAGetLastError();
+        closesocket(won);
+        won = INVALID_SOCKET;
+    }
+    return won;
+}
+
+
+tomo::connection::connection(const char *host, const char *svc, uint16_t port,
+                             std::chrono::milliseconds timeout):
+    sock(INVALID_SOCKET)
+{
+    SOCKET s;
+    ADDRINFO hints{ }, *ai, *node;
+    DWORD lasterr, ms;
+    int res;
+
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags    = AI_ADDRCONFIG;
+    res = getaddrinfo(host, svc, &hints, &ai);
+    if (res) {
+        throw_win32_error((DWORD)WSAGetLastError());
+    }
+    if (!svc) {
+        for (node = ai; node; node = node->ai_next) {
+            set_port(node->ai_addr, port);
+        }
+    }
+    s = race_connect(interleave(ai), timeout, lasterr);
+    freeaddrinfo(ai);
+    if (s == INVALID_SOCKET) {
+        throw_win32_error(lasterr);
+    }
+
+    /* Both in milliseconds, as a DWORD */
+    if (timeout.count() > 0) {
+        ms = (DWORD)std::min<long long>(timeout.count(), MAXDWORD);
+        if (setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char *)&ms, sizeof ms)
+         || setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (const char *)&ms, sizeof ms)) {
+            lasterr = WSAGetLastError();
+            closesocket(s);
+            throw_win32_error(lasterr);
+        }
+    }
+    sock = s;
+}
+
+
+tomo::connection::~connection()
+{
+    closesocket((SOCKET)sock);
+}
+
+
+void tomo::connection::send(const void *data, size_t len)
+{
+    const char *p = (const char *)data;
+    int count;
+
+    while (len) {
+        /* type "void *" not compatible with "char *"? */
+        count = ::send((SOCKET)sock, p, (int)std::min<size_t>(len, INT_MAX), 0);
+        if (count < 0) {
+            if (WSAGetLastError() == WSAETIMEDOUT) {
+                throw std::runtime_error("Timed out sending data to MRN server");
+            }
+            throw_win32_error((DWORD)WSAGetLastError());
+        }
+        p += count;
+        len -= count;
+    }
+}
+
+
+size_t tomo::connection::recv(void *buf, size_t len)
+{
+    int count;
+                    /* Fuck you, C++ */
+    count = ::recv((SOCKET)sock, (char *)buf, (int)std::min<size_t>(len, INT_MAX), 0);
+    if (count < 0) {
+        if (WSAGetLastError() == WSAETIMEDOUT) {
+            throw std::runtime_error("Timed out waiting for MRN server");
+        }
+        throw_win32_error((DWORD)WSAGetLastError());
+    }
+    return (size_t)count;
+}
+
+
+void tomo::connection::shutdown_send()
+{
+    if (shutdown((SOCKET)sock, SD_SEND)) {
+        throw_win32_error((DWORD)WSAGetLastError());
+    }
+}
@@ -0,0 +1,273 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include "lookup.h"
+#include "connection.h"
+
+
+/** Longest reply to take from the server, either way */
+static constexpr size_t max_reply = 1 << 16;
+
+
+static void put_be32(char *p, uint32_t x)
+{
+    p[0] = (char)(x >> 24);
+    p[1] = (char)(x >> 16);
+    p[2] = (char)(x >> 8);
+    p[3] = (char)x;
+}
+
+
+static uint32_t get_be32(const char *p)
+{
+    return (uint32_t)(uint8_t)p[0] << 24
+         | (uint32_t)(uint8_t)p[1] << 16
+         | (uint32_t)(uint8_t)p[2] << 8
+         | (uint32_t)(uint8_t)p[3];
+}
+
+
+/** The name goes out as is, and the reply is everything up to the server
+ *  closing the connection, however many segments it comes in. Nothing else
+ *  marks its end: MRNs are separated by newlines, so a newline may be followed
+ *  by more of them. A server that keeps the connection open runs into the
+ *  timeout, which fails the lookup; it has to be spoken to framed */
+static std::string exchange_once(const char *host, uint16_t port, const std::string &name,
+                                 std::chrono::milliseconds timeout)
+{
+    tomo::connection conn(host, nullptr, port, timeout);
+    std::string reply;
+    char buf[4096];
+    size_t n;
+
+    conn.send(name.data(), name.size());
+    conn.shutdown_send();
+    while ((n = conn.recv(buf, sizeof buf))) {
+        if (reply.size() + n > max_reply) {
+            throw std::runtime_error("MRN server reply is too long");
+        }
+        reply.append(buf, n);
+    }
+    return reply;
+}
+
+
+void tomo::lookup_name(const char *host, uint16_t port, char *name, size_t len)
+{
+    std::string reply;
+
+    reply = exchange_once(host, port, name, tomo::mrn_timeout);
+    snprintf(name, len, "%s", reply.c_str());
+    if (!strcmp(name, "NOT FOUND")) {
+        throw std::runtime_error("Patient name not found in MRN database");
+    }
+}
+
+
+tomo::mrnclient::mrnclient(const char *host, uint16_t port, bool framed,
+                           std::chrono::milliseconds timeout):
+    m_host(host),
+    m_port(port),
+    m_framed(framed),
+    m_timeout(timeout),
+    m_sent(0),
+    m_recvd(0),
+    m_pending(0),
+    m_reading(false),
+    m_rxlen(0)
+{
+
+}
+
+
+tomo::mrnclient::~mrnclient()
+{
+
+}
+
+
+std::string tomo::mrnclient::lookup_once(const std::string &name)
+{
+    return exchange_once(m_host.c_str(), m_port, name, m_timeout);
+}
+
+
+uint64_t tomo::mrnclient::submit(std::unique_lock<std::mutex> &lock, const std::string *names, size_t n,
+                                 bool &reused)
+{
+    std::vector<char> out;
+    uint64_t first;
+    size_t i, pos;
+
+    /* A dead connection is only replaced once nobody waits on it any more */
+    m_cv.wait(lock, [this, n]() { return (!m_error && m_sent - m_recvd + n <= window) || !m_pending; });
+    if (m_error) {
+        m_conn.reset();
+        m_error = nullptr;
+    }
+    reused = (bool)m_conn;
+    if (!m_conn) {
+        m_conn.reset(new tomo::connection(m_host.c_str(), nullptr, m_port, m_timeout));
+        m_sent = m_recvd = 0;
+        m_replies.clear();
+        m_rxlen = 0;
+    }
+
+    /* Every query in one send */
+    for (i = 0; i < n; i++) {
+        if (names[i].size() > max_reply) {
+            throw std::runtime_error("Patient name is too long for the MRN server");
+        }
+        pos = out.size();
+        out.resize(pos + 4 + names[i].size());
+        put_be32(&out[pos], (uint32_t)names[i].size());
+        memcpy(&out[pos + 4], names[i].data(), names[i].size());
+    }
+    try {
+        m_conn->send(out.data(), out.size());
+    } catch (...) {
+        m_error = std::current_exception();
+        m_cv.notify_all();
+        throw;
+    }
+    first = m_sent;
+    m_sent += n;
+    m_pending += n;
+    return first;
+}
+
+
+std::string tomo::mrnclient::read_reply()
+{
+    size_t n, len;
+    std::string reply;
+
+    for (;;) {
+        if (m_rxlen >= 4) {
+            len = get_be32(m_rxbuf.data());
+            if (len > max_reply) {
+                throw std::runtime_error("MRN server reply is too long");
+            }
+            if (m_rxlen >= 4 + len) {
+                reply.assign(m_rxbuf.data() + 4, len);
+                m_rxlen -= 4 + len;
+                memmove(m_rxbuf.data(), m_rxbuf.data() + 4 + len, m_rxlen);
+                return reply;
+            }
+        }
+        if (m_rxbuf.size() - m_rxlen < 4096) {
+            m_rxbuf.resize(std::max<size_t>(m_rxbuf.size() * 2, 8192));
+        }
+        n = m_conn->recv(m_rxbuf.data() + m_rxlen, m_rxbuf.size() - m_rxlen);
+        if (!n) {
+            throw std::runtime_error("MRN server closed the connection");
+        }
+        m_rxlen += n;
+    }
+}
+
+
+std::string tomo::mrnclient::collect(std::unique_lock<std::mutex> &lock, uint64_t ticket)
+{
+    std::string reply;
+
+    for (;;) {
+        auto it = m_replies.find(ticket);
+
+        if (it != m_replies.end()) {
+            reply = std::move(it->second);
+            m_replies.erase(it);
+            m_pending--;
+            m_cv.notify_all();
+            return reply;
+        }
+        if (m_error) {
+            m_pending--;
+            m_cv.notify_all();
+            std::rethrow_exception(m_error);
+        }
+        if (m_reading) {
+            m_cv.wait(lock);
+            continue;
+        }
+
+        /* Replies come in the order the queries went out, whoever reads them */
+        m_reading = true;
+        lock.unlock();
+        try {
+            reply = read_reply();
+            lock.lock();
+            m_replies.emplace(m_recvd++, std::move(reply));
+        } catch (...) {
+            lock.lock();
+            m_error = std::current_exception();
+        }
+        m_reading = false;
+        m_cv.notify_all();
+    }
+}
+
+
+std::string tomo::mrnclient::lookup(const std::string &name)
+{
+    std::vector<std::string> replies;
+
+    if (!framed()) {
+        return lookup_once(name);
+    }
+    replies = lookup(std::vector<std::string>{ name });
+    return std::move(replies.front());
+}
+
+
+std::vector<std::string> tomo::mrnclient::lookup(const std::vector<std::string> &names)
+{
+    std::vector<std::string> replies;
+    std::unique_lock<std::mutex> lock(m_mtx, std::defer_lock);
+    uint64_t first;
+    size_t i, j, n;
+    bool reused, again;
+
+    replies.reserve(names.size());
+    if (!framed()) {
+        for (const auto &name: names) {
+            replies.push_back(lookup_once(name));
+        }
+        return replies;
+    }
+
+    /* A window at a time, each taken back in full before the next goes out.
+    One that fails on a connection that was already open, before any of its
+    replies came, goes out again on a new one */
+    lock.lock();
+    for (i = 0; i < names.size(); i += n) {
+        n = std::min(window, names.size() - i);
+        for (again = true; ; again = false) {
+            try {
+                first = submit(lock, &names[i], n, reused);
+            } catch (...) {
+                if (again && reused) {
+                    continue;
+                }
+                throw;
+            }
+            for (j = 0; j < n; j++) {
+                try {
+                    replies.push_back(collect(lock, first + j));
+                } catch (...) {
+                    /* The rest will never be taken either */
+                    m_pending -= n - j - 1;
+                    m_cv.notify_all();
+                    if (!again || !reused || j) {
+                        throw;
+                    }
+                    break;
+                }
+            }
+            if (j == n) {
+                break;
+            }
+        }
+    }
+    return replies;
+}
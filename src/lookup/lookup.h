@@ -1,47 +1,151 @@
-#pragma once
-/** Oh wow I already have a lookup.h in this project what do you know */
-#ifndef TOMO_LOOKUP_H
-#define TOMO_LOOKUP_H
-
-#include <stdexcept>
-
-/** TODO: Only allow connections to the same subnet? Ask for confirmation if an
- *      attempt is made to connect to the internet?
- */
-
-
-/** The lookup mechanism must take the patient's name in DICOM format, and
- *  return either:
- *    - "NOT FOUND" if the patient's name is not found or cannot be mapped
- *    - A list of MRN's mapped to this name, each separated by a single newline
- *      char. There is no currently no facility for disambiguating these IDs
- * 
- *  Because name clashes cannot currently be resolved, the query format may
- *  change in the future to accomodate patient DOB as well.
- */
-
-
-namespace tomo {
-
-
-/** @brief Look up @p name in whatever external database is accessible to this
- *      function
- *  @param host
- *      Hostname of the MRN server
- *  @param port
- *      Port to connect to
- *  @param name
- *      On entry, a pointer to a buffer containing the patient name string in
- *      DICOM format. On output, this will contain the result
- *  @param len
- *      The size of @p name in bytes
- *  @throws std::runtime_error if connection cannot be established, or if the
- *      name was not found
- */
-void lookup_name(const char *host, uint16_t port, char *name, size_t len);
-
-
-};
-
-
-#endif /* TOMO_LOOKUP_H */
+#pragma once
+/** Oh wow I already have a lookup.h in this project what do you know */
+#ifndef TOMO_LOOKUP_H
+#define TOMO_LOOKUP_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/** TODO: Only allow connections to the same subnet? Ask for confirmation if an
+ *      attempt is made to connect to the internet?
+ */
+
+
+/** The lookup mechanism must take the patient's name in DICOM format, and
+ *  return either:
+ *    - "NOT FOUND" if the patient's name is not found or cannot be mapped
+ *    - A list of MRN's mapped to this name, each separated by a single newline
+ *      char. There is no currently no facility for disambiguating these IDs
+ * 
+ *  Because name clashes cannot currently be resolved, the query format may
+ *  change in the future to accomodate patient DOB as well.
+ */
+
+
+namespace tomo {
+
+
+class connection;
+
+
+/** How long connecting to the MRN server may take, and then how long it may
+ *  go quiet while a reply is expected, unless the caller says otherwise */
+constexpr std::chrono::milliseconds mrn_timeout = std::chrono::seconds(10);
+
+
+/** @brief Look up @p name in whatever external database is accessible to this
+ *      function
+ *  @param host
+ *      Hostname of the MRN server
+ *  @param port
+ *      Port to connect to
+ *  @param name
+ *      On entry, a pointer to a buffer containing the patient name string in
+ *      DICOM format. On output, this will contain the result
+ *  @param len
+ *      The size of @p name in bytes
+ *  @throws std::runtime_error if connection cannot be established, or the
+ *      server does not reply, within mrn_timeout, or if the name was not found
+ */
+void lookup_name(const char *host, uint16_t port, char *name, size_t len);
+
+
+/** Looks names up on the MRN server, for any number of archives
+ *
+ *  By default every lookup is a connection of its own, exactly as lookup_name
+ *  makes, and its reply ends where the server closes it. A server that keeps
+ *  the connection open only works framed. A framed client instead keeps one
+ *  connection open for as long as it lives, and puts each query and each reply
+ *  behind its length, as a 4-byte big-endian integer. Queries then go out back to back without waiting on
+ *  the replies, which come back in the same order. Threads may share a client;
+ *  their queries are pipelined on the one connection. If it drops, the lookups
+ *  in flight fail and the next one reconnects. The server may well close it
+ *  while it sits idle, so queries that fail on a connection that was already
+ *  open, before any of their replies came, go out once more on a new one
+ */
+class mrnclient {
+    /** Queries in flight at once. Keeps both ends from blocking on a full
+     *  socket buffer while the other is still sending */
+    static constexpr size_t window = 64;
+
+    std::string m_host;
+    uint16_t m_port;
+    bool m_framed;
+    std::chrono::milliseconds m_timeout;
+
+    std::unique_ptr<tomo::connection> m_conn;
+    std::mutex m_mtx;
+    std::condition_variable m_cv;
+
+    uint64_t m_sent;            /* Queries sent on this connection */
+    uint64_t m_recvd;           /* Replies read from it */
+    size_t m_pending;           /* Queries whose replies nobody took yet */
+    bool m_reading;             /* Some thread is reading the next reply */
+    std::map<uint64_t, std::string> m_replies;
+    std::exception_ptr m_error;
+
+    std::vector<char> m_rxbuf;  /* Only touched by the thread reading */
+    size_t m_rxlen;
+
+
+    /** Sends @p n queries from @p names. Returns the first one's number.
+     *  @p reused is whether they went out on a connection that was already
+     *  open, even if sending fails */
+    uint64_t submit(std::unique_lock<std::mutex> &lock, const std::string *names, size_t n,
+                    bool &reused);
+
+    /** Waits for reply @p ticket, reading replies in turn if nobody else is */
+    std::string collect(std::unique_lock<std::mutex> &lock, uint64_t ticket);
+
+    /** Reads the next framed reply off the connection */
+    std::string read_reply();
+
+    /** One lookup on a connection of its own */
+    std::string lookup_once(const std::string &name);
+
+public:
+    /** @brief Looks names up on @p host at @p port. Nothing connects until the
+     *      first lookup
+     *  @param timeout
+     *      Limits each connection attempt, and each wait on the server after
+     *      it. A lookup that times out fails like any other
+     */
+    mrnclient(const char *host, uint16_t port, bool framed = false,
+              std::chrono::milliseconds timeout = mrn_timeout);
+    ~mrnclient();
+
+    mrnclient(const mrnclient &) = delete;
+    mrnclient &operator=(const mrnclient &) = delete;
+
+
+    /** @brief The server's reply to @p name: "NOT FOUND", or its MRNs
+     *      separated by newlines
+     *  @throws std::runtime_error if the server cannot be reached, or
+     *      replies with something malformed
+     */
+    std::string lookup(const std::string &name);
+
+    /** @brief The replies to every name in @p names, in order. A framed
+     *      client pipelines them all
+     */
+    std::vector<std::string> lookup(const std::vector<std::string> &names);
+
+    const std::string &host() const noexcept { return m_host; }
+    uint16_t port() const noexcept { return m_port; }
+    bool framed() const noexcept { return m_framed; }
+    std::chrono::milliseconds timeout() const noexcept { return m_timeout; }
+};
+
+
+};
+
+
+#endif /* TOMO_LOOKUP_H */
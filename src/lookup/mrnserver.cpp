@@ -0,0 +1,349 @@
+/** A stand-in for the MRN server, for trying the converter and timing batch
+ *  lookups offline. Not for use with real patient data
+ *
+ *  It answers each name with the MRNs listed for it in a map file, one
+ *  "name<TAB>mrn" per line, or without one, with an MRN made up from a hash
+ *  of the name. Connections either carry a single query up to the client's
+ *  end of stream, as lookup_name sends it, or with --framed, any number of
+ *  length-framed queries, as a framed tomo::mrnclient sends them
+ *
+ *  With --stall it accepts nothing, and once its backlog is full, connections
+ *  to it hang as they would to a dead host. One of those on ::1 and a live one
+ *  on 127.0.0.1 at the same port stand in for a dual-stacked MRN host whose
+ *  IPv6 address is dead, for any name that resolves to both
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "lookup.h"
+
+using namespace std::literals;
+
+
+/** Longest query to take from a client */
+static constexpr size_t max_query = 1 << 16;
+
+static std::multimap<std::string, std::string> mrns;
+static bool use_map = false;
+
+
+static std::string answer(const std::string &name)
+{
+    uint64_t h = 14695981039346656037ull;   /* FNV-1a */
+    std::string reply;
+    char buf[32];
+
+    if (use_map) {
+        auto range = mrns.equal_range(name);
+
+        for (auto it = range.first; it != range.second; ++it) {
+            if (!reply.empty()) {
+                reply += '\n';
+            }
+            reply += it->second;
+        }
+        return reply.empty() ? "NOT FOUND" : reply;
+    }
+    for (unsigned char c: name) {
+        h = (h ^ c) * 1099511628211ull;
+    }
+    snprintf(buf, sizeof buf, "%08llu", (unsigned long long)(h % 100000000));
+    return buf;
+}
+
+
+static bool read_all(int fd, void *dst, size_t len)
+{
+    char *p = (char *)dst;
+    ssize_t n;
+
+    while (len) {
+        n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+
+static bool write_all(int fd, const void *src, size_t len)
+{
+    const char *p = (const char *)src;
+    ssize_t n;
+
+    while (len) {
+        n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+
+static void serve_once(int fd)
+{
+    std::string name, reply;
+    char buf[4096];
+    ssize_t n;
+
+    while ((n = recv(fd, buf, sizeof buf, 0)) != 0) {
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 || name.size() + n > max_query) {
+            return;
+        }
+        name.append(buf, n);
+    }
+    reply = answer(name);
+    write_all(fd, reply.data(), reply.size());
+}
+
+
+static void serve_framed(int fd)
+{
+    std::string name, reply, out;
+    unsigned char hdr[4];
+    uint32_t len;
+
+    /* The replies to everything already in are sent together */
+    while (read_all(fd, hdr, 4)) {
+        len = (uint32_t)hdr[0] << 24 | hdr[1] << 16 | hdr[2] << 8 | hdr[3];
+        if (len > max_query) {
+            return;
+        }
+        name.resize(len);
+        if (!read_all(fd, name.data(), len)) {
+            return;
+        }
+        reply = answer(name);
+        len = (uint32_t)reply.size();
+        out += (char)(len >> 24);
+        out += (char)(len >> 16);
+        out += (char)(len >> 8);
+        out += (char)len;
+        out += reply;
+
+        /* Flushed once the client has nothing more queued */
+        if (recv(fd, hdr, 1, MSG_PEEK | MSG_DONTWAIT) <= 0) {
+            if (!write_all(fd, out.data(), out.size())) {
+                return;
+            }
+            out.clear();
+        }
+    }
+    write_all(fd, out.data(), out.size());
+}
+
+
+/** Listens on 127.0.0.1:@p port, or ::1 if @p ipv6, or any free port if 0.
+ *  Returns the socket */
+static int listen_on(uint16_t &port, bool ipv6 = false, int backlog = 128)
+{
+    struct sockaddr_in addr = { };
+    struct sockaddr_in6 addr6 = { };
+    struct sockaddr *sa = (struct sockaddr *)&addr;
+    socklen_t len = sizeof addr;
+    int fd, one = 1;
+
+    if (ipv6) {
+        addr6.sin6_family = AF_INET6;
+        addr6.sin6_port = htons(port);
+        addr6.sin6_addr = in6addr_loopback;
+        sa = (struct sockaddr *)&addr6;
+        len = sizeof addr6;
+    } else {
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    }
+    fd = socket(sa->sa_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot create socket");
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+    if (bind(fd, sa, len) || listen(fd, backlog)) {
+        close(fd);
+        throw std::runtime_error("Cannot listen on port " + std::to_string(port));
+    }
+    getsockname(fd, sa, &len);
+    port = ntohs(ipv6 ? addr6.sin6_port : addr.sin_port);
+    return fd;
+}
+
+
+/** Never accepts. The one connection made here fills the backlog, so the
+ *  kernel drops every SYN after it */
+static void stall(uint16_t port, bool ipv6)
+{
+    int lfd = listen_on(port, ipv6, 0);
+    int fd = socket(ipv6 ? AF_INET6 : AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof addr;
+
+    getsockname(lfd, (struct sockaddr *)&addr, &len);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, len)) {
+        throw std::runtime_error("Cannot fill the backlog");
+    }
+    for (;;) {
+        pause();
+    }
+}
+
+
+static void serve(int lfd, bool framed)
+{
+    int fd;
+
+    for (;;) {
+        fd = accept(lfd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return;
+        }
+        std::thread([fd, framed]() {
+            if (framed) {
+                serve_framed(fd);
+            } else {
+                serve_once(fd);
+            }
+            close(fd);
+        }).detach();
+    }
+}
+
+
+static void load_map(const char *path)
+{
+    std::ifstream f(path);
+    std::string line;
+    size_t tab;
+
+    if (!f) {
+        throw std::runtime_error("Cannot open map file "s + path);
+    }
+    while (std::getline(f, line)) {
+        tab = line.find('\t');
+        if (tab != std::string::npos) {
+            mrns.emplace(line.substr(0, tab), line.substr(tab + 1));
+        }
+    }
+    use_map = true;
+}
+
+
+/** Times @p n lookups through a one-shot client and a pipelined one, each
+ *  against its own server in this process */
+static int bench(size_t n)
+{
+    using clock = std::chrono::steady_clock;
+    uint16_t port1 = 0, port2 = 0;
+    int lfd1 = listen_on(port1), lfd2 = listen_on(port2);
+    std::vector<std::string> names(n);
+    size_t i;
+
+    std::thread(serve, lfd1, false).detach();
+    std::thread(serve, lfd2, true).detach();
+    for (i = 0; i < n; i++) {
+        names[i] = "DOE^JOHN^" + std::to_string(i);
+    }
+
+    for (bool framed: { false, true }) {
+        tomo::mrnclient client("127.0.0.1", framed ? port2 : port1, framed);
+        auto t0 = clock::now();
+        auto replies = client.lookup(names);
+        double s = std::chrono::duration<double>(clock::now() - t0).count();
+
+        for (i = 0; i < n; i++) {
+            if (replies[i] != answer(names[i])) {
+                fprintf(stderr, "Wrong reply to %s\n", names[i].c_str());
+                return 1;
+            }
+        }
+        printf("%-9s %zu lookups in %.3f s, %.0f/s\n", framed ? "pipelined" : "one-shot", n, s, n / s);
+    }
+    return 0;
+}
+
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+        "Usage: %s [--framed] [--port PORT] [--ipv6] [--map FILE]\n"
+        "       %s --stall [--port PORT] [--ipv6]\n"
+        "       %s --bench N\n"
+        "Answers MRN lookups on 127.0.0.1, for testing only\n\n"
+        "    --framed       take length-framed queries, as --mrn-pipeline sends them\n"
+        "    --port PORT    listen on PORT (default 6006)\n"
+        "    --ipv6         listen on ::1 instead\n"
+        "    --stall        answer nothing, and let connections hang like a dead host\n"
+        "    --map FILE     answer from FILE, one \"name<TAB>mrn\" per line\n"
+        "    --bench N      time N lookups one-shot and pipelined, then exit\n",
+        argv0, argv0, argv0);
+}
+
+
+int main(int argc, char *argv[])
+{
+    uint16_t port = 6006;
+    bool framed = false, ipv6 = false, stalled = false;
+    int i;
+
+    try {
+        for (i = 1; i < argc; i++) {
+            if (!strcmp(argv[i], "--framed")) {
+                framed = true;
+            } else if (!strcmp(argv[i], "--ipv6")) {
+                ipv6 = true;
+            } else if (!strcmp(argv[i], "--stall")) {
+                stalled = true;
+            } else if (!strcmp(argv[i], "--port") && i + 1 < argc) {
+                port = (uint16_t)atoi(argv[++i]);
+            } else if (!strcmp(argv[i], "--map") && i + 1 < argc) {
+                load_map(argv[++i]);
+            } else if (!strcmp(argv[i], "--bench") && i + 1 < argc) {
+                return bench(strtoul(argv[++i], nullptr, 10));
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        if (stalled) {
+            stall(port, ipv6);
+        }
+        serve(listen_on(port, ipv6), framed);
+    } catch (const std::exception &e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    return 1;
+}
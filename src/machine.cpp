@@ -1,6 +1,119 @@
+#include <atomic>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <system_error>
 #include <utility>
+#include <vector>
 #include "machine.h"
+#include "cache.h"
 #include "error.h"
+#include "log.h"
+#include "xmlscan.h"
+#include "snapshot.h"
+
+
+/** How much of each XML file is read to decide if it is a machine file */
+static constexpr size_t sniff_len = 8192;
+
+
+/** One line per archive directory in the index file, tab-separated:
+ *      directory, machine file name, size, modification time */
+struct index_entry {
+    std::string dir;
+    std::string name;
+    uintmax_t size;
+    long long mtime;
+};
+
+
+static std::mutex index_mtx;    /* Archives in one batch share the index */
+
+
+static std::filesystem::path index_path()
+{
+    std::filesystem::path path = tomo::cache_dir();
+
+    if (!path.empty()) {
+        path.append("machines.idx");
+    }
+    return path;
+}
+
+
+static std::vector<index_entry> read_index(const std::filesystem::path &path)
+{
+    std::vector<index_entry> entries;
+    std::ifstream file(path);
+    std::string line;
+    index_entry ent;
+
+    while (std::getline(file, line)) {
+        std::istringstream ss(line);
+
+        if (std::getline(ss, ent.dir, '\t') && std::getline(ss, ent.name, '\t')
+         && ss >> ent.size >> ent.mtime) {
+            entries.push_back(ent);
+        }
+    }
+    return entries;
+}
+
+
+/** The index is replaced as a whole, so a reader never sees half of it. Each
+ *  writer, in this process or another, has a temporary of its own, and the
+ *  last rename wins; at worst an entry is lost and found again by sniffing */
+static void write_index(const std::filesystem::path &path, const std::vector<index_entry> &entries)
+{
+    static std::atomic<uint64_t> seq(std::random_device{}());
+    std::filesystem::path tmp = path;
+    std::error_code err;
+    std::ofstream file;
+    char suffix[32];
+
+    snprintf(suffix, sizeof suffix, ".%016" PRIx64 ".tmp", seq++);
+    tmp += suffix;
+    file.open(tmp, std::ios::out | std::ios::trunc);
+    for (const auto &ent: entries) {
+        file << ent.dir << '\t' << ent.name << '\t' << ent.size << '\t' << ent.mtime << '\n';
+    }
+    file.close();
+    if (file) {
+        std::filesystem::rename(tmp, path, err);
+    }
+    if (!file || err) {
+        tomo::log::printf(tomo::log::WARN, "Cannot update the machine index %s", path.string().c_str());
+        std::filesystem::remove(tmp, err);
+    }
+}
+
+
+/** @returns false if the file cannot be stat'ed */
+static bool stat_file(const std::filesystem::path &path, index_entry &ent)
+{
+    std::error_code err;
+
+    ent.size = std::filesystem::file_size(path, err);
+    if (err) {
+        return false;
+    }
+    ent.mtime = std::filesystem::last_write_time(path, err).time_since_epoch().count();
+    return !err;
+}
+
+
+static std::string index_key(const std::filesystem::path &dir)
+{
+    std::error_code err;
+    std::filesystem::path abs;
+
+    abs = std::filesystem::weakly_canonical(dir, err);
+    return err ? std::filesystem::absolute(dir).lexically_normal().string() : abs.string();
+}
 
 
 tomo::machine::machine()
@@ -33,6 +146,101 @@ bool tomo::machine::load_file(const std::filesystem::path &xml)
 }
 
 
+bool tomo::machine::sniff(const std::filesystem::path &xml)
+{
+    std::vector<char> head(sniff_len);
+    std::ifstream file;
+
+    file.open(xml, std::ios::in | std::ios::binary);
+    file.read(head.data(), head.size());
+    head.resize(file.gcount());
+
+    /* Mirrors load_file, which wants FullMachine directly under the root. A
+    huge patient or curve file is given up on at its first few elements */
+    try {
+        tomo::xmlscan scan(head.data(), head.size());
+
+        while (scan.next() != tomo::xmlscan::DONE) {
+            if (scan.depth() == 2) {
+                if (scan.name() == "FullMachine") {
+                    return true;
+                }
+            }
+        }
+    } catch (std::runtime_error &) {
+        /* The prefix ended mid-markup, or this is not XML */
+    }
+    return false;
+}
+
+
+bool tomo::machine::load_dir(const std::filesystem::path &dir)
+{
+    const std::filesystem::path idx = index_path();
+    const std::string key = index_key(dir);
+    std::vector<std::filesystem::path> xmls;
+    std::vector<index_entry> entries;
+    std::filesystem::path found;
+    index_entry cur;
+
+    if (!idx.empty()) {
+        std::lock_guard<std::mutex> lock(index_mtx);
+
+        entries = read_index(idx);
+    }
+    for (const auto &ent: entries) {
+        if (ent.dir == key) {
+            found = dir;
+            found.append(ent.name);
+            if (stat_file(found, cur) && cur.size == ent.size && cur.mtime == ent.mtime
+             && load_file(found)) {
+                log::printf(tomo::log::DEBUG, "Machine file %s is in the index", found.string().c_str());
+                return true;
+            }
+            found.clear();
+            break;
+        }
+    }
+
+    for (auto &file: std::filesystem::directory_iterator(dir)) {
+        if (file.path().extension() == ".xml") {
+            xmls.push_back(file.path());
+        }
+    }
+    for (const auto &xml: xmls) {
+        if (sniff(xml) && load_file(xml)) {
+            found = xml;
+            break;
+        }
+    }
+    if (found.empty()) {
+        log::puts(tomo::log::DEBUG, "No machine file found by its root; trying every XML file");
+        for (const auto &xml: xmls) {
+            if (load_file(xml)) {
+                found = xml;
+                break;
+            }
+        }
+    }
+    if (found.empty()) {
+        return false;
+    }
+
+    cur.dir = key;
+    cur.name = found.filename().string();
+    if (!idx.empty() && stat_file(found, cur)
+     && key.find_first_of("\t\n") == key.npos && cur.name.find_first_of("\t\n") == cur.name.npos) {
+        std::lock_guard<std::mutex> lock(index_mtx);
+
+        entries = read_index(idx);
+        std::erase_if(entries, [&key](const index_entry &ent) { return ent.dir == key; });
+        entries.push_back(cur);
+        write_index(idx, entries);
+    }
+    return true;
+}
+
+
 void tomo::machine::construct(pugi::xml_node root)
 {
     pugi::xml_node node;
@@ -41,3 +249,9 @@ void tomo::machine::construct(pugi::xml_node root)
     node = xchild(node, "machineName");
     name() = node.text().as_string();
 }
+
+
+void tomo::machine::serialize(tomo::snapshot &snap)
+{
+    snap(m_name);
+}
@@ -15,14 +15,32 @@ class machine: public constructible {
 
     std::string &name() noexcept { return m_name; }
 
+
+    /** Whether the first few KB of @p xml look like a machine file */
+    static bool sniff(const std::filesystem::path &xml);
+
 public:
     machine();
 
     /** Returns true if the file was successfully loaded */
     bool load_file(const std::filesystem::path &xml);
 
+
+    /** @brief Finds and loads the machine file in the archive directory @p dir.
+     *      Where it was found is remembered in the cache directory, keyed on
+     *      the directory and the file's name, size and modification time, so
+     *      later runs on the same archive go straight to it
+     *
+     *      Otherwise, only files whose root holds a FullMachine element near
+     *      the top are parsed. Every XML file is tried, like before, only if
+     *      none of those loads
+     *  @returns true if a machine file was loaded
+     */
+    bool load_dir(const std::filesystem::path &dir);
+
     /** From the node "fullMachine" */
     virtual void construct(pugi::xml_node root) override;
+    virtual void serialize(tomo::snapshot &snap) override;
 
     const std::string &name() const noexcept { return m_name; }
 };
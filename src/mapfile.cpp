@@ -0,0 +1,184 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+#include "mapfile.h"
+
+#if defined(_WIN32)
+#   include <Windows.h>
+
+#else
+#   include <fcntl.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <unistd.h>
+
+#endif
+
+
+static void throw_map_error(const std::filesystem::path &path, const char *what)
+{
+    std::stringstream ss;
+
+    ss << "Cannot map " << path.string() << ": " << what;
+    throw std::runtime_error(ss.str());
+}
+
+
+tomo::mapfile::mapfile() noexcept:
+    m_data(nullptr),
+    m_size(0)
+#if defined(_WIN32)
+    , m_file(nullptr),
+    m_map(nullptr)
+#endif
+{
+
+}
+
+
+#if defined(_WIN32)
+
+tomo::mapfile::mapfile(const std::filesystem::path &path, bool cow):
+    mapfile()
+{
+    LARGE_INTEGER size;
+    HANDLE file;
+
+    file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                       OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        throw_map_error(path, "cannot open file");
+    }
+    m_file = file;
+    if (!GetFileSizeEx(file, &size)) {
+        close();
+        throw_map_error(path, "cannot stat file");
+    }
+    m_size = (size_t)size.QuadPart;
+    if (!m_size) {
+        /* Windows refuses to map empty files */
+        return;
+    }
+    m_map = CreateFileMappingW(file, NULL, cow ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, NULL);
+    if (m_map) {
+        m_data = MapViewOfFile(m_map, cow ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+    }
+    if (!m_data) {
+        close();
+        throw_map_error(path, "cannot map file");
+    }
+}
+
+
+void tomo::mapfile::release(size_t, size_t) noexcept
+{
+    /* The working set trimmer gets to these soon enough */
+}
+
+
+void tomo::mapfile::close() noexcept
+{
+    if (m_data) {
+        UnmapViewOfFile(m_data);
+    }
+    if (m_map) {
+        CloseHandle(m_map);
+    }
+    if (m_file) {
+        CloseHandle(m_file);
+    }
+    m_data = nullptr;
+    m_map = nullptr;
+    m_file = nullptr;
+    m_size = 0;
+}
+
+#else
+
+tomo::mapfile::mapfile(const std::filesystem::path &path, bool cow):
+    mapfile()
+{
+    struct stat st;
+    void *data;
+    int fd;
+
+    fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        throw_map_error(path, strerror(errno));
+    }
+    if (fstat(fd, &st)) {
+        ::close(fd);
+        throw_map_error(path, strerror(errno));
+    }
+    if (st.st_size) {
+        data = mmap(nullptr, st.st_size, cow ? PROT_READ | PROT_WRITE : PROT_READ,
+                    MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            ::close(fd);
+            throw_map_error(path, strerror(errno));
+        }
+        /* Readahead aggressively, and drop pages behind us */
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+        m_data = data;
+        m_size = st.st_size;
+    }
+    /* The mapping keeps its own reference to the file */
+    ::close(fd);
+}
+
+
+void tomo::mapfile::release(size_t offset, size_t len) noexcept
+{
+    static const uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t begin, end;
+
+    len = std::min(len, m_size - std::min(offset, m_size));
+    begin = reinterpret_cast<uintptr_t>(m_data) + offset;
+    end = begin + len;
+    begin = (begin + page - 1) & ~(page - 1);
+    end &= ~(page - 1);
+    if (begin < end) {
+        madvise(reinterpret_cast<void *>(begin), end - begin, MADV_DONTNEED);
+    }
+}
+
+
+void tomo::mapfile::close() noexcept
+{
+    if (m_data) {
+        munmap(m_data, m_size);
+    }
+    m_data = nullptr;
+    m_size = 0;
+}
+
+#endif
+
+
+tomo::mapfile::mapfile(mapfile &&other) noexcept:
+    mapfile()
+{
+    *this = std::move(other);
+}
+
+
+tomo::mapfile &tomo::mapfile::operator=(mapfile &&other) noexcept
+{
+    std::swap(m_data, other.m_data);
+    std::swap(m_size, other.m_size);
+#if defined(_WIN32)
+    std::swap(m_file, other.m_file);
+    std::swap(m_map, other.m_map);
+#endif
+    return *this;
+}
+
+
+tomo::mapfile::~mapfile()
+{
+    close();
+}
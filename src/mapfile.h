@@ -0,0 +1,66 @@
+#pragma once
+
+#ifndef MAPFILE_H
+#define MAPFILE_H
+
+#include <cstddef>
+#include <filesystem>
+
+
+namespace tomo {
+
+
+/** A memory mapping of an entire file. Pages are faulted in from the page
+ *  cache as they are touched, so nothing is copied until a consumer actually
+ *  reads it. A copy-on-write mapping may also be scribbled on, and only the
+ *  pages written to are ever copied; the file itself never changes
+ */
+class mapfile {
+    void *m_data;
+    size_t m_size;
+
+#if defined(_WIN32)
+    void *m_file;   /* HANDLEs, kept opaque to keep Windows.h out of here */
+    void *m_map;
+#endif
+
+
+    void close() noexcept;
+
+public:
+    mapfile() noexcept;
+
+    /** @brief Maps the file at @p path and hints that it will be read front to
+     *      back. The mapping is writable, privately, if @p cow is set
+     *  @throws std::runtime_error if the file cannot be opened or mapped
+     */
+    explicit mapfile(const std::filesystem::path &path, bool cow = false);
+
+    mapfile(mapfile &&other) noexcept;
+    mapfile &operator=(mapfile &&other) noexcept;
+
+    mapfile(const mapfile &) = delete;
+    mapfile &operator=(const mapfile &) = delete;
+
+    ~mapfile();
+
+
+    /** @brief Hands the pages wholly inside [@p offset, @p offset + @p len)
+     *      back to the kernel. They are faulted in from the file again if they
+     *      are touched later, so on a copy-on-write mapping anything written to
+     *      them is lost. This is purely advisory
+     */
+    void release(size_t offset, size_t len) noexcept;
+
+
+    /** Only to be written to through a copy-on-write mapping */
+    void *data() noexcept { return m_data; }
+    const void *data() const noexcept { return m_data; }
+    size_t size() const noexcept { return m_size; }
+};
+
+
+};
+
+
+#endif /* MAPFILE_H */
@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <system_error>
+#include "mrncache.h"
+#include "lookup/lookup.h"
+#include "snapshot.h"
+#include "cache.h"
+#include "log.h"
+
+
+/** First line of every entry. The rest of the line is the time of the reply,
+ *  and the lengths of the key and reply that follow it. Version 1 keyed by
+ *  the name alone */
+static const char entry_magic[] = "tomoconv-mrn 2";
+
+
+static int64_t now_seconds()
+{
+    using namespace std::chrono;
+
+    return duration_cast<seconds>(system_clock::now().time_since_epoch()).count();
+}
+
+
+/** Whether @p reply names no one MRN. These get the shorter TTL */
+static bool is_negative(const std::string &reply)
+{
+    return reply == "NOT FOUND" || reply.find('\n') != std::string::npos;
+}
+
+
+tomo::mrncache::mrncache(tomo::mrnclient &client, std::chrono::seconds ttl,
+                         std::chrono::seconds negative_ttl, bool bypass):
+    m_client(client),
+    m_ttl(ttl),
+    m_negttl(std::min(negative_ttl, ttl)),
+    m_server(client.host() + ':' + std::to_string(client.port()) + (client.framed() ? " framed" : ""))
+{
+    std::error_code err;
+
+    if (bypass || ttl.count() <= 0) {
+        return;
+    }
+    m_dir = tomo::cache_dir();
+    if (m_dir.empty()) {
+        return;
+    }
+    m_dir.append("mrn");
+    std::filesystem::create_directories(m_dir, err);
+    if (!err) {
+        std::filesystem::permissions(m_dir, std::filesystem::perms::owner_all,
+                                     std::filesystem::perm_options::replace, err);
+    }
+    if (err) {
+        log::printf(tomo::log::WARN, "Not caching MRN lookups: cannot create %s: %s",
+                    m_dir.string().c_str(), err.message().c_str());
+        m_dir.clear();
+    }
+}
+
+
+/** The server, then the name. A newline cannot be in a host name */
+std::string tomo::mrncache::entry_key(const std::string &name) const
+{
+    return m_server + '\n' + name;
+}
+
+
+std::filesystem::path tomo::mrncache::entry_path(const std::string &key) const
+{
+    std::filesystem::path path = m_dir;
+    char hex[17];
+
+    snprintf(hex, sizeof hex, "%016llx", (unsigned long long)tomo::snapshot::hash(key.data(), key.size()));
+    path.append(hex);
+    return path;
+}
+
+
+/** Anything that does not read back exactly is a miss, and is written over
+ *  once the server has replied */
+std::optional<std::string> tomo::mrncache::load(const std::string &key) const
+{
+    std::ifstream file(entry_path(key), std::ios::in | std::ios::binary);
+    std::string line, stored, reply;
+    long long when;
+    size_t nkey, nreply;
+
+    if (!file || !std::getline(file, line)) {
+        return std::nullopt;
+    }
+    if (line.compare(0, sizeof entry_magic - 1, entry_magic)
+        || sscanf(line.c_str() + sizeof entry_magic - 1, " %lld %zu %zu", &when, &nkey, &nreply) != 3
+        || nkey != key.size() || !nreply || nreply > 1 << 16) {
+        return std::nullopt;
+    }
+    stored.resize(nkey);
+    reply.resize(nreply);
+    if (!file.read(stored.data(), nkey) || !file.read(reply.data(), nreply)
+        || file.peek() != std::char_traits<char>::eof()) {
+        return std::nullopt;
+    }
+
+    /* A hash collision reads back as somebody else's name, or server */
+    if (stored != key) {
+        return std::nullopt;
+    }
+    if (when > now_seconds() || now_seconds() - when >= (is_negative(reply) ? m_negttl : m_ttl).count()) {
+        return std::nullopt;
+    }
+    return reply;
+}
+
+
+void tomo::mrncache::save(const std::string &key, const std::string &reply) const
+{
+    static std::atomic<uint64_t> seq(std::random_device{}());
+    const std::filesystem::path path = entry_path(key);
+    std::filesystem::path tmp = path;
+    std::error_code err;
+    std::ofstream file;
+    char suffix[32];
+
+    /* Each writer has a temporary of its own, and the last rename wins */
+    snprintf(suffix, sizeof suffix, ".%016" PRIx64 ".tmp", seq++);
+    tmp += suffix;
+    file.open(tmp, std::ios::out | std::ios::binary | std::ios::trunc);
+    file << entry_magic << ' ' << now_seconds() << ' ' << key.size() << ' ' << reply.size() << '\n';
+    file << key << reply;
+    file.close();
+    if (file) {
+        std::filesystem::rename(tmp, path, err);
+    }
+    if (!file || err) {
+        log::printf(tomo::log::WARN, "Cannot cache MRN lookup in %s", path.string().c_str());
+        std::filesystem::remove(tmp, err);
+    }
+}
+
+
+std::string tomo::mrncache::lookup(const std::string &name)
+{
+    const std::string key = entry_key(name);
+    std::optional<std::string> cached;
+    std::string reply;
+
+    if (!bypassed() && (cached = load(key))) {
+        log::puts(tomo::log::DEBUG, "Using cached MRN lookup");
+        return *cached;
+    }
+
+    /* A server that closed without a word has not said there is no MRN */
+    reply = m_client.lookup(name);
+    if (reply.empty()) {
+        throw std::runtime_error("MRN server sent an empty reply");
+    }
+    if (!bypassed() && (!is_negative(reply) || m_negttl.count() > 0)) {
+        save(key, reply);
+    }
+    return reply;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#ifndef MRNCACHE_H
+#define MRNCACHE_H
+
+#include <chrono>
+#include <filesystem>
+#include <optional>
+#include <string>
+
+
+namespace tomo {
+
+
+class mrnclient;
+
+
+/** The MRN server's replies, kept on disk so that converting a patient again,
+ *  or another archive of the same patient, does not ask again. A single MRN is
+ *  kept until it is @p ttl old. "NOT FOUND" and several MRNs are only kept for
+ *  the shorter @p negative_ttl, since a newly registered patient or a resolved
+ *  clash should show up soon
+ *
+ *  Entries are keyed by the server as well as the name, so that test and
+ *  production servers never answer for each other. Each is a file of its own
+ *  under cache_dir()/mrn, replaced whole by renaming, so converters running
+ *  at once at worst both ask the server and write the same reply. The files hold patient names and MRNs in plain text,
+ *  and are only readable by their owner where the platform allows
+ */
+class mrncache {
+    tomo::mrnclient &m_client;
+    std::filesystem::path m_dir;    /* Empty when bypassed */
+    std::chrono::seconds m_ttl;
+    std::chrono::seconds m_negttl;  /* For replies that name no one MRN */
+    std::string m_server;           /* Goes in front of every name */
+
+
+    /** What @p name is cached under */
+    std::string entry_key(const std::string &name) const;
+    std::filesystem::path entry_path(const std::string &key) const;
+
+    /** The reply cached under @p key, if there is one and it is fresh */
+    std::optional<std::string> load(const std::string &key) const;
+    void save(const std::string &key, const std::string &reply) const;
+
+public:
+    /** @brief Caches the replies of @p client for @p ttl, or for
+     *      @p negative_ttl if they are "NOT FOUND" or several MRNs. Zero
+     *      caches none of those. It goes straight to the server if @p bypass,
+     *      or if there is no cache directory
+     */
+    mrncache(tomo::mrnclient &client, std::chrono::seconds ttl,
+             std::chrono::seconds negative_ttl, bool bypass = false);
+
+    mrncache(const mrncache &) = delete;
+    mrncache &operator=(const mrncache &) = delete;
+
+
+    /** @brief The reply to @p name, from the cache or else from the server,
+     *      as tomo::mrnclient::lookup returns it
+     *  @throws std::runtime_error if it has to ask and the server cannot be
+     *      reached, or sends nothing. Failures are never cached
+     */
+    std::string lookup(const std::string &name);
+
+    bool bypassed() const noexcept { return m_dir.empty(); }
+    std::chrono::seconds ttl() const noexcept { return m_ttl; }
+    std::chrono::seconds negative_ttl() const noexcept { return m_negttl; }
+};
+
+
+};
+
+
+#endif /* MRNCACHE_H */
@@ -1,10 +1,14 @@
 #include <cstring>
+#include <exception>
+#include <future>
+#include <mutex>
 #include "patient.h"
-#include "lookup.h"
+#include "schema.h"
 #include "auxiliary.h"
 #include "error.h"
 #include "log.h"
-#include "lookup/lookup.h"
+#include "mrncache.h"
+#include "snapshot.h"
 
 using namespace std::literals;
 
@@ -17,20 +21,23 @@ tomo::patient::patient()
 
 void tomo::patient::construct(pugi::xml_node root)
 {
-    tomo::xtable xtable;
-
-    xtable.insert("dbInfo", dbinfo());
-    xtable.insert("patientName", name());
-    xtable.insert("patientID", mrn());
-    xtable.insert("patientBirthDate", bday());
-    xtable.insert("patientGender", gender());
+    static constexpr tomo::schema keys{
+        tomo::xkey<&patient::m_dbinfo>("dbInfo"),
+        tomo::xkey<&patient::m_name>("patientName"),
+        tomo::xkey<&patient::m_mrn>("patientID"),
+        tomo::xkey<&patient::m_bday>("patientBirthDate"),
+        tomo::xkey<&patient::m_gender>("patientGender")
+    };
     
     root = xchild(root, "briefPatient");
 
-    xtable.search(root);
-    if (xtable.size()) {
-        throw missing_keys(root, xtable);
-    }
+    keys.require(root, keys.search(*this, root));
+}
+
+
+void tomo::patient::serialize(tomo::snapshot &snap)
+{
+    snap(m_dbinfo, m_name, m_mrn, m_bday, m_gender);
 }
 
 
@@ -64,17 +71,68 @@ static std::vector<std::string> parse_reply(const char *reply)
 }
 
 
-void tomo::patient::update_mrn(const char *host, uint16_t port)
+/** A lookup in flight, which the first caller of mrn() settles for all */
+struct tomo::patient::mrn_lookup {
+    std::future<std::string> reply;
+    bool lenient;
+
+    std::once_flag settled;
+    std::string mrn;
+    std::exception_ptr error;
+};
+
+
+static std::string mrn_from_reply(const std::string &reply)
 {
     std::vector<std::string> mrns;
-    char buf[256];
 
-    snprintf(buf, sizeof buf, "%s", name().c_str());
-    lookup_name(host, port, buf, sizeof buf);
-    mrns = parse_reply(buf);
+    if (reply == "NOT FOUND") {
+        throw std::runtime_error("Patient name not found in MRN database");
+    }
+    mrns = parse_reply(reply.c_str());
     if (mrns.size() > 1) {
         throw std::runtime_error("Cannot map MRN: Patient name is not unique");
     }
-    mrn().assign(mrns.front());
-    log::printf(tomo::log::DEBUG, "Updated patient MRN to %s", mrn().c_str());
+    return mrns.front();
+}
+
+
+void tomo::patient::update_mrn(tomo::mrncache &cache, bool lenient)
+{
+    auto lookup = std::make_shared<mrn_lookup>();
+
+    /* Not on the scheduler, whose workers would sit out a slow server */
+    lookup->lenient = lenient;
+    lookup->reply = std::async(std::launch::async, [&cache, name = name()]() {
+        return cache.lookup(name);
+    });
+    m_lookup = std::move(lookup);
+}
+
+
+const std::string &tomo::patient::mrn() const
+{
+    mrn_lookup *lookup = m_lookup.get();
+
+    if (!lookup) {
+        return m_mrn;
+    }
+    std::call_once(lookup->settled, [this, lookup]() {
+        try {
+            lookup->mrn = mrn_from_reply(lookup->reply.get());
+            log::printf(tomo::log::DEBUG, "Updated patient MRN to %s", lookup->mrn.c_str());
+        } catch (std::runtime_error &e) {
+            if (!lookup->lenient) {
+                lookup->error = std::current_exception();
+                return;
+            }
+            /* Issue a warning that the MRN could not be looked up */
+            log::printf(tomo::log::WARN, e.what());
+            lookup->mrn = m_mrn;
+        }
+    });
+    if (lookup->error) {
+        std::rethrow_exception(lookup->error);
+    }
+    return lookup->mrn;
 }
@@ -3,6 +3,7 @@
 #ifndef PATIENT_H
 #define PATIENT_H
 
+#include <memory>
 #include <string>
 #include <pugixml.hpp>
 #include "dbinfo.h"
@@ -11,7 +12,12 @@
 namespace tomo {
 
 
+class mrncache;
+
+
 class patient: public constructible {
+    struct mrn_lookup;
+
     tomo::dbinfo m_dbinfo;
 
     std::string m_name;
@@ -19,10 +25,11 @@ class patient: public constructible {
     std::string m_bday;
     std::string m_gender;
 
+    std::shared_ptr<mrn_lookup> m_lookup;   /* Since update_mrn, if ever */
+
 
     tomo::dbinfo &dbinfo() noexcept { return m_dbinfo; }
     std::string &name() noexcept { return m_name; }
-    std::string &mrn() noexcept { return m_mrn; }
     std::string &bday() noexcept { return m_bday; }
     std::string &gender() noexcept { return m_gender; }
 
@@ -31,20 +38,31 @@ public:
 
     /** Constructed from the node "patient" */
     virtual void construct(pugi::xml_node root) override;
+    virtual void serialize(tomo::snapshot &snap) override;
 
     const tomo::dbinfo &dbinfo() const noexcept { return m_dbinfo; }
     const std::string &name() const noexcept { return m_name; }
-    const std::string &mrn() const noexcept { return m_mrn; }
     const std::string &bday() const noexcept { return m_bday; }
     const std::string &gender() const noexcept { return m_gender; }
 
+    /** @brief The MRN, which the lookup that update_mrn started replaces.
+     *      The first call waits for it to finish
+     *  @throws std::runtime_error if the lookup failed, and was not lenient
+     */
+    const std::string &mrn() const;
+
     /** Returns the PatientSex DICOM code string appropriate for this patient */
     const char *dcmgender() const noexcept;
 
-    /** Use the lookup library to find an updated MRN if possible. Throws a
-     *  std::runtime_error if it fails
+    /** @brief Starts finding an updated MRN with the lookup library, or the
+     *      replies it cached, on a thread of its own. mrn() waits for it
+     *  @param cache
+     *      Must outlive the patient
+     *  @param lenient
+     *      If the lookup fails, mrn() warns and returns the MRN in the archive
+     *      instead of throwing
      */
-    void update_mrn(const char *host, uint16_t port);
+    void update_mrn(tomo::mrncache &cache, bool lenient = false);
 };
 
 
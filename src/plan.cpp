@@ -1,7 +1,8 @@
 #include "plan.h"
-#include "lookup.h"
+#include "schema.h"
 #include "error.h"
 #include "log.h"
+#include "snapshot.h"
 
 using namespace std::literals;
 
@@ -14,13 +15,17 @@ tomo::plan::trial::trial()
 
 void tomo::plan::trial::construct(pugi::xml_node root)
 {
-    tomo::xtable xtable;
+    static constexpr tomo::schema keys{
+        tomo::xkey<&trial::m_doses>("doseVolumeList")
+    };
 
-    xtable.insert("doseVolumeList", xref(m_doses, "doseVolumeList"));
-    xtable.search(root);
-    if (xtable.size()) {
-        throw missing_keys(root, xtable);
-    }
+    keys.require(root, keys.search(*this, root));
+}
+
+
+void tomo::plan::trial::serialize(tomo::snapshot &snap)
+{
+    snap(m_doses);
 }
 
 
@@ -32,17 +37,21 @@ tomo::plan::delivery::delivery()
 
 void tomo::plan::delivery::construct(pugi::xml_node root)
 {
-    tomo::xtable xtable;
+    static constexpr tomo::schema keys{
+        tomo::xkey<&delivery::m_dbinfo>("dbInfo"),
+        tomo::xkey<&delivery::m_machuid>("machineUID"),
+        tomo::xkey<&delivery::m_machname>("machineName"),
+        tomo::xkey<&delivery::m_approved>("isPlanApproved")
+    };
 
     root = xchild(root, "deliveryReview");
-    xtable.insert("dbInfo", dbinfo());
-    xtable.insert("machineUID", machine_uid());
-    xtable.insert("machineName", machine_name());
-    xtable.insert("isPlanApproved", approved());
-    xtable.search(root);
-    if (xtable.size()) {
-        throw missing_keys(root, xtable);
-    }
+    keys.require(root, keys.search(*this, root));
+}
+
+
+void tomo::plan::delivery::serialize(tomo::snapshot &snap)
+{
+    snap(m_dbinfo, m_machuid, m_machname, m_approved);
 }
 
 
@@ -75,46 +84,40 @@ tomo::plan::plan()
 
 void tomo::plan::construct_brief(pugi::xml_node brief)
 {
-    tomo::xtable xtable;
+    static constexpr tomo::schema keys{
+        tomo::xkey<&plan::m_dbinfo>("dbInfo"),
+        tomo::xkey<&plan::m_label>("planLabel")
+    };
 
-    xtable.insert("dbInfo", dbinfo());
-    xtable.insert("planLabel", label());
-    xtable.search(brief);
-    if (xtable.size()) {
-        throw missing_keys(brief, xtable);
-    }
+    keys.require(brief, keys.search(*this, brief));
 }
 
 
 void tomo::plan::construct_plan(pugi::xml_node plan)
 {
-    tomo::xtable xtable;
+    static constexpr tomo::schema keys{
+        tomo::xkey<&plan::m_beamletivdt>("beamletIVDT"),
+        tomo::xkey<&plan::m_fulldoseivdt>("fullDoseIVDT")
+    };
     pugi::xml_node brief;
 
     brief = xchild(plan, "briefPlan");
-    xtable.insert("beamletIVDT", beamlet_ivdt());
-    xtable.insert("fullDoseIVDT", fulldose_ivdt());
-    xtable.search(plan);
-    if (xtable.size()) {
-        throw missing_keys(plan, xtable);
-    }
+    keys.require(plan, keys.search(*this, plan));
     construct_brief(brief);
 }
 
 
 void tomo::plan::construct(pugi::xml_node root)
 {
-    tomo::xtable xtable;
+    static constexpr tomo::schema keys{
+        tomo::xkey<&plan::m_structs>("plannedStructureSet"),
+        tomo::xkey<&plan::m_images>("fullImageDataArray"),
+        tomo::xkey<&plan::m_dlvryreview>("fullDeliveryReviewDataArray"),
+        tomo::xkey<&plan::m_trials>("fullPlanTrialArray")
+    };
 
     construct_plan(xchild(root, "plan"));
-    xtable.insert("plannedStructureSet", m_structs);
-    xtable.insert("fullImageDataArray", xref(m_images, "fullImageDataArray"));
-    xtable.insert("fullDeliveryReviewDataArray", xref(m_dlvryreview, "fullDeliveryReviewDataArray"));
-    xtable.insert("fullPlanTrialArray", xref(m_trials, "fullPlanTrialArray"));
-    xtable.search(root);
-    if (xtable.size()) {
-        throw missing_keys(root, xtable);
-    }
+    keys.require(root, keys.search(*this, root));
     /* These branches are not possible, since the xvector callback throws an
     exception if its result is empty */
     /* if (!m_images.size()) {
@@ -125,3 +128,10 @@ void tomo::plan::construct(pugi::xml_node root)
     } */
     find_rp_uid();
 }
+
+
+void tomo::plan::serialize(tomo::snapshot &snap)
+{
+    snap(m_dbinfo, m_label, m_beamletivdt, m_fulldoseivdt, m_rtplan_uid);
+    snap(m_structs, m_images, m_trials, m_dlvryreview);
+}
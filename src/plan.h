@@ -6,6 +6,7 @@
 #include <vector>
 #include <pugixml.hpp>
 #include "constructible.h"
+#include "lazy.h"
 #include "structures.h"
 #include "image.h"
 #include "dbinfo.h"
@@ -24,6 +25,7 @@ public:
 
         /** Constructed from root node "fullPlanTrialArray" (lower) */
         virtual void construct(pugi::xml_node root) override;
+        virtual void serialize(tomo::snapshot &snap) override;
 
         size_t ndoses() const noexcept { return m_doses.size(); }
         const tomo::image &dose(size_t i) const noexcept { return m_doses[i]; }
@@ -50,6 +52,7 @@ public:
 
         /** From the root node "fullDeliveryReviewDataArray" (lower) */
         virtual void construct(pugi::xml_node root) override;
+        virtual void serialize(tomo::snapshot &snap) override;
 
 
         const tomo::dbinfo &dbinfo() const noexcept { return m_dbinfo; }
@@ -72,8 +75,8 @@ private:
 
     tomo::structset m_structs;  /* plannedStructureSet */
 
-    std::vector<tomo::img_data> m_images;   /* fullImageDataArray */
-    std::vector<trial> m_trials;            /* fullPlanTrialArray */
+    tomo::lazy<std::vector<tomo::img_data>> m_images;   /* fullImageDataArray */
+    tomo::lazy<std::vector<trial>> m_trials;            /* fullPlanTrialArray */
     std::vector<delivery> m_dlvryreview;    /* fullDeliveryReviewDataArray */
 
 
@@ -97,6 +100,7 @@ public:
 
     /* Constructed from the root node "fullPlanDataArray" (lower) */
     virtual void construct(pugi::xml_node root) override;
+    virtual void serialize(tomo::snapshot &snap) override;
 
 
     const tomo::dbinfo &dbinfo() const noexcept { return m_dbinfo; }
@@ -106,11 +110,12 @@ public:
     const std::string &fulldose_ivdt() const noexcept { return m_fulldoseivdt; }
     const std::string &rtplan_uid() const noexcept { return m_rtplan_uid; }
 
-    size_t nimages() const noexcept { return m_images.size(); }
-    const tomo::image &image(size_t i) const noexcept { return m_images[i].img; }
+    /* The images and trials are read on first use */
+    size_t nimages() const { return m_images->size(); }
+    const tomo::image &image(size_t i) const { return (*m_images)[i].img; }
 
-    size_t ntrials() const noexcept { return m_trials.size(); }
-    const trial &trial(size_t i) const noexcept { return m_trials[i]; }
+    size_t ntrials() const { return m_trials->size(); }
+    const trial &trial(size_t i) const { return (*m_trials)[i]; }
 
     const tomo::structset &structure_set() const noexcept { return m_structs; }
 };
@@ -0,0 +1,331 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "scheduler.h"
+
+
+namespace {
+
+
+struct worker {
+    std::mutex mtx;
+    std::deque<tomo::scheduler::item> queue;
+};
+
+
+/** Everything the pool owns. Without a call to scheduler::start there is one
+ *  queue and nobody to drain it except the waiting thread */
+struct pool {
+    std::vector<std::unique_ptr<worker>> queues;
+    std::vector<std::thread> threads;
+
+    std::mutex idle_mtx;
+    std::condition_variable idle_cv;
+    std::atomic<size_t> queued;
+    std::atomic<unsigned> next;
+    bool stopping;
+
+    unsigned njobs;
+
+    pool();
+    ~pool();
+
+    void resize(size_t n);
+    void join();
+};
+
+
+}
+
+
+static pool &the_pool()
+{
+    static pool p;
+
+    return p;
+}
+
+
+/* Index of the queue owned by this thread, or -1 off the pool */
+static thread_local int self = -1;
+
+
+pool::pool():
+    queued(0),
+    next(0),
+    stopping(false),
+    njobs(1)
+{
+    resize(1);
+}
+
+
+pool::~pool()
+{
+    join();
+}
+
+
+void pool::resize(size_t n)
+{
+    queues.clear();
+    while (n--) {
+        queues.emplace_back(new worker);
+    }
+}
+
+
+void pool::join()
+{
+    {
+        std::lock_guard<std::mutex> lock(idle_mtx);
+        stopping = true;
+    }
+    idle_cv.notify_all();
+    for (auto &thr: threads) {
+        thr.join();
+    }
+    threads.clear();
+    stopping = false;
+}
+
+
+/** Pops from the back of our own queue, or steals from the front of another */
+static bool take_any(pool &p, tomo::scheduler::item &it)
+{
+    const size_t n = p.queues.size();
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        worker &w = *p.queues[(self + i) % n];
+        std::lock_guard<std::mutex> lock(w.mtx);
+
+        if (w.queue.size()) {
+            if (i == 0) {
+                it = w.queue.back();
+                w.queue.pop_back();
+            } else {
+                it = w.queue.front();
+                w.queue.pop_front();
+            }
+            p.queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+void tomo::scheduler::work(int idx)
+{
+    pool &p = the_pool();
+    tomo::scheduler::item it;
+
+    self = idx;
+    for (;;) {
+        if (take_any(p, it)) {
+            it.group->execute(*static_cast<tomo::taskgroup::slot *>(it.slot));
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(p.idle_mtx);
+        p.idle_cv.wait(lock, [&p]() { return p.stopping || p.queued; });
+        if (p.stopping && !p.queued) {
+            break;
+        }
+    }
+}
+
+
+void tomo::scheduler::push(const item &it)
+{
+    pool &p = the_pool();
+    size_t idx;
+
+    idx = (self >= 0) ? self : p.next++ % p.queues.size();
+    {
+        std::lock_guard<std::mutex> lock(p.queues[idx]->mtx);
+        p.queues[idx]->queue.push_back(it);
+        p.queued++;
+    }
+    {
+        /* Keeps a worker from missing this between its check and its wait */
+        std::lock_guard<std::mutex> lock(p.idle_mtx);
+    }
+    p.idle_cv.notify_one();
+}
+
+
+bool tomo::scheduler::take(const taskgroup *group, item &it)
+{
+    pool &p = the_pool();
+
+    for (auto &w: p.queues) {
+        std::lock_guard<std::mutex> lock(w->mtx);
+        auto pos = std::find_if(w->queue.begin(), w->queue.end(),
+            [group](const item &x) {
+                return x.group == group;
+            });
+
+        if (pos != w->queue.end()) {
+            it = *pos;
+            w->queue.erase(pos);
+            p.queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+void tomo::scheduler::start(unsigned njobs)
+{
+    pool &p = the_pool();
+    unsigned i;
+
+    if (!njobs) {
+        njobs = std::max(std::thread::hardware_concurrency(), 1U);
+    }
+    p.join();
+    p.njobs = njobs;
+    /* The waiting thread makes up the last job */
+    p.resize(std::max(njobs - 1, 1U));
+    for (i = 0; i + 1 < njobs; i++) {
+        p.threads.emplace_back(work, (int)i);
+    }
+}
+
+
+void tomo::scheduler::stop()
+{
+    pool &p = the_pool();
+
+    p.join();
+    p.njobs = 1;
+    p.resize(1);
+}
+
+
+unsigned tomo::scheduler::jobs() noexcept
+{
+    return the_pool().njobs;
+}
+
+
+tomo::taskgroup::taskgroup():
+    m_replayed(0),
+    m_pending(0),
+    m_failed(SIZE_MAX)
+{
+
+}
+
+
+tomo::taskgroup::~taskgroup()
+{
+    try {
+        wait();
+    } catch (...) {
+        /* Nobody asked */
+    }
+}
+
+
+void tomo::taskgroup::execute(slot &s)
+{
+    bool skip;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        skip = s.index > m_failed;
+    }
+    if (!skip) {
+        s.log.attach();
+        try {
+            s.task();
+        } catch (...) {
+            s.error = std::current_exception();
+        }
+        s.log.detach();
+    }
+    s.task = nullptr;
+    /* Notify under the lock, the waiter may destroy us as soon as it sees
+    m_pending hit zero */
+    std::lock_guard<std::mutex> lock(m_mtx);
+    if (s.error) {
+        m_failed = std::min(m_failed, s.index);
+    }
+    s.done = true;
+    m_pending--;
+    m_cv.notify_all();
+}
+
+
+void tomo::taskgroup::replay()
+{
+    slot *s;
+
+    for (;;) {
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+
+            if (m_replayed == m_slots.size() || !m_slots[m_replayed].done) {
+                return;
+            }
+            if (m_replayed > m_failed) {
+                /* Whatever ran past a failure would have been skipped had it
+                run serially, so it stays quiet */
+                return;
+            }
+            s = &m_slots[m_replayed++];
+        }
+        s->log.replay();
+    }
+}
+
+
+void tomo::taskgroup::run(std::function<void()> task)
+{
+    slot *s;
+
+    m_slots.push_back({ std::move(task), { }, nullptr, m_slots.size(), false });
+    s = &m_slots.back();
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_pending++;
+    }
+    scheduler::push({ this, s });
+}
+
+
+void tomo::taskgroup::wait()
+{
+    std::exception_ptr error;
+    scheduler::item it;
+
+    for (;;) {
+        replay();
+        if (scheduler::take(this, it)) {
+            execute(*static_cast<slot *>(it.slot));
+            continue;
+        }
+        /* Everything left is running on another thread */
+        std::unique_lock<std::mutex> lock(m_mtx);
+        if (!m_pending) {
+            break;
+        }
+        m_cv.wait(lock);
+    }
+    replay();
+    if (m_failed != SIZE_MAX) {
+        error = m_slots[m_failed].error;
+    }
+    m_slots.clear();
+    m_replayed = 0;
+    m_failed = SIZE_MAX;
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include "log.h"
+
+
+namespace tomo {
+
+
+class taskgroup;
+
+
+/** The process-wide worker pool. Each worker owns a deque of tasks; it pops
+ *  from the back of its own and steals from the front of everybody else's when
+ *  it runs dry. The thread that waits on a task group helps out by running that
+ *  group's queued tasks, so with a single job no threads are spawned at all and
+ *  everything runs serially, in submission order, on the waiting thread
+ */
+class scheduler {
+    friend class taskgroup;
+
+public:
+    struct item {
+        taskgroup *group;
+        void *slot;
+    };
+
+private:
+    static void work(int idx);
+
+    static void push(const item &it);
+
+    /** Dequeue any task belonging to @p group */
+    static bool take(const taskgroup *group, item &it);
+
+public:
+    /** @brief Spawn the worker threads
+     *  @param njobs
+     *      Number of tasks that may execute at once, counting the waiting
+     *      thread. Zero picks the hardware concurrency
+     */
+    static void start(unsigned njobs);
+
+    /** Joins the workers. Outstanding task groups must already be waited on */
+    static void stop();
+
+    static unsigned jobs() noexcept;
+};
+
+
+/** A batch of tasks that is waited on as a unit. Only the thread that owns the
+ *  group may add to it. Log messages from each task are held back and issued
+ *  in submission order, so the output does not depend on the job count. The
+ *  first failure (again in submission order) is rethrown by wait(), and tasks
+ *  submitted after it are skipped if they have not started yet
+ */
+class taskgroup {
+    friend class scheduler;
+
+    struct slot {
+        std::function<void()> task;
+        tomo::logbuffer log;
+        std::exception_ptr error;
+        size_t index;
+        bool done;
+    };
+
+    std::deque<slot> m_slots;   /* Never shrinks while tasks are in flight, so
+                                the scheduler may hold on to slot pointers */
+    size_t m_replayed;          /* Slots whose logs have been forwarded */
+    size_t m_pending;
+    size_t m_failed;            /* Index of the earliest failure, if any */
+
+    std::mutex m_mtx;
+    std::condition_variable m_cv;
+
+
+    void execute(slot &s);
+
+    /** Forward the logs of each contiguously finished slot. Call with m_mtx
+     *  unlocked */
+    void replay();
+
+public:
+    taskgroup();
+    ~taskgroup();
+
+    taskgroup(const taskgroup &) = delete;
+    taskgroup &operator=(const taskgroup &) = delete;
+
+
+    /** @brief Queue @p task for execution on the pool */
+    void run(std::function<void()> task);
+
+
+    /** @brief Block until every queued task has finished, running some of them
+     *      on the calling thread. The group is empty and reusable afterwards
+     *  @throws whatever the earliest failing task threw
+     */
+    void wait();
+};
+
+
+};
+
+
+#endif /* SCHEDULER_H */
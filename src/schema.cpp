@@ -0,0 +1,37 @@
+#include "schema.h"
+
+
+void tomo::xread(int &x, pugi::xml_node node)
+{
+    x = node.text().as_int();
+}
+
+
+void tomo::xread(bool &b, pugi::xml_node node)
+{
+    b = node.text().as_bool();
+}
+
+
+void tomo::xread(float &flt, pugi::xml_node node)
+{
+    flt = node.text().as_float();
+}
+
+
+void tomo::xread(double &dub, pugi::xml_node node)
+{
+    dub = node.text().as_double();
+}
+
+
+void tomo::xread(std::string &str, pugi::xml_node node)
+{
+    str = node.text().as_string();
+}
+
+
+void tomo::xread(constructible &cons, pugi::xml_node node)
+{
+    cons.construct(node);
+}
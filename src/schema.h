@@ -0,0 +1,205 @@
+#pragma once
+
+#ifndef SCHEMA_H
+#define SCHEMA_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <pugixml.hpp>
+#include "constructible.h"
+#include "error.h"
+#include "log.h"
+
+/** The operation that has evolved appears to be:
+ *   :: Declare the keys of interest, each bound to the member it is read into,
+ *      as a static constexpr schema
+ *   :: Search (using the method), which returns a mask of the keys not found
+ *   :: Excuse optional keys from the mask
+ *   :: Require whatever is left
+ *
+ *  The keys are sorted at compile time and found by binary search, and each
+ *  member is read through a function instantiated for exactly its type, so
+ *  reading a subtree allocates nothing and casts nothing
+ */
+
+
+namespace tomo {
+
+
+void xread(int &x, pugi::xml_node node);
+void xread(bool &b, pugi::xml_node node);
+void xread(float &flt, pugi::xml_node node);
+void xread(double &dub, pugi::xml_node node);
+void xread(std::string &str, pugi::xml_node node);
+void xread(constructible &cons, pugi::xml_node node);
+
+
+/** Array lists hold one child for each element, named after the list itself */
+template <class ConstructT>
+void xread(std::vector<ConstructT> &vec, pugi::xml_node node)
+{
+    std::stringstream ss;
+
+    vec.clear();
+    for (pugi::xml_node child: node.children(node.name())) {
+        vec.push_back({ });
+        vec.back().construct(child);
+    }
+    /* Oops I forgot about this behavior. It has never happened */
+    if (!vec.size()) {
+        ss << "Array list " << node.name() << " is empty";
+        throw std::runtime_error(ss.str());
+    }
+}
+
+
+/** A key, and the reader of the member it goes into */
+template <class ModelT>
+struct xfield {
+    std::string_view key;
+    void (*read)(ModelT &obj, pugi::xml_node node);
+};
+
+
+template <class MemberT>
+struct xmember;
+
+template <class ModelT, class ValueT>
+struct xmember<ValueT ModelT::*> {
+    using model_t = ModelT;
+};
+
+
+/** @brief Binds the child element @p key to the data member @p Member */
+template <auto Member>
+constexpr xfield<typename xmember<decltype(Member)>::model_t> xkey(std::string_view key) noexcept
+{
+    using model_t = typename xmember<decltype(Member)>::model_t;
+
+    return { key, [](model_t &obj, pugi::xml_node node) { xread(obj.*Member, node); } };
+}
+
+
+template <class ModelT, size_t N>
+class schema {
+public:
+    using mask_t = uint64_t;
+
+    static_assert(N && N <= 64, "A schema holds between 1 and 64 keys");
+
+    /** Every key in the schema */
+    static constexpr mask_t all = (N == 64) ? ~(mask_t)0 : ((mask_t)1 << N) - 1;
+
+private:
+    std::array<xfield<ModelT>, N> m_fields;
+
+
+    /** Index of @p key, or N if it is not in the schema */
+    constexpr size_t find(std::string_view key) const noexcept
+    {
+        auto it = std::lower_bound(m_fields.begin(), m_fields.end(), key,
+            [](const xfield<ModelT> &f, std::string_view k) { return f.key < k; });
+
+        return (it != m_fields.end() && it->key == key) ? it - m_fields.begin() : N;
+    }
+
+    std::vector<pugi::string_t> keys(mask_t mask) const
+    {
+        std::vector<pugi::string_t> res;
+        size_t i;
+
+        for (i = 0; i < N; i++) {
+            if (mask & (mask_t)1 << i) {
+                res.emplace_back(m_fields[i].key);
+            }
+        }
+        return res;
+    }
+
+public:
+    template <class... FieldT>
+    consteval schema(FieldT... fields):
+        m_fields{ fields... }
+    {
+        size_t i;
+
+        std::sort(m_fields.begin(), m_fields.end(),
+            [](const xfield<ModelT> &a, const xfield<ModelT> &b) { return a.key < b.key; });
+        for (i = 1; i < N; i++) {
+            if (m_fields[i - 1].key == m_fields[i].key) {
+                throw std::logic_error("Repeated schema key");
+            }
+        }
+    }
+
+
+    /** @brief The mask bit of @p key, which must be in the schema */
+    consteval mask_t bit(std::string_view key) const
+    {
+        if (find(key) == N) {
+            throw std::logic_error("Key is not in the schema");
+        }
+        return (mask_t)1 << find(key);
+    }
+
+
+    /** @brief Reads the first child of @p root with each key into @p obj
+     *  @returns The mask of keys that were not found
+     */
+    mask_t search(ModelT &obj, pugi::xml_node root) const
+    {
+        pugi::xml_node node;
+        mask_t missing = all;
+        size_t i;
+
+        for (node = root.first_child(); node && missing; node = node.next_sibling()) {
+            i = find(node.name());
+            if (i < N && (missing & (mask_t)1 << i)) {
+                m_fields[i].read(obj, node);
+                missing &= ~((mask_t)1 << i);
+            }
+        }
+        return missing;
+    }
+
+
+    /** @brief Drops the keys in @p optional from @p missing, issuing a warning
+     *      to log files if any of them were in fact missing
+     *  @returns What is left of @p missing
+     */
+    mask_t excuse(pugi::xml_node root, mask_t missing, mask_t optional) const
+    {
+        if (missing & optional) {
+            log::printf(tomo::log::WARN, "Tree %s is missing keys:", root.name());
+            for (const auto &key: keys(missing & optional)) {
+                log::printf(tomo::log::WARN, "   - %s", key.c_str());
+            }
+        }
+        return missing & ~optional;
+    }
+
+
+    /** @throws tomo::missing_keys naming every key in @p missing, if any */
+    void require(pugi::xml_node root, mask_t missing) const
+    {
+        if (missing) {
+            throw missing_keys(root, keys(missing));
+        }
+    }
+};
+
+
+template <class ModelT, class... FieldT>
+schema(xfield<ModelT>, FieldT...) -> schema<ModelT, 1 + sizeof...(FieldT)>;
+
+
+};
+
+
+#endif /* SCHEMA_H */
@@ -0,0 +1,663 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include "sink.h"
+#include "log.h"
+
+#if defined(_WIN32)
+#   include <Windows.h>
+
+#else
+#   include <fcntl.h>
+#   include <limits.h>
+#   include <sys/uio.h>
+#   include <unistd.h>
+
+#   if defined(TOMO_HAVE_URING)
+#       include <sys/eventfd.h>
+#       include <liburing.h>
+#   endif
+
+#endif
+
+
+static size_t g_budget = 256 << 20;
+static std::function<std::unique_ptr<tomo::sink>(size_t)> g_make;
+
+
+[[noreturn]] static void throw_write_error(const std::filesystem::path &path, const char *what)
+{
+    std::stringstream ss;
+
+    ss << "Cannot write " << path.string() << ": " << what;
+    throw std::runtime_error(ss.str());
+}
+
+
+tomo::outbuf tomo::outbuf::adopt(std::vector<char> &&bytes)
+{
+    auto owner = std::make_shared<std::vector<char>>(std::move(bytes));
+
+    return { owner, owner->data(), owner->size() };
+}
+
+
+tomo::sink::sink(size_t budget) noexcept:
+    m_budget(budget),
+    m_inflight(0)
+{
+
+}
+
+
+tomo::sink::~sink()
+{
+
+}
+
+
+void tomo::sink::configure(size_t budget) noexcept
+{
+    g_budget = budget;
+}
+
+
+size_t tomo::sink::budget() noexcept
+{
+    return g_budget;
+}
+
+
+void tomo::sink::configure(std::function<std::unique_ptr<sink>(size_t budget)> make)
+{
+    g_make = std::move(make);
+}
+
+
+void tomo::sink::write(const std::filesystem::path &path, std::vector<outbuf> bufs)
+{
+    write(path, std::move(bufs), nullptr, 0, 0);
+}
+
+
+void tomo::sink::write(const std::filesystem::path &path, std::vector<outbuf> bufs, source more,
+                       size_t more_len, size_t resident)
+{
+    std::unique_ptr<file> f(new file{ path, std::move(bufs), 0, std::move(more) });
+
+    f->size = holds_streams() ? more_len : std::min(resident, more_len);
+
+    for (const auto &buf: f->bufs) {
+        f->size += buf.len;
+    }
+    {
+        std::unique_lock<std::mutex> lock(m_mtx);
+
+        m_cv.wait(lock, [this, &f]() {
+            return m_error || !m_inflight || m_inflight + f->size <= m_budget;
+        });
+        if (m_error) {
+            std::rethrow_exception(m_error);
+        }
+        m_inflight += f->size;
+    }
+    start(std::move(f));
+}
+
+
+void tomo::sink::done(std::unique_ptr<file> f, std::exception_ptr error) noexcept
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+
+    m_inflight -= f->size;
+    if (error && !m_error) {
+        m_error = error;
+    }
+    /* The buffers go back to their owners here */
+    f.reset();
+    m_cv.notify_all();
+}
+
+
+void tomo::sink::drain() noexcept
+{
+    std::unique_lock<std::mutex> lock(m_mtx);
+
+    m_cv.wait(lock, [this]() { return !m_inflight; });
+}
+
+
+void tomo::sink::wait()
+{
+    std::unique_lock<std::mutex> lock(m_mtx);
+
+    m_cv.wait(lock, [this]() { return !m_inflight; });
+    if (m_error) {
+        std::rethrow_exception(m_error);
+    }
+}
+
+
+namespace {
+
+
+/** Blocking writes from a few threads of its own. These must not be scheduler
+ *  workers: a writer held back by the budget would be waiting on a write
+ *  queued behind it on the same thread
+ */
+class pool_sink: public tomo::sink {
+    std::deque<std::unique_ptr<file>> m_queue;
+    std::vector<std::thread> m_threads;
+    std::mutex m_qmtx;
+    std::condition_variable m_qcv;
+    bool m_stopping;
+
+    void work();
+
+    virtual void start(std::unique_ptr<file> f) override;
+
+public:
+    pool_sink(size_t budget, unsigned nthreads);
+    virtual ~pool_sink() override;
+};
+
+
+}
+
+
+#if defined(_WIN32)
+
+static void write_buf(HANDLE file, const std::filesystem::path &path, const tomo::outbuf &buf)
+{
+    const char *p = static_cast<const char *>(buf.data);
+    size_t left;
+    DWORD n;
+
+    for (left = buf.len; left; p += n, left -= n) {
+        if (!WriteFile(file, p, (DWORD)std::min<size_t>(left, 1u << 30), &n, NULL)) {
+            throw_write_error(path, "write failed");
+        }
+    }
+}
+
+
+static void write_file(const std::filesystem::path &path, const std::vector<tomo::outbuf> &bufs,
+                       const tomo::sink::source &more)
+{
+    tomo::outbuf buf;
+    HANDLE file;
+
+    file = CreateFileW(path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                       FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        throw_write_error(path, "cannot create file");
+    }
+    try {
+        for (const auto &b: bufs) {
+            write_buf(file, path, b);
+        }
+
+        /* Each buffer goes back to its owner as soon as it is written */
+        while (more && more(buf)) {
+            write_buf(file, path, buf);
+            buf = { };
+        }
+    } catch (...) {
+        CloseHandle(file);
+        throw;
+    }
+    if (!CloseHandle(file)) {
+        throw_write_error(path, "close failed");
+    }
+}
+
+#else
+
+/** Writes all of @p iov, which it uses up, to @p fd */
+static void write_iov(int fd, const std::filesystem::path &path, std::vector<struct iovec> &iov)
+{
+    struct iovec *v;
+    size_t nv;
+    ssize_t n;
+
+    /* Almost always a single call; the loop is for short writes */
+    for (v = iov.data(), nv = iov.size(); nv; ) {
+        n = writev(fd, v, (int)std::min<size_t>(nv, IOV_MAX));
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1) {
+            throw_write_error(path, strerror(errno));
+        }
+        for (; nv && (size_t)n >= v->iov_len; v++, nv--) {
+            n -= v->iov_len;
+        }
+        if (nv) {
+            v->iov_base = static_cast<char *>(v->iov_base) + n;
+            v->iov_len -= n;
+        }
+    }
+}
+
+
+static void write_file(const std::filesystem::path &path, const std::vector<tomo::outbuf> &bufs,
+                       const tomo::sink::source &more)
+{
+    std::vector<struct iovec> iov;
+    tomo::outbuf buf;
+    int fd;
+
+    for (const auto &b: bufs) {
+        iov.push_back({ const_cast<void *>(b.data), b.len });
+    }
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        throw_write_error(path, strerror(errno));
+    }
+    try {
+        write_iov(fd, path, iov);
+
+        /* Each buffer goes back to its owner as soon as it is written */
+        while (more && more(buf)) {
+            iov.assign(1, { const_cast<void *>(buf.data), buf.len });
+            write_iov(fd, path, iov);
+            buf = { };
+        }
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    if (::close(fd)) {
+        throw_write_error(path, strerror(errno));
+    }
+}
+
+#endif
+
+
+pool_sink::pool_sink(size_t budget, unsigned nthreads):
+    sink(budget),
+    m_stopping(false)
+{
+    while (nthreads--) {
+        m_threads.emplace_back(&pool_sink::work, this);
+    }
+}
+
+
+pool_sink::~pool_sink()
+{
+    drain();
+    {
+        std::lock_guard<std::mutex> lock(m_qmtx);
+
+        m_stopping = true;
+    }
+    m_qcv.notify_all();
+    for (auto &t: m_threads) {
+        t.join();
+    }
+}
+
+
+void pool_sink::start(std::unique_ptr<file> f)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_qmtx);
+
+        m_queue.push_back(std::move(f));
+    }
+    m_qcv.notify_one();
+}
+
+
+void pool_sink::work()
+{
+    std::unique_ptr<file> f;
+    std::exception_ptr error;
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(m_qmtx);
+
+            m_qcv.wait(lock, [this]() { return m_stopping || !m_queue.empty(); });
+            if (m_queue.empty()) {
+                return;
+            }
+            f = std::move(m_queue.front());
+            m_queue.pop_front();
+        }
+        error = nullptr;
+        try {
+            write_file(f->path, f->bufs, f->more);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        done(std::move(f), error);
+    }
+}
+
+
+#if defined(TOMO_HAVE_URING)
+
+namespace {
+
+
+/** Each file is one chain of three linked requests: open into a slot of the
+ *  ring's own file table, one vectored write, and close. A whole file costs a
+ *  single io_uring_enter, and nothing blocks but the kernel's own workers.
+ *  Completions are reaped on a thread of the sink's own, woken through an
+ *  eventfd, so that it never has to enter the ring itself
+ *
+ *  If the ring refuses a submission outright, it is not used again: the files
+ *  it did not take fail, and every sink opened after that is a pool_sink
+ */
+class uring_sink: public tomo::sink {
+    static constexpr unsigned nslots = 64;      /* Files in flight at once */
+    static constexpr unsigned depth = 4 * nslots;
+    static constexpr unsigned chain = 3;        /* Requests per file */
+
+    /** Which request of the chain a completion belongs to, kept in the low
+     *  bits of its user data */
+    enum stage: uintptr_t { OPEN, WRITE, CLOSE, STAGE_MASK = 3 };
+
+    struct op {
+        std::unique_ptr<file> f;
+        std::vector<struct iovec> iov;
+        std::string error;
+        unsigned slot;
+        unsigned pending;       /* Requests yet to complete */
+    };
+
+    struct io_uring m_ring;
+    int m_efd;
+    std::vector<unsigned> m_slots;
+    std::deque<op *> m_unsent;  /* Chains the kernel has not taken all of */
+    unsigned m_taken;           /* How much of the first of them it has */
+    bool m_broken;
+    bool m_stopping;
+    std::mutex m_sqmtx;
+    std::condition_variable m_slotcv;
+    std::thread m_reaper;
+
+    bool submit() noexcept;
+    void reap();
+    void complete(op *o, stage st, int res) noexcept;
+    void finish(op *o) noexcept;
+
+    virtual void start(std::unique_ptr<file> f) override;
+
+public:
+    explicit uring_sink(size_t budget);
+    virtual ~uring_sink() override;
+};
+
+
+}
+
+
+/** Set once any ring has failed */
+static std::atomic<bool> g_uring_failed(false);
+
+
+uring_sink::uring_sink(size_t budget):
+    sink(budget),
+    m_taken(0),
+    m_broken(false),
+    m_stopping(false)
+{
+    struct io_uring_probe *probe;
+    bool ok;
+    int err;
+
+    err = io_uring_queue_init(depth, &m_ring, 0);
+    if (err) {
+        throw std::runtime_error(strerror(-err));
+    }
+    probe = io_uring_get_probe_ring(&m_ring);
+    ok = probe
+      && io_uring_opcode_supported(probe, IORING_OP_OPENAT)
+      && io_uring_opcode_supported(probe, IORING_OP_WRITEV)
+      && io_uring_opcode_supported(probe, IORING_OP_CLOSE);
+    io_uring_free_probe(probe);
+    err = ok ? io_uring_register_files_sparse(&m_ring, nslots) : -EOPNOTSUPP;
+    m_efd = err ? -1 : eventfd(0, EFD_CLOEXEC);
+    if (!err && m_efd == -1) {
+        err = -errno;
+    }
+    if (!err) {
+        err = io_uring_register_eventfd(&m_ring, m_efd);
+    }
+    if (err) {
+        if (m_efd != -1) {
+            ::close(m_efd);
+        }
+        io_uring_queue_exit(&m_ring);
+        throw std::runtime_error(strerror(-err));
+    }
+    for (unsigned i = nslots; i--; ) {
+        m_slots.push_back(i);
+    }
+    m_reaper = std::thread(&uring_sink::reap, this);
+}
+
+
+uring_sink::~uring_sink()
+{
+    const uint64_t one = 1;
+
+    drain();
+    {
+        std::lock_guard<std::mutex> lock(m_sqmtx);
+
+        m_stopping = true;
+    }
+    while (::write(m_efd, &one, sizeof one) == -1 && errno == EINTR) {
+    }
+    m_reaper.join();
+    io_uring_queue_exit(&m_ring);
+    ::close(m_efd);
+}
+
+
+void uring_sink::start(std::unique_ptr<file> f)
+{
+    struct io_uring_sqe *sqe;
+    std::exception_ptr error;
+
+    /* A chain is submitted whole, so a streamed file is written right here,
+    as pool_sink would, and only holds up its own writer */
+    if (f->more) {
+        try {
+            write_file(f->path, f->bufs, f->more);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        done(std::move(f), error);
+        return;
+    }
+
+    op *o = new op{ std::move(f), { }, { }, 0, chain };
+    std::unique_lock<std::mutex> lock(m_sqmtx);
+
+    for (const auto &buf: o->f->bufs) {
+        o->iov.push_back({ const_cast<void *>(buf.data), buf.len });
+    }
+    m_slotcv.wait(lock, [this]() { return m_broken || !m_slots.empty(); });
+    if (m_broken) {
+        o->error = "io_uring failed earlier";
+        o->pending = 0;
+        o->slot = UINT_MAX;
+        finish(o);
+        return;
+    }
+    o->slot = m_slots.back();
+    m_slots.pop_back();
+
+    /* Everything queued so far was submitted, so there is room for a chain */
+    sqe = io_uring_get_sqe(&m_ring);
+    io_uring_prep_openat_direct(sqe, AT_FDCWD, o->f->path.c_str(),
+                                O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644, o->slot);
+    io_uring_sqe_set_data64(sqe, reinterpret_cast<uintptr_t>(o) | OPEN);
+    sqe->flags |= IOSQE_IO_LINK;
+
+    /* Hard link, so that the file is closed even if the write fails */
+    sqe = io_uring_get_sqe(&m_ring);
+    io_uring_prep_writev(sqe, o->slot, o->iov.data(), o->iov.size(), 0);
+    io_uring_sqe_set_data64(sqe, reinterpret_cast<uintptr_t>(o) | WRITE);
+    sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+
+    sqe = io_uring_get_sqe(&m_ring);
+    io_uring_prep_close_direct(sqe, o->slot);
+    io_uring_sqe_set_data64(sqe, reinterpret_cast<uintptr_t>(o) | CLOSE);
+
+    m_unsent.push_back(o);
+    submit();
+}
+
+
+/** Hands everything queued to the kernel. Called with the submission lock
+ *  held. On an error other than a transient one, the requests it did not take
+ *  never will be, so their files fail here
+ *  @returns Whether it all went
+ */
+bool uring_sink::submit() noexcept
+{
+    unsigned n;
+    op *o;
+    int res;
+
+    while (io_uring_sq_ready(&m_ring)) {
+        res = io_uring_submit(&m_ring);
+        if (res == -EINTR || res == -EAGAIN || res == -EBUSY) {
+            continue;
+        }
+        if (res < 0) {
+            tomo::log::printf(tomo::log::ERROR, "io_uring submission failed, not using it again: %s", strerror(-res));
+            m_broken = true;
+            g_uring_failed = true;
+            break;
+        }
+        for (n = m_taken + res; !m_unsent.empty() && n >= chain; n -= chain) {
+            m_unsent.pop_front();
+        }
+        m_taken = m_unsent.empty() ? 0 : n;
+    }
+    if (!m_broken) {
+        return true;
+    }
+
+    /* Of the first chain, what the kernel did take still completes */
+    for (; !m_unsent.empty(); m_taken = 0) {
+        o = m_unsent.front();
+        m_unsent.pop_front();
+        if (o->error.empty()) {
+            o->error = "io_uring submission failed";
+        }
+        o->pending -= chain - m_taken;
+        if (!o->pending) {
+            finish(o);
+        }
+    }
+    m_slotcv.notify_all();
+    return false;
+}
+
+
+/** Called with the submission lock held */
+void uring_sink::finish(op *o) noexcept
+{
+    std::exception_ptr error;
+
+    if (o->slot != UINT_MAX) {
+        m_slots.push_back(o->slot);
+        m_slotcv.notify_one();
+    }
+    if (!o->error.empty()) {
+        try {
+            throw_write_error(o->f->path, o->error.c_str());
+        } catch (...) {
+            error = std::current_exception();
+        }
+    }
+    done(std::move(o->f), error);
+    delete o;
+}
+
+
+void uring_sink::complete(op *o, stage st, int res) noexcept
+{
+    std::lock_guard<std::mutex> lock(m_sqmtx);
+
+    /* Everything after a failed open comes back cancelled; report the cause */
+    if (o->error.empty()) {
+        if (res < 0) {
+            o->error = strerror(-res);
+        } else if (st == WRITE && (size_t)res != o->f->size) {
+            o->error = "short write";
+        }
+    }
+    if (!--o->pending) {
+        finish(o);
+    }
+}
+
+
+void uring_sink::reap()
+{
+    struct io_uring_cqe *cqe;
+    uintptr_t data;
+    uint64_t n;
+    int res;
+
+    for (;;) {
+        while (!io_uring_peek_cqe(&m_ring, &cqe)) {
+            data = (uintptr_t)io_uring_cqe_get_data64(cqe);
+            res = cqe->res;
+            io_uring_cqe_seen(&m_ring, cqe);
+            complete(reinterpret_cast<op *>(data & ~(uintptr_t)STAGE_MASK),
+                     static_cast<stage>(data & STAGE_MASK), res);
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_sqmtx);
+
+            if (m_stopping) {
+                return;
+            }
+        }
+        /* The kernel counts every completion it posts here, and so does the
+        destructor when it is time to stop */
+        while (::read(m_efd, &n, sizeof n) == -1 && errno == EINTR) {
+        }
+    }
+}
+
+#endif
+
+
+std::unique_ptr<tomo::sink> tomo::sink::open()
+{
+    if (g_make) {
+        return g_make(budget());
+    }
+#if defined(TOMO_HAVE_URING)
+    static std::once_flag reported;
+
+    try {
+        if (!g_uring_failed) {
+            return std::make_unique<uring_sink>(budget());
+        }
+    } catch (const std::exception &e) {
+        std::call_once(reported, [&e]() {
+            log::printf(log::DEBUG, "io_uring is unavailable (%s), writing files from a thread pool", e.what());
+        });
+    }
+#endif
+    return std::make_unique<pool_sink>(budget(), 4);
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#ifndef SINK_H
+#define SINK_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+
+namespace tomo {
+
+
+/** One piece of an encoded file. The sink holds on to @p owner, which keeps
+ *  @p data alive, until the piece is written
+ */
+struct outbuf {
+    std::shared_ptr<const void> owner;
+    const void *data;
+    size_t len;
+
+    /** @brief Hands @p bytes over to the sink */
+    static outbuf adopt(std::vector<char> &&bytes);
+};
+
+
+/** Where the encoded DICOM files go. Writers hand over whole files and move
+ *  on while the sink creates, writes and closes them in the background. Once
+ *  budget() bytes are in flight, writers are held back until some of them land
+ *
+ *  A handful of threads do blocking writes. On Linux, built with TOMO_URING,
+ *  the files go through io_uring instead when the kernel allows it, with each
+ *  open, write and close submitted together. The files can also go somewhere
+ *  other than the disk altogether, see tomo::storesink
+ */
+class sink {
+public:
+    /** Produces the rest of a file, one buffer at a time, on the sink's side
+     *  once the buffers before it are out. Each call sets the next buffer and
+     *  returns true, or returns false at the end. Whatever it throws fails the
+     *  file */
+    using source = std::function<bool(outbuf &)>;
+
+protected:
+    struct file {
+        std::filesystem::path path;
+        std::vector<outbuf> bufs;
+        size_t size;            /* Charged against the budget. The whole
+                                file, but for a streamed one only what it
+                                keeps in memory at once */
+        source more;            /* Null for all but streamed files */
+    };
+
+private:
+    size_t m_budget;
+    size_t m_inflight;
+    std::exception_ptr m_error;
+    std::mutex m_mtx;
+    std::condition_variable m_cv;
+
+protected:
+    explicit sink(size_t budget) noexcept;
+
+    /** @brief Starts writing @p f. The implementation must pass it to done()
+     *      once it is finished with it, from any thread
+     */
+    virtual void start(std::unique_ptr<file> f) = 0;
+
+    /** @brief Whether streamed files are held whole until they are out, so
+     *      that all of them counts against the budget */
+    virtual bool holds_streams() const noexcept { return false; }
+
+    /** @brief Retires @p f, along with @p error if it failed */
+    void done(std::unique_ptr<file> f, std::exception_ptr error) noexcept;
+
+    /** @brief Blocks until nothing is in flight. Implementations call this
+     *      before tearing themselves down */
+    void drain() noexcept;
+
+public:
+    sink(const sink &) = delete;
+    sink &operator=(const sink &) = delete;
+
+    virtual ~sink();
+
+
+    /** @brief Sets the in-flight byte budget of every sink opened after this */
+    static void configure(size_t budget) noexcept;
+    static size_t budget() noexcept;
+
+    /** @brief Has open() return what @p make makes out of the budget from
+     *      now on, instead of a sink that writes files. Null goes back to
+     *      files */
+    static void configure(std::function<std::unique_ptr<sink>(size_t budget)> make);
+
+    /** @brief Opens the fastest sink this system supports, or whatever
+     *      configure was last given */
+    static std::unique_ptr<sink> open();
+
+
+    /** @brief Queues @p bufs to be written, in order, to a new file at @p path.
+     *      Blocks while the byte budget is used up; a single file larger than
+     *      the whole budget goes out on its own
+     *  @throws Whatever an earlier write failed with, so that a writer stops
+     *      encoding files that cannot land anyway
+     */
+    void write(const std::filesystem::path &path, std::vector<outbuf> bufs);
+
+    /** @brief Queues a file of @p bufs followed by whatever @p more produces,
+     *      @p more_len bytes of it. The sink only holds on to the buffer it is
+     *      writing, so a file far larger than memory streams through a few
+     *      buffers at a time
+     *  @param resident
+     *      How much of @p more is in memory at once, at most. Only that is
+     *      charged against the budget, unless the sink holds streams whole
+     */
+    void write(const std::filesystem::path &path, std::vector<outbuf> bufs, source more,
+               size_t more_len, size_t resident);
+
+    /** @brief Blocks until every file queued so far is written and closed
+     *  @throws The first error any of them ran into
+     */
+    void wait();
+};
+
+
+};
+
+
+#endif /* SINK_H */
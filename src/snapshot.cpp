@@ -0,0 +1,85 @@
+#include "snapshot.h"
+
+
+tomo::snapshot::snapshot() noexcept:
+    m_pos(nullptr),
+    m_end(nullptr),
+    m_reading(false)
+{
+
+}
+
+
+tomo::snapshot::snapshot(const void *data, size_t len) noexcept:
+    m_pos(static_cast<const char *>(data)),
+    m_end(static_cast<const char *>(data) + len),
+    m_reading(true)
+{
+
+}
+
+
+void tomo::snapshot::get(void *dst, size_t len)
+{
+    if ((size_t)(m_end - m_pos) < len) {
+        throw std::runtime_error("Snapshot is truncated");
+    }
+    memcpy(dst, m_pos, len);
+    m_pos += len;
+}
+
+
+size_t tomo::snapshot::io_size(size_t n)
+{
+    uint64_t len = n;
+
+    io_scalar(len);
+    /* Every element takes at least a byte, so this is a cheap sanity check
+    that keeps a corrupt count from allocating the world */
+    if (m_reading && len > (uint64_t)(m_end - m_pos)) {
+        throw std::runtime_error("Snapshot is corrupt");
+    }
+    return (size_t)len;
+}
+
+
+void tomo::snapshot::io(bool &b)
+{
+    uint8_t x = b;
+
+    io_scalar(x);
+    if (x > 1) {
+        throw std::runtime_error("Snapshot is corrupt");
+    }
+    b = x;
+}
+
+
+void tomo::snapshot::io(std::string &str)
+{
+    str.resize(io_size(str.size()));
+    if (m_reading) {
+        get(str.data(), str.size());
+    } else {
+        put(str.data(), str.size());
+    }
+}
+
+
+/** Eight bytes at a time, each folded in with a multiply and a rotate */
+uint64_t tomo::snapshot::hash(const void *data, size_t len) noexcept
+{
+    constexpr uint64_t k = 0x9e3779b97f4a7c15ull;
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    uint64_t h = len * k, w;
+
+    for (; len >= 8; p += 8, len -= 8) {
+        memcpy(&w, p, 8);
+        h = (h ^ w * k) * 0xff51afd7ed558ccdull;
+        h = h << 31 | h >> 33;
+    }
+    w = 0;
+    memcpy(&w, p, len);
+    h = (h ^ w * k) * 0xc4ceb9fe1a85ec53ull;
+    return h ^ h >> 29;
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "constructible.h"
+#include "lazy.h"
+#include "mapfile.h"
+
+
+namespace tomo {
+
+
+/** A binary image of a constructed model, so that an archive converted again
+ *  can skip the patient XML altogether. Each model class lists its members in
+ *  serialize() once, and the same list both writes and reads them:
+ *
+ *      void serialize(tomo::snapshot &snap) override { snap(m_a, m_b, m_c); }
+ *
+ *  Snapshots are in native byte order and are only ever read back by the
+ *  build that wrote them; see version
+ */
+class snapshot {
+public:
+    /** Bump this whenever any serialize() changes */
+    static constexpr uint32_t version = 2;
+
+private:
+    std::vector<char> m_out;    /* When writing */
+    const char *m_pos;          /* When reading */
+    const char *m_end;
+    bool m_reading;
+
+
+    void put(const void *src, size_t len) { m_out.insert(m_out.end(), (const char *)src, (const char *)src + len); }
+    void get(void *dst, size_t len);
+
+    template <class T>
+    void io_scalar(T &x)
+    {
+        if (m_reading) {
+            get(&x, sizeof x);
+        } else {
+            put(&x, sizeof x);
+        }
+    }
+
+    /** Element counts and string lengths */
+    size_t io_size(size_t n);
+
+public:
+    /** @brief Starts an empty snapshot to write to */
+    snapshot() noexcept;
+
+    /** @brief Reads back the snapshot in [@p data, @p data + @p len) */
+    snapshot(const void *data, size_t len) noexcept;
+
+
+    bool reading() const noexcept { return m_reading; }
+
+    /** @brief A 64-bit hash of [@p data, @p data + @p len), for telling if an
+     *      input changed. It is fast, not cryptographic */
+    static uint64_t hash(const void *data, size_t len) noexcept;
+
+
+    /** Everything written so far */
+    const std::vector<char> &bytes() const noexcept { return m_out; }
+
+    /** Whether every byte has been read */
+    bool exhausted() const noexcept { return m_pos == m_end; }
+
+
+    template <class T>
+    requires std::is_arithmetic_v<T>
+    void io(T &x) { io_scalar(x); }
+
+    void io(bool &b);
+    void io(std::string &str);
+    void io(constructible &cons) { cons.serialize(*this); }
+
+    template <class T, size_t N>
+    void io(std::array<T, N> &arr)
+    {
+        for (auto &x: arr) {
+            io(x);
+        }
+    }
+
+    template <class T>
+    void io(std::vector<T> &vec)
+    {
+        vec.resize(io_size(vec.size()));
+        for (auto &x: vec) {
+            io(x);
+        }
+    }
+
+    /** Only a subtree that has been read goes in, behind a flag, so writing
+     *  never reads one. One that did not comes back unread and unbound, and
+     *  must not be asked for; see tomo::archive::load_snapshot */
+    template <class T>
+    void io(lazy<T> &val)
+    {
+        bool ready = !m_reading && val.ready();
+        T tmp;
+
+        io(ready);
+        if (!ready) {
+            return;
+        }
+        if (m_reading) {
+            io(tmp);
+            val.assign(std::move(tmp));
+        } else {
+            io(const_cast<T &>(val.get()));
+        }
+    }
+
+
+    template <class... T>
+    void operator()(T &...vals) { (io(vals), ...); }
+};
+
+
+};
+
+
+#endif /* SNAPSHOT_H */
@@ -1,9 +1,15 @@
+#include <algorithm>
 #include <array>
+#include <charconv>
 #include <cstring>
 #include <unordered_map>
 #include "structures.h"
 #include "auxiliary.h"
 #include "error.h"
+#include "schema.h"
+#include "mapfile.h"
+#include "xmlscan.h"
+#include "snapshot.h"
 
 using namespace std::literals;
 
@@ -16,38 +22,45 @@ tomo::structset::structset()
 
 void tomo::structset::construct(pugi::xml_node root)
 {
-    tomo::xtable xtable;
+    static constexpr tomo::schema set_keys{
+        tomo::xkey<&structset::m_dbinfo>("dbInfo"),
+        tomo::xkey<&structset::m_label>("structureSetLabel"),
+        tomo::xkey<&structset::m_assoc_img>("associatedImage"),
+        tomo::xkey<&structset::m_mod_assoc_img>("modifiedAssociatedImage")
+    };
+    static constexpr tomo::schema roi_keys{
+        tomo::xkey<&structset::m_roilist>("troiList")
+    };
     pugi::xml_node node;
 
     node = xchild(root, "structureSet");
-    xtable.insert("dbInfo", dbinfo());
-    xtable.insert("structureSetLabel", label());
-    xtable.insert("associatedImage", associated_img());
-    xtable.insert("modifiedAssociatedImage", mod_associated_img());
-    xtable.search(node);
-    if (xtable.size()) {
-        throw missing_keys(node, xtable);
-    }
+    set_keys.require(node, set_keys.search(*this, node));
 
-    xtable.insert("troiList", xref(roilist(), "troiList"));
-    xtable.search(root);
-    if (xtable.size()) {
-        throw missing_keys(root, xtable);
-    }
+    roi_keys.require(root, roi_keys.search(*this, root));
+}
+
+
+void tomo::structset::serialize(tomo::snapshot &snap)
+{
+    snap(m_dbinfo, m_label, m_assoc_img, m_mod_assoc_img, m_roilist);
 }
 
 
 void tomo::roi::color::construct(pugi::xml_node root)
 {
-    tomo::xtable xtable;
+    static constexpr tomo::schema keys{
+        tomo::xkey<&color::red>("red"),
+        tomo::xkey<&color::green>("green"),
+        tomo::xkey<&color::blue>("blue")
+    };
 
-    xtable.insert("red", red);
-    xtable.insert("green", green);
-    xtable.insert("blue", blue);
-    xtable.search(root);
-    if (xtable.size()) {
-        throw missing_keys(root, xtable);
-    }
+    keys.require(root, keys.search(*this, root));
+}
+
+
+void tomo::roi::color::serialize(tomo::snapshot &snap)
+{
+    snap(red, green, blue);
 }
 
 
@@ -59,22 +72,27 @@ tomo::roi::roi()
 
 void tomo::roi::construct(pugi::xml_node root)
 {
-    tomo::xtable xtable;
+    static constexpr tomo::schema keys{
+        tomo::xkey<&roi::m_dbinfo>("dbInfo"),
+        tomo::xkey<&roi::m_structnum>("structureNumber"),
+        tomo::xkey<&roi::m_interpreted_type>("interpretedType"),
+        tomo::xkey<&roi::m_name>("name"),
+        tomo::xkey<&roi::m_color>("color"),
+        tomo::xkey<&roi::m_is_density_overridden>("isDensityOverridden"),
+        tomo::xkey<&roi::m_lies_on_interpolation>("liesOnInterpolatedSlices"),
+        tomo::xkey<&roi::m_is_displayed>("isDisplayed")
+    };
 
     filename() = xchild(root, "curveDataFile").text().as_string();
     root = xchild(root, "briefROI");
-    xtable.insert("dbInfo", dbinfo());
-    xtable.insert("structureNumber", number());
-    xtable.insert("interpretedType", interpreted_type());
-    xtable.insert("name", name());
-    xtable.insert("color", color());
-    xtable.insert("isDensityOverridden", is_density_overridden());
-    xtable.insert("liesOnInterpolatedSlices", lies_on_interpolation());
-    xtable.insert("isDisplayed", is_displayed());
-    xtable.search(root);
-    if (xtable.size()) {
-        throw missing_keys(root, xtable);
-    }
+    keys.require(root, keys.search(*this, root));
+}
+
+
+void tomo::roi::serialize(tomo::snapshot &snap)
+{
+    snap(m_dbinfo, m_structnum, m_is_density_overridden, m_lies_on_interpolation, m_is_displayed);
+    snap(m_color, m_interpreted_type, m_name, m_filename);
 }
 
 
@@ -90,105 +108,162 @@ void tomo::roi::curve::construct_attached_curves(pugi::xml_node root)
 }
 
 
-static float pop_float(const char *text, char **endptr, char delim)
+void tomo::roi::curve::construct_point_data(std::string_view str)
 {
-    float res;
-
-    /* Convert to millimeters here */
-    res = 10.0f * (float)strtod(text, endptr);
-    if (**endptr != delim) {
-        throw std::runtime_error("Malformed ROI curve triplet");
+    std::vector<float> &pts = data();
+    const size_t start = pts.size();
+    size_t i;
+
+    tomo::parse_triplets(str, pts);
+
+    /* Convert to millimeters here. They appear to use a coordinate system with
+    y and z flipped about an origin common to DICOM's patient-specific system.
+    I should fact-check this before deployment. This loop has no dependencies
+    between triplets, so it vectorizes. Only the new points, in case there
+    were some already */
+    for (i = start; i + 3 <= pts.size(); i += 3) {
+        pts[i] *= 10.0f;
+        pts[i + 1] *= -10.0f;
+        pts[i + 2] *= -10.0f;
     }
-    return res;
 }
 
 
-/** Pops a triplet into @p trip and advances @p text to the next triplet. At the
- *  end, sets @p text to NULL. If a triplet is not formatted correctly, this
- *  function throws a std::runtime_error
- */
-static void parse_triplet(const pugi::char_t  **text,
-                          std::array<float, 3> &trip)
+tomo::roi::curve::curve()
 {
-    pugi::char_t *endptr;
 
-    /* They appear to use a coordinate system with y and z flipped about an
-    origin common to DICOM's patient-specific system. I should fact-check this
-    before deployment */
-    trip[0] = pop_float(*text, &endptr, ',');
-    trip[1] = -pop_float(endptr + 1, &endptr, ',');
-    trip[2] = -pop_float(endptr + 1, &endptr, ';');
-    while (isspace(*++endptr)) { }
-    *text = (*endptr) ? endptr : nullptr;
 }
 
 
-void tomo::roi::curve::construct_point_data(pugi::xml_node root)
-/** We're doing this the (sorta) C way */
+void tomo::roi::curve::construct(pugi::xml_node root)
 {
-    std::array<float, 3> triplet;
-    const pugi::char_t *text;
+    static constexpr tomo::schema keys{
+        tomo::xkey<&curve::m_curveindex>("curveIndex"),
+        tomo::xkey<&curve::m_orient>("sliceOrientation"),
+        tomo::xkey<&curve::m_sliceval>("sliceValue"),
+        tomo::xkey<&curve::m_sliceindex>("slicePlaneIndex")
+    };
 
-    text = root.text().as_string(nullptr);
-    while (text) {
-        parse_triplet(&text, triplet);
-        for (float trip: triplet) {
-            data().push_back(trip);
-        }
-    }
+    construct_attached_curves(root.child("attachedCurves"));
+    construct_point_data(xchild(root, "pointData").text().get());
+
+    keys.require(root, keys.search(*this, root));
 }
 
 
-tomo::roi::curve::curve()
+void tomo::roi::curve::serialize(tomo::snapshot &snap)
 {
-
+    snap(m_trips, m_attached, m_orient, m_sliceval, m_curveindex, m_sliceindex);
 }
 
 
-void tomo::roi::curve::construct(pugi::xml_node root)
+/** Leading space and a plus sign are skipped, and anything unreadable is zero,
+ *  the same as pugixml's as_int and as_double */
+template <class NumT>
+static NumT text_num(std::string_view text)
 {
-    tomo::xtable xtable;
+    const char *p = text.data(), *end = text.data() + text.size();
+    NumT x = 0;
 
-    construct_attached_curves(root.child("attachedCurves"));
-    construct_point_data(xchild(root, "pointData"));
-
-    xtable.insert("curveIndex", curve_index());
-    xtable.insert("sliceOrientation", orientation());
-    xtable.insert("sliceValue", slice_value());
-    xtable.insert("slicePlaneIndex", slice_index());
-    xtable.search(root);
-    if (xtable.size()) {
-        throw missing_keys(root, xtable);
+    while (p < end && isspace((unsigned char)*p)) {
+        p++;
+    }
+    if (p < end && *p == '+') {
+        p++;
     }
+    std::from_chars(p, end, x);
+    return x;
 }
 
 
-std::vector<tomo::roi::curve>
-tomo::roi::load_file(const std::filesystem::path &dir) const
+void tomo::roi::read_curves(const std::filesystem::path             &dir,
+                            const std::function<void(const curve &)> &emit) const
 {
-    const pugi::string_t prefix = "ROICurve_"s;
+    /* The children of each curve, in the order of the bits in "seen" */
+    static constexpr std::string_view fields[] = {
+        "curveIndex", "sliceOrientation", "sliceValue", "slicePlaneIndex", "pointData"
+    };
+    static constexpr unsigned all = (1u << std::size(fields)) - 1;
+    constexpr std::string_view prefix = "ROICurve_";
     std::filesystem::path path = dir;
-    pugi::xml_parse_result res;
-    std::vector<curve> curves;
-    pugi::xml_document doc;
-    pugi::xml_node root;
-    pugi::string_t name;
-    tomo::xtable xtable;
+    std::string_view name;
+    tomo::mapfile file;
+    unsigned seen = 0;
+    bool in_curve = false, attached = false;
+    size_t i;
+    curve crv;
 
     path.append(filename());
-    res = doc.load_file(path.string().c_str());
-    if (!res) {
-        throw parse_error(res, path);
-    }
-    root = xchild(doc.root(), "ROICurves");
-    for (pugi::xml_node node: root.children()) {
-        name = node.name();
-        if (prefixed(name, prefix)) {
-            curves.push_back({ });
-            curves.back().construct(node);
+    file = tomo::mapfile(path);
+    tomo::xmlscan scan(file.data(), file.size());
+
+    /* Depth 1 is ROICurves, 2 is each curve, and 3 is each field of a curve */
+    for (;;) {
+        switch (scan.next()) {
+        case tomo::xmlscan::OPEN:
+            name = scan.name();
+            if (scan.depth() == 1 && name != "ROICurves") {
+                throw std::runtime_error("ROI curve file " + path.string() + " has no ROICurves");
+            } else if (scan.depth() == 2 && name.substr(0, prefix.size()) == prefix) {
+                in_curve = true;
+                seen = 0;
+                crv.data().clear();
+                crv.attached_curves().clear();
+            } else if (scan.depth() == 3 && in_curve) {
+                attached = name == "attachedCurves";
+            } else if (scan.depth() == 4 && in_curve && attached) {
+                throw std::runtime_error("attachedCurves subtree is not empty!");
+            }
+            break;
+
+        case tomo::xmlscan::CLOSE:
+            name = scan.name();
+            if (scan.depth() == 3 && in_curve) {
+                for (i = 0; i < std::size(fields) && fields[i] != name; i++) { }
+                if (i < std::size(fields) && !(seen & 1u << i)) {
+                    seen |= 1u << i;
+                    switch (i) {
+                    case 0:
+                        crv.curve_index() = text_num<int>(scan.text());
+                        break;
+                    case 1:
+                        crv.orientation() = scan.text();
+                        break;
+                    case 2:
+                        crv.slice_value() = text_num<double>(scan.text());
+                        break;
+                    case 3:
+                        crv.slice_index() = text_num<int>(scan.text());
+                        break;
+                    case 4:
+                        crv.construct_point_data(scan.text());
+                        break;
+                    }
+                } else if (attached && scan.text().find_first_not_of(" \t\r\n") != std::string_view::npos) {
+                    throw std::runtime_error("attachedCurves subtree is not empty!");
+                }
+                attached = false;
+            } else if (scan.depth() == 2 && in_curve) {
+                in_curve = false;
+                if (seen != all) {
+                    std::string msg = "ROI curve " + std::string(name) + " is missing keys:";
+
+                    for (i = 0; i < std::size(fields); i++) {
+                        if (!(seen & 1u << i)) {
+                            msg += ' ';
+                            msg += fields[i];
+                        }
+                    }
+                    throw std::runtime_error(msg);
+                }
+                emit(crv);
+            }
+            break;
+
+        case tomo::xmlscan::DONE:
+            return;
         }
     }
-    return curves;
 }
 
 
@@ -4,8 +4,11 @@
 #define STRUCTURES_H
 
 #include <filesystem>
+#include <functional>
+#include <string_view>
 #include <vector>
 #include "constructible.h"
+#include "lazy.h"
 #include "dbinfo.h"
 
 
@@ -22,7 +25,7 @@ class structset: public constructible {
     std::string m_assoc_img;
     std::string m_mod_assoc_img;
 
-    std::vector<tomo::roi> m_roilist;
+    tomo::lazy<std::vector<tomo::roi>> m_roilist;  /* Read on first use */
 
 
     tomo::dbinfo &dbinfo() noexcept { return m_dbinfo; }
@@ -31,16 +34,13 @@ class structset: public constructible {
     std::string &associated_img() noexcept { return m_assoc_img; }
     std::string &mod_associated_img() noexcept { return m_mod_assoc_img; }
 
-    tomo::roi &roi(size_t i) noexcept { return roilist()[i]; }
-
-    std::vector<tomo::roi> &roilist() noexcept { return m_roilist; }
-
 public:
     structset();
 
     /** From "fullStructureSetDataArray" (lower) (must contain structureSet and
      *  troiList subtrees) */
     virtual void construct(pugi::xml_node root) override;
+    virtual void serialize(tomo::snapshot &snap) override;
 
 
     const tomo::dbinfo &dbinfo() const noexcept { return m_dbinfo; }
@@ -49,16 +49,18 @@ public:
     const std::string &associated_img() const noexcept { return m_assoc_img; }
     const std::string &mod_associated_img() const noexcept { return m_mod_assoc_img; }
 
-    size_t nrois() const noexcept { return roilist().size(); }
-    const tomo::roi &roi(size_t i) const noexcept { return roilist()[i]; }
+    size_t nrois() const { return roilist().size(); }
+    const tomo::roi &roi(size_t i) const { return roilist()[i]; }
 
-    const std::vector<tomo::roi> &roilist() const noexcept { return m_roilist; }
+    const std::vector<tomo::roi> &roilist() const { return *m_roilist; }
 };
 
 
 class roi: public constructible {
 public:
     class curve: public constructible {
+        friend class roi;   /* Which streams them out of curve files */
+
         std::vector<float> m_trips;
         std::vector<int> m_attached;
 
@@ -76,7 +78,8 @@ public:
          */
         void construct_attached_curves(pugi::xml_node root);
 
-        void construct_point_data(pugi::xml_node root);
+        /** Triplets look like "x,y,z;" with any amount of space after each */
+        void construct_point_data(std::string_view text);
 
         std::string &orientation() noexcept { return m_orient; }
 
@@ -94,6 +97,7 @@ public:
 
         /** From the root node "ROICurve_*" */
         virtual void construct(pugi::xml_node root) override;
+        virtual void serialize(tomo::snapshot &snap) override;
 
 
         const std::string &orientation() const noexcept { return m_orient; }
@@ -122,6 +126,7 @@ public:
         int red, green, blue;
 
         virtual void construct(pugi::xml_node root) override;
+        virtual void serialize(tomo::snapshot &snap) override;
     };
 
 private:
@@ -162,9 +167,19 @@ public:
 
     /** From the root node "troiList" (lower) */
     virtual void construct(pugi::xml_node root) override;
+    virtual void serialize(tomo::snapshot &snap) override;
 
 
-    std::vector<curve> load_file(const std::filesystem::path &dir) const;
+    /** @brief Streams each curve in this ROI's curve file under @p dir to
+     *      @p emit, in file order. The file is read in a single pass without
+     *      building a DOM, and the same curve object is refilled for every
+     *      curve, so memory does not grow with the number of curves
+     *  @throws std::runtime_error if the file cannot be mapped or is malformed,
+     *      or if a curve is missing a required key. Whatever @p emit throws
+     *      is passed through
+     */
+    void read_curves(const std::filesystem::path             &dir,
+                     const std::function<void(const curve &)> &emit) const;
 
     const tomo::dbinfo &dbinfo() const noexcept { return m_dbinfo; }
 
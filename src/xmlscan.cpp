@@ -0,0 +1,211 @@
+#include <cstring>
+#include <stdexcept>
+#include "xmlscan.h"
+
+using namespace std::literals;
+
+
+static bool starts_with(const char *pos, const char *end, std::string_view prefix) noexcept
+{
+    return (size_t)(end - pos) >= prefix.size() && !memcmp(pos, prefix.data(), prefix.size());
+}
+
+
+static bool is_space(char c) noexcept
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+
+static void put_utf8(std::string &out, unsigned long cp)
+{
+    if (cp < 0x80) {
+        out += (char)cp;
+    } else if (cp < 0x800) {
+        out += (char)(0xc0 | cp >> 6);
+        out += (char)(0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        out += (char)(0xe0 | cp >> 12);
+        out += (char)(0x80 | (cp >> 6 & 0x3f));
+        out += (char)(0x80 | (cp & 0x3f));
+    } else {
+        out += (char)(0xf0 | cp >> 18);
+        out += (char)(0x80 | (cp >> 12 & 0x3f));
+        out += (char)(0x80 | (cp >> 6 & 0x3f));
+        out += (char)(0x80 | (cp & 0x3f));
+    }
+}
+
+
+tomo::xmlscan::xmlscan(const void *data, size_t len) noexcept:
+    m_pos(static_cast<const char *>(data)),
+    m_end(static_cast<const char *>(data) + len),
+    m_level(0),
+    m_depth(0),
+    m_owned(false),
+    m_selfclose(false)
+{
+
+}
+
+
+void tomo::xmlscan::malformed(const char *what) const
+{
+    throw std::runtime_error("Malformed XML: "s + what);
+}
+
+
+void tomo::xmlscan::skip_past(std::string_view delim)
+{
+    std::string_view rest(m_pos, m_end - m_pos);
+    size_t at;
+
+    at = rest.find(delim);
+    if (at == rest.npos) {
+        malformed("document ends inside markup");
+    }
+    m_pos += at + delim.size();
+}
+
+
+void tomo::xmlscan::append(const char *begin, const char *end, bool cdata)
+{
+    const char *amp, *semi;
+    unsigned long cp;
+    char *num_end;
+
+    if (begin == end) {
+        return;
+    }
+    if (!cdata && !m_owned && m_text.empty() && !memchr(begin, '&', end - begin)) {
+        /* The usual case, which copies nothing */
+        m_text = std::string_view(begin, end - begin);
+        return;
+    }
+    if (!m_owned) {
+        m_buf.assign(m_text);
+        m_owned = true;
+    }
+    if (cdata) {
+        m_buf.append(begin, end);
+        m_text = m_buf;
+        return;
+    }
+    while ((amp = static_cast<const char *>(memchr(begin, '&', end - begin)))) {
+        m_buf.append(begin, amp);
+        semi = static_cast<const char *>(memchr(amp, ';', end - amp));
+        if (!semi) {
+            malformed("unterminated entity reference");
+        }
+        std::string_view ent(amp + 1, semi - amp - 1);
+        if (ent == "lt"sv) {
+            m_buf += '<';
+        } else if (ent == "gt"sv) {
+            m_buf += '>';
+        } else if (ent == "amp"sv) {
+            m_buf += '&';
+        } else if (ent == "quot"sv) {
+            m_buf += '"';
+        } else if (ent == "apos"sv) {
+            m_buf += '\'';
+        } else if (ent.size() > 1 && ent[0] == '#') {
+            if (ent[1] == 'x') {
+                cp = strtoul(amp + 3, &num_end, 16);
+            } else {
+                cp = strtoul(amp + 2, &num_end, 10);
+            }
+            if (num_end != semi || cp > 0x10ffff) {
+                malformed("bad character reference");
+            }
+            put_utf8(m_buf, cp);
+        } else {
+            malformed("unknown entity reference");
+        }
+        begin = semi + 1;
+    }
+    m_buf.append(begin, end);
+    m_text = m_buf;
+}
+
+
+tomo::xmlscan::event tomo::xmlscan::next()
+{
+    const char *lt, *p;
+    char quote;
+
+    if (m_selfclose) {
+        m_selfclose = false;
+        m_text = { };
+        m_depth = m_level--;
+        return CLOSE;
+    }
+    m_text = { };
+    m_owned = false;
+    m_buf.clear();
+    for (;;) {
+        lt = static_cast<const char *>(memchr(m_pos, '<', m_end - m_pos));
+        if (!lt) {
+            if (m_level) {
+                malformed("document ends inside an element");
+            }
+            m_pos = m_end;
+            return DONE;
+        }
+        append(m_pos, lt, false);
+        m_pos = lt;
+
+        if (starts_with(m_pos, m_end, "<?"sv)) {
+            skip_past("?>"sv);
+
+        } else if (starts_with(m_pos, m_end, "<!--"sv)) {
+            skip_past("-->"sv);
+
+        } else if (starts_with(m_pos, m_end, "<![CDATA["sv)) {
+            p = m_pos + 9;
+            m_pos = p;
+            skip_past("]]>"sv);
+            append(p, m_pos - 3, true);
+
+        } else if (starts_with(m_pos, m_end, "<!"sv)) {
+            /* A doctype, without an internal subset */
+            skip_past(">"sv);
+
+        } else if (starts_with(m_pos, m_end, "</"sv)) {
+            p = m_pos + 2;
+            skip_past(">"sv);
+            for (lt = p; lt < m_pos - 1 && !is_space(*lt); lt++) { }
+            m_name = std::string_view(p, lt - p);
+            if (!m_level) {
+                malformed("closing tag outside of any element");
+            }
+            if (m_owned) {
+                m_text = m_buf;
+            }
+            m_depth = m_level--;
+            return CLOSE;
+
+        } else {
+            p = ++m_pos;
+            while (m_pos < m_end && !is_space(*m_pos) && *m_pos != '/' && *m_pos != '>') {
+                m_pos++;
+            }
+            m_name = std::string_view(p, m_pos - p);
+            /* Attribute values may hold a '>' */
+            for (quote = 0; m_pos < m_end && (quote || *m_pos != '>'); m_pos++) {
+                if (quote && *m_pos == quote) {
+                    quote = 0;
+                } else if (!quote && (*m_pos == '"' || *m_pos == '\'')) {
+                    quote = *m_pos;
+                }
+            }
+            if (m_pos == m_end || m_name.empty()) {
+                malformed("bad start tag");
+            }
+            m_selfclose = m_pos[-1] == '/';
+            m_pos++;
+            m_text = { };
+            m_depth = ++m_level;
+            return OPEN;
+        }
+    }
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#ifndef XMLSCAN_H
+#define XMLSCAN_H
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+
+namespace tomo {
+
+
+/** A single forward pass over an XML document in memory, for files too big
+ *  to be worth a DOM. Elements come out as they open and close, with the text
+ *  directly inside each one handed over when it closes. Attributes, comments,
+ *  processing instructions and the doctype are skipped
+ *
+ *  Text is a view into the document itself unless it had to be decoded, i.e.
+ *  it holds entity references or CDATA sections, or is split by comments. Each
+ *  view lasts until the next call to next()
+ */
+class xmlscan {
+public:
+    enum event {
+        OPEN,
+        CLOSE,
+        DONE
+    };
+
+private:
+    const char *m_pos;
+    const char *m_end;
+
+    size_t m_level;         /* Elements open right now */
+    size_t m_depth;
+
+    std::string_view m_name;
+    std::string_view m_text;
+    std::string m_buf;      /* Decoded text, when it cannot be a plain view */
+    bool m_owned;           /* Whether m_text lives in m_buf */
+    bool m_selfclose;       /* The last OPEN was <empty/> */
+
+
+    /** Adds raw document text, or the contents of a CDATA section if @p cdata */
+    void append(const char *begin, const char *end, bool cdata);
+
+    /** Skips to just past @p delim
+     *  @throws std::runtime_error if the document ends first */
+    void skip_past(std::string_view delim);
+
+    [[noreturn]] void malformed(const char *what) const;
+
+public:
+    xmlscan(const void *data, size_t len) noexcept;
+
+    xmlscan(const xmlscan &) = delete;
+    xmlscan &operator=(const xmlscan &) = delete;
+
+
+    /** @brief Reads up to the next element boundary
+     *  @returns DONE at the end of the document
+     *  @throws std::runtime_error if the document is cut short, has more
+     *      closing tags than opening ones, or has an entity it does not know.
+     *      Closing tags are not checked against the names they close
+     */
+    event next();
+
+
+    /** Name of the element that was just opened or closed */
+    std::string_view name() const noexcept { return m_name; }
+
+    /** On CLOSE, the text of the element since its last child closed. For
+     *  leaf elements, that is all of it */
+    std::string_view text() const noexcept { return m_text; }
+
+    /** Depth of the element that was just opened or closed. The root is 1 */
+    size_t depth() const noexcept { return m_depth; }
+};
+
+
+};
+
+
+#endif /* XMLSCAN_H */